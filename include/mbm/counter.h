@@ -1,6 +1,8 @@
 #ifndef _MBM_COUNTER_H_
 #define _MBM_COUNTER_H_
 
+#include <linux/topology.h>
+
 #include "mbm/types.h"
 #include "../src/config.h"
 
@@ -51,6 +53,42 @@ static __always_inline mbm_counter_error_t mbm_read_event(u32 rmid, u32 event, u
     return MBM_COUNTER_READ_SUCCESS;
 }
 
+/*
+ * Widen a raw bandwidth count of an RMID, read on this CPU, into a 64-bit
+ * count that does not wrap. The counters are per L3 domain, approximated by
+ * the node, and CPUs of a node may update the same entry concurrently: a raw
+ * value older than the entry (a backwards step of more than half the counter
+ * range) returns the entry unchanged. Reads must come at least twice per wrap,
+ * i.e. every few ms at full bandwidth with a 24-bit counter.
+ */
+static __always_inline u64 mbm_widen(u32 rmid, u32 wide_event, u64 raw) {
+    u64 mask = g_mbm_mgr.counter_mask;
+    u64 *wide = &g_mbm_mgr.wide[((u64)numa_node_id() * (g_mbm_mgr.max_rmid + 1) +
+                                 rmid) * MBM_N_WIDE_EVENTS + wide_event];
+    u64 old = READ_ONCE(*wide);
+
+    for (;;) {
+        u64 new, prev;
+        if (old == 0) {
+            new = raw;
+        } else {
+            u64 delta = (raw - old) & mask;
+            if (delta > mask / 2) {
+                return old;
+            }
+            new = old + delta;
+        }
+        if (new == old) {
+            return old;
+        }
+        prev = cmpxchg(wide, old, new);
+        if (prev == old) {
+            return new;
+        }
+        old = prev;
+    }
+}
+
 /* Read all MBM counters for a given RMID and store in mbm_counter_data_t */
 static __always_inline void mbm_read_counters(void* info) {
     mbm_counter_data_t* data = (mbm_counter_data_t*)info;
@@ -63,6 +101,7 @@ static __always_inline void mbm_read_counters(void* info) {
         data->status = err;
         return;
     }
+    data->total_bw = mbm_widen(data->rmid, MBM_WIDE_TOTAL_BW, data->total_bw);
 
 #if HRP_RDT_INCLUDE_LOCAL_BW
     err = mbm_read_event(data->rmid, MBM_EVENT_L3_LOCAL_BW, &data->local_bw);
@@ -70,6 +109,7 @@ static __always_inline void mbm_read_counters(void* info) {
         data->status = err;
         return;
     }
+    data->local_bw = mbm_widen(data->rmid, MBM_WIDE_LOCAL_BW, data->local_bw);
 #endif
 
     err = mbm_read_event(data->rmid, MBM_EVENT_L3_OCCUP, &data->occupancy);
@@ -89,31 +129,6 @@ static __always_inline void mbm_guard_exit(void) {
     spin_unlock(&g_rmid_mgr->lock);
 }
 
-static __always_inline void mbm_poll_all_cores(void) {
-    struct rmid_manager *g_rmid_mgr = &g_mbm_mgr.rmid_mgr;
-    for (int idx= 0; idx < MAX_CORES; idx++) {
-        struct rmid_info *info = &g_rmid_mgr->rmid_table[idx];
-        if (info->in_use) {
-            mbm_counter_data_t data;
-            data.status = MBM_COUNTER_READ_SUCCESS;
-            data.rmid = info->rmid;
-            mbm_read_counters(&data);
-            if (data.status == MBM_COUNTER_READ_SUCCESS) {
-                info->last_local_bw = info->new_local_bw;
-                info->last_total_bw = info->new_total_bw;
-                info->last_occupancy = info->new_occupancy;
-
-                info->new_local_bw = data.local_bw;
-                info->new_total_bw = data.total_bw;
-                info->new_occupancy = data.occupancy;
-            } else {
-                pr_warn("Core %d RMID %u: Failed to read counters, status: %d\n",
-                        info->core_id, data.rmid, data.status);
-            }
-        }
-    }
-}
-
 static __always_inline struct rmid_info* mbm_get_rmid_info_for_core(u32 core_id) {
     struct rmid_manager *g_rmid_mgr = &g_mbm_mgr.rmid_mgr;
     if (core_id >= MAX_CORES) {
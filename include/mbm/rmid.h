@@ -20,6 +20,10 @@ int mbm_rmid_clear_assoc(void);
 int mbm_rmid_allocate_all_cores(void);
 void mbm_rmid_deallocate_all(void);
 u32 mbm_rmid_get_for_core(u32 core_id);
+int mbm_rmid_set_tag(u32 kind, u64 id, u32 rmid);
+u32 mbm_rmid_for_task(struct task_struct *task);
+int mbm_rmid_poll_node(int node, mbm_counter_data_t *data, u32 *core_ids,
+                       int max);
 
 static __always_inline void mbm_set_rmid(u32 rmid) {
   u64 val;
@@ -5,6 +5,8 @@
 #include <linux/spinlock.h>
 #include <linux/types.h>
 
+#include "../src/config.h"
+
 /* MSR field definitions */
 #define PQR_ASSOC_RMID_MASK 0x3FF
 #define QM_EVTSEL_RMID_SHIFT 32
@@ -13,16 +15,24 @@
 #define QM_CTR_DATA_MASK 0x3FFFFFFFFFFFFFFFULL
 #define QM_CTR_ERROR_MASK (1ULL << 63)
 #define QM_CTR_UNAVAIL_MASK (1ULL << 62)
+#define QM_CTR_MIN_WIDTH 24
 
 /* MBM event types */
 #define MBM_EVENT_L3_OCCUP 0x01
 #define MBM_EVENT_L3_TOTAL_BW 0x02
 #define MBM_EVENT_L3_LOCAL_BW 0x03
 
+/* Bandwidth events widened to 64 bits, index in mbm_manager.wide */
+#define MBM_WIDE_TOTAL_BW 0
+#define MBM_WIDE_LOCAL_BW 1
+#define MBM_N_WIDE_EVENTS 2
+
 /* Maximum supported values */
 #define MAX_RMID 1023
 #define MAX_CORES 255
 #define DEFAULT_MAX_RMID 255
+#define MAX_RMID_TAGS 64
+#define MBM_NO_CORE 0xFFFF
 
 #define LOWER_32(val) ((u32)((val) & 0xFFFFFFFFULL))
 #define UPPER_32(val) ((u32)(((val) >> 32) & 0xFFFFFFFFULL))
@@ -40,11 +50,20 @@ struct rmid_info {
   u64 new_occupancy;
 };
 
+/* RMID of a thread, process or cgroup, read locklessly at context switches */
+struct rmid_tag {
+  u32 kind; // HRP_RDT_TAG_*
+  u32 rmid; // RMID0 when the slot is free
+  u64 id;
+};
+
 /* Global RMID management structure */
 struct rmid_manager {
   u32 num_cores;
   struct rmid_info *rmid_table;
   u8 core_to_rmid_map[MAX_CORES]; // Map core_id to rmid table index
+  struct rmid_tag tags[MAX_RMID_TAGS];
+  u32 n_tags[HRP_RDT_N_TAG_KINDS]; // tags of each kind, to skip the lookups
   spinlock_t lock;
 };
 
@@ -61,6 +80,12 @@ typedef struct mbm_manager {
   } cap;
   u32 scaling_factor;
   u32 max_rmid;
+  u64 counter_mask; // valid bits of QM_CTR, from cap.counter_width
+  /*
+   * Last widened count of each node, RMID and bandwidth event. The low
+   * counter_width bits are the last raw value, 0 until the first read.
+   */
+  u64 *wide;
 } mbm_manager_t;
 
 #endif /* _MBM_TYPES_H_ */
@@ -0,0 +1,255 @@
+"""Reader of the header at the start of hiresperf logs, and of the entries
+that follow it.
+
+Keep in sync with hrp_log_header_t and hrp_log_block_t in src/config.h. Logs
+of older builds have no header, read_log_header returns None for them and the
+parsers fall back to their command line flags.
+"""
+import glob
+import os
+import struct
+import numpy as np
+
+HRP_LOG_HEADER_MAGIC = b"HRPERFLG"
+HRP_LOG_HEADER_VERSION = 2
+
+HRP_LOG_CLOCK_REAL = 0
+HRP_LOG_CLOCK_RAW = 1
+HRP_LOG_CLOCK_TSC = 2
+HRP_LOG_CLOCK_NAMES = {
+    HRP_LOG_CLOCK_REAL: "ktime_get_real",
+    HRP_LOG_CLOCK_RAW: "ktime_get_raw",
+    HRP_LOG_CLOCK_TSC: "tsc",
+}
+HRP_LOG_FORMAT_RAW = 0
+HRP_LOG_FORMAT_COMPACT = 1
+HRP_LOG_FORMAT_NAMES = {HRP_LOG_FORMAT_RAW: "raw", HRP_LOG_FORMAT_COMPACT: "compact"}
+HRP_LOG_BLOCK_MAGIC = 0x42505248
+HRP_LOG_SAMPLING_INSTRUCTED = 0xFFFFFFFF
+HRP_LOG_SAMPLING_NAMES = {0: "ipi", 1: "hrtimer", 2: "overflow"}
+
+# magic, 12 u32 from version to format, 4 u64 from tsc_khz to start_kts
+_FIXED = struct.Struct("<8s12I4Q")
+# magic, cpu_id, n_entries, payload size
+_BLOCK = struct.Struct("<IiII")
+_FIELD = struct.Struct("<24sII")
+_EVENT = struct.Struct("<QQII")
+
+
+def read_log_header(path: str):
+    """Return the header of a log as a dict, or None if it has none.
+
+    "events" is {group: {pmc: (evtsel, offcore_rsp, name_id)}} with the
+    enabled counters only, like the event selections recorded as markers.
+    """
+    with open(path, "rb") as f:
+        fixed = f.read(_FIXED.size)
+        if len(fixed) < _FIXED.size or fixed[:8] != HRP_LOG_HEADER_MAGIC:
+            return None
+        (
+            _,
+            version,
+            header_size,
+            entry_size,
+            n_fields,
+            max_fields,
+            cpu_mask_words,
+            max_groups,
+            n_gp_events,
+            clock,
+            sampling_mode,
+            sampling_period,
+            log_format,
+            tsc_khz,
+            rdt_scale,
+            start_walltime_ns,
+            start_kts,
+        ) = _FIXED.unpack(fixed)
+        rest = f.read(header_size - _FIXED.size)
+
+    if version > HRP_LOG_HEADER_VERSION:
+        print(
+            f"Warning: log header version {version} is newer than this parser ({HRP_LOG_HEADER_VERSION})."
+        )
+
+    off = 0
+    fields = []
+    for i in range(n_fields):
+        name, offset, size = _FIELD.unpack_from(rest, off + i * _FIELD.size)
+        fields.append((name.split(b"\0", 1)[0].decode(), offset, size))
+    off += max_fields * _FIELD.size
+
+    mask = struct.unpack_from(f"<{cpu_mask_words}Q", rest, off)
+    cpus = [w * 64 + b for w, word in enumerate(mask) for b in range(64) if word >> b & 1]
+    off += cpu_mask_words * 8
+
+    n_groups, rotate_samples = struct.unpack_from("<II", rest, off)
+    off += 8
+    events = {}
+    for g in range(min(n_groups, max_groups)):
+        group = {}
+        for pmc in range(n_gp_events):
+            evtsel, offcore_rsp, name_id, _ = _EVENT.unpack_from(
+                rest, off + (g * n_gp_events + pmc) * _EVENT.size
+            )
+            if evtsel != 0:
+                group[pmc] = (evtsel, offcore_rsp, name_id)
+        events[g] = group
+
+    return {
+        "version": version,
+        "header_size": header_size,
+        "entry_size": entry_size,
+        "fields": fields,
+        "clock": clock,
+        "sampling_mode": sampling_mode,
+        "sampling_period": sampling_period,
+        "format": log_format,
+        "tsc_per_us": tsc_khz / 1e3,
+        "rdt_scale": rdt_scale,
+        "start_walltime_ns": start_walltime_ns,
+        "start_kts": start_kts,
+        "cpus": cpus,
+        "rotate_samples": rotate_samples,
+        "events": events,
+    }
+
+
+def log_dtype(header: dict) -> np.dtype:
+    """NumPy dtype of the log entries described by a header."""
+    return np.dtype(
+        {
+            "names": [name for name, _, _ in header["fields"]],
+            "formats": [
+                np.int32 if name == "cpu_id" else np.uint32 if size == 4 else np.uint64
+                for name, _, size in header["fields"]
+            ],
+            "offsets": [offset for _, offset, _ in header["fields"]],
+            "itemsize": header["entry_size"],
+        }
+    )
+
+
+def _decode_varints(buf: np.ndarray) -> np.ndarray:
+    """Values of the LEB128 varints packed back to back in a uint8 array."""
+    last = buf < 0x80
+    ends = np.flatnonzero(last)
+    # the varint each byte belongs to, and the byte's position in it
+    vid = np.zeros(buf.size, dtype=np.int64)
+    vid[1:] = np.cumsum(last[:-1])
+    starts = np.concatenate(([0], ends[:-1] + 1))
+    pos = np.arange(buf.size) - starts[vid]
+    low = (buf & 0x7F).astype(np.uint64)
+    values = np.zeros(ends.size, dtype=np.uint64)
+    for k in range(10):
+        at = pos == k
+        if not at.any():
+            break
+        values[vid[at]] |= low[at] << np.uint64(7 * k)
+    return values
+
+
+def _read_compact_entries(path: str, header: dict) -> np.ndarray:
+    """Decode the blocks of a compact log into raw entries."""
+    offsets = {name: offset for name, offset, _ in header["fields"]}
+    has_seq = "seq" in offsets
+    tick_offset = offsets["timestamp"]
+    n_words = has_seq + (header["entry_size"] - tick_offset) // 8
+
+    with open(path, "rb") as f:
+        f.seek(header["header_size"])
+        data = np.fromfile(f, dtype=np.uint8)
+
+    cpu_ids, counts, payloads = [], [], []
+    pos = 0
+    while pos + _BLOCK.size <= data.size:
+        magic, cpu_id, n_entries, size = _BLOCK.unpack_from(data, pos)
+        end = pos + _BLOCK.size + size
+        if magic != HRP_LOG_BLOCK_MAGIC or end > data.size:
+            print(
+                f"Warning: bad or truncated block at offset {header['header_size'] + pos}, ignoring the rest of the log."
+            )
+            break
+        if n_entries > 0:
+            cpu_ids.append(cpu_id)
+            counts.append(n_entries)
+            payloads.append(data[pos + _BLOCK.size : end])
+        pos = end
+    if not counts:
+        return np.zeros(0, dtype=log_dtype(header))
+
+    words = _decode_varints(np.concatenate(payloads))
+    counts = np.array(counts)
+    if words.size != counts.sum() * n_words:
+        raise ValueError("compact log blocks do not match the entry layout in the header")
+    words = words.reshape(-1, n_words)
+
+    # the first entry of each block is plain, the others are zigzag-encoded
+    # differences to the entry before; sum them up and restart at each block
+    first = np.cumsum(counts) - counts
+    values = (words >> np.uint64(1)) ^ -(words & np.uint64(1))
+    values[first] = words[first]
+    values = np.cumsum(values, axis=0, dtype=np.uint64)
+    base = np.zeros((counts.size, n_words), dtype=np.uint64)
+    base[1:] = values[first[1:] - 1]
+    values -= np.repeat(base, counts, axis=0)
+
+    raw = np.zeros((len(values), header["entry_size"]), dtype=np.uint8)
+    cpu = np.repeat(np.array(cpu_ids, dtype=np.int32), counts)
+    raw[:, offsets["cpu_id"] : offsets["cpu_id"] + 4] = cpu.view(np.uint8).reshape(-1, 4)
+    if has_seq:
+        seq = values[:, 0].astype(np.uint32)
+        raw[:, offsets["seq"] : offsets["seq"] + 4] = seq.view(np.uint8).reshape(-1, 4)
+    tick = np.ascontiguousarray(values[:, int(has_seq) :])
+    raw[:, tick_offset:] = tick.view(np.uint8).reshape(len(values), -1)
+    return raw.reshape(-1).view(log_dtype(header))
+
+
+def read_log_entries(path: str, header: dict) -> np.ndarray:
+    """All entries of a log with a header, in the layout of log_dtype."""
+    if header["format"] == HRP_LOG_FORMAT_COMPACT:
+        return _read_compact_entries(path, header)
+    if header["format"] != HRP_LOG_FORMAT_RAW:
+        raise ValueError(f"unknown log format {header['format']}")
+    return np.fromfile(path, dtype=log_dtype(header), offset=header["header_size"])
+
+
+def log_paths(path: str) -> list:
+    """The per-node logs in a directory (HRP_LOG_PER_NODE), or the log itself."""
+    if os.path.isdir(path):
+        return sorted(glob.glob(os.path.join(path, "hrperf_log*.bin")))
+    return [path]
+
+
+def read_merged_log_entries(paths: list, header: dict) -> np.ndarray:
+    """Entries of the logs of one run, e.g. one file per node, in one array.
+
+    All logs must have the layout of `header`; the parsers sort the entries by
+    CPU and timestamp, so the order of the files does not matter.
+    """
+    parts = []
+    for path in paths:
+        h = read_log_header(path)
+        if h is None or h["fields"] != header["fields"] or h["entry_size"] != header["entry_size"]:
+            raise ValueError(f"{path} does not have the entry layout of {paths[0]}")
+        parts.append(read_log_entries(path, h))
+    return np.concatenate(parts)
+
+
+def has_field(header: dict, name: str) -> bool:
+    return any(f == name for f, _, _ in header["fields"])
+
+
+def describe_log_header(header: dict) -> str:
+    mode = header["sampling_mode"]
+    if mode == HRP_LOG_SAMPLING_INSTRUCTED:
+        sampling = "instructed"
+    else:
+        sampling = f"{HRP_LOG_SAMPLING_NAMES.get(mode, mode)} (period {header['sampling_period']})"
+    cpus = header["cpus"]
+    return (
+        f"log header v{header['version']}: {len(header['fields'])} fields, "
+        f"entry size {header['entry_size']}, {HRP_LOG_FORMAT_NAMES.get(header['format'], header['format'])} format, clock {HRP_LOG_CLOCK_NAMES.get(header['clock'], header['clock'])}, "
+        f"TSC {header['tsc_per_us']:.3f} cycles/us, sampling {sampling}, "
+        f"{len(cpus)} CPUs, started at {header['start_walltime_ns']} ns wall time"
+    )
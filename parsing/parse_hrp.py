@@ -5,6 +5,14 @@ import argparse
 import re
 import polars as pl
 import numpy as np
+from hrp_log_header import (
+    HRP_LOG_CLOCK_TSC,
+    describe_log_header,
+    has_field,
+    log_paths,
+    read_log_header,
+    read_merged_log_entries,
+)
 
 def read_hrp_tsc_config(config_path="../src/config.h") -> bool:
     script_dir = os.path.dirname(os.path.abspath(__file__))
@@ -32,13 +40,155 @@ def read_hrp_use_offcore_config(config_path="../src/config.h") -> bool:
         # If no flag, fall back to original hireserf
         return False
 
+# Keep in sync with HRP_EVENT_ID_* in src/config.h
+HRP_EVENT_NAMES = {
+    0: "none",
+    1: "llc_misses",
+    2: "sw_prefetch",
+    3: "stall_mem",
+    4: "offcore_read",
+    5: "offcore_write",
+    6: "write_estimate",
+}
+
+# Marker records, see HrperfMarker in src/buffer.h. A marker reuses the tick
+# layout: timestamp is the marker time, stall_mem its type and the next four
+# counter fields its arguments.
+HRP_LOG_MARKER_CPU = -1
+# the RDT records of node n come from a ring of their own, with cpu_id -2 - n
+# (HRP_LOG_RDT_CPU in src/buffer.h), all negative cpu_ids are markers
+HRP_LOG_MARKER_EVENT_SEL = 1
+HRP_LOG_MARKER_DUMP = 2
+HRP_LOG_MARKER_BURST_START = 3
+HRP_LOG_MARKER_BURST_END = 4
+HRP_LOG_MARKER_RDT = 5
+# core of the RDT records of tagged RMIDs, MBM_NO_CORE in include/mbm/types.h
+HRP_MBM_NO_CORE = 0xFFFF
+HRP_MARKER_ARG_FIELDS = ["inst_retire", "cpu_unhalt", "llc_misses", "sw_prefetch"]
+
+# PERF_METRICS byte fields, each is the fraction of the window's slots * 255.
+# Level-1 in bytes 0-3, level-2 (Sapphire Rapids) in bytes 4-7.
+HRP_PERF_METRICS_FIELDS = [
+    "retiring",
+    "bad_speculation",
+    "frontend_bound",
+    "backend_bound",
+    "heavy_operations",
+    "branch_mispredicts",
+    "fetch_latency",
+    "memory_bound",
+]
+HRP_TOPDOWN_COLUMNS = HRP_PERF_METRICS_FIELDS + [
+    "light_operations",
+    "machine_clears",
+    "fetch_bandwidth",
+    "core_bound",
+]
+
+# Keep in sync with HRP_NUM_GP_EVENTS in src/config.h
+HRP_NUM_GP_EVENTS = 8
+
+# Fields of the tick holding PMC0, PMC1, ..., PMC3 onwards are only logged
+# with HRP_USE_ALL_COUNTERS
+HRP_PMC_FIELDS = ["llc_misses", "sw_prefetch", "stall_mem"] + [
+    f"pmc{i}" for i in range(3, HRP_NUM_GP_EVENTS)
+]
+
+
+def split_markers(data: np.ndarray):
+    """Split the log into samples and the event selections recorded in it.
+
+    Returns the samples and a list of (timestamp, {group: {pmc: (evtsel,
+    offcore_rsp, name)}}), one entry per (re)programming of the counters, in
+    time order. Logs without multiplexing only have group 0.
+    """
+    is_marker = data["cpu_id"] <= HRP_LOG_MARKER_CPU
+    markers = np.sort(data[is_marker], order="timestamp", kind="stable")
+    samples = data[~is_marker]
+
+    event_sets = []
+    for m in markers:
+        if int(m["stall_mem"]) != HRP_LOG_MARKER_EVENT_SEL:
+            continue
+        index, evtsel, offcore_rsp, name_id = (int(m[f]) for f in HRP_MARKER_ARG_FIELDS)
+        group, pmc = index >> 16, index & 0xFFFF
+        ts = int(m["timestamp"])
+        # the markers of one selection are emitted back to back, group 0 and
+        # counter 0 first
+        if (group == 0 and pmc == 0) or not event_sets:
+            event_sets.append((ts, {}))
+        event_sets[-1][1].setdefault(group, {})[pmc] = (
+            evtsel,
+            offcore_rsp,
+            HRP_EVENT_NAMES.get(name_id, f"event_{name_id}"),
+        )
+    return samples, event_sets
+
+
+def multiplexed_event_rates(
+    df: pl.DataFrame, groups: dict, kts_per_us: float
+) -> pl.DataFrame:
+    """Estimate the event rates of a multiplexed log.
+
+    A group only counts while it is scheduled, so the rate of an event is its
+    count delta over the running time delta of its group, between two samples
+    of that group. The estimate is carried forward while other groups are
+    scheduled. Each count is also scaled to the enabled time, like perf does.
+    Adds one mux_<event>_rate (per us) and one mux_<event>_scaled column per
+    event.
+    """
+    group = ["cpu_id", "event_epoch", "group_id"]
+    running = pl.col("time_running")
+    running_us = (running - running.shift(1).over(group)) / kts_per_us
+
+    rates, scaled = {}, {}
+    for g, events in groups.items():
+        in_group = pl.col("group_id") == g
+        for pmc, (_, _, name) in events.items():
+            count = pl.col(HRP_PMC_FIELDS[pmc])
+            delta = count - count.shift(1).over(group)
+            rates.setdefault(name, []).append(pl.when(in_group).then(delta / running_us))
+            scaled.setdefault(name, []).append(
+                pl.when(in_group & (running > 0)).then(
+                    count * pl.col("time_enabled") / running
+                )
+            )
+
+    carry = ["cpu_id", "event_epoch"]
+    return df.with_columns(
+        [
+            pl.coalesce(e).forward_fill().over(carry).alias(f"mux_{n}_rate")
+            for n, e in rates.items()
+        ]
+        + [
+            pl.coalesce(e).forward_fill().over(carry).alias(f"mux_{n}_scaled")
+            for n, e in scaled.items()
+        ]
+    )
+
 
 def read_logs_to_numpy(
     file_path: str,
     use_imc: bool = False,
     use_rdt: bool = False,
     use_rdt_local_bw: bool = False,
+    use_mux: bool = False,
+    use_all_counters: bool = False,
+    use_topdown: bool = False,
+    use_freq: bool = False,
+    header: dict = None,
 ) -> np.ndarray:
+    if header is not None:
+        # the header describes the layout and the format, the flags are not needed
+        print("Reading binary file into NumPy array...")
+        try:
+            data = read_merged_log_entries(log_paths(file_path), header)
+            print(f"Read {len(data)} records to successfully.")
+            return data
+        except Exception as e:
+            print(f"Error reading file with NumPy: {e}")
+            return np.array([])
+
     # Base fields: cpu_id, timestamp, stall_mem, inst_retire, cpu_unhalt, llc_misses, sw_prefetch
     fields = [
         ("cpu_id", np.int32),
@@ -66,6 +216,29 @@ def read_logs_to_numpy(
             fields.append(("local_bw", np.uint64))
         fields.append(("occupancy", np.uint64))
 
+    # Add multiplexing fields if enabled
+    if use_mux:
+        fields.extend(
+            [
+                ("group_id", np.uint64),
+                ("time_enabled", np.uint64),
+                ("time_running", np.uint64),
+            ]
+        )
+
+    # Add the fixed counters 2-3 and PMC3 onwards if all counters are used
+    if use_all_counters:
+        fields.extend([("ref_cycles", np.uint64), ("slots", np.uint64)])
+        fields.extend([(f, np.uint64) for f in HRP_PMC_FIELDS[3:]])
+
+    # Add the topdown slots and PERF_METRICS of each window if enabled
+    if use_topdown:
+        fields.extend([("td_slots", np.uint64), ("perf_metrics", np.uint64)])
+
+    # Add APERF and MPERF if enabled
+    if use_freq:
+        fields.extend([("aperf", np.uint64), ("mperf", np.uint64)])
+
     dt = np.dtype(fields)
 
     print("Reading binary file into NumPy array...")
@@ -78,6 +251,30 @@ def read_logs_to_numpy(
         return np.array([])
 
 
+def sched_intervals(df: pl.DataFrame) -> pl.DataFrame:
+    """Run intervals of the threads from the context switch samples of
+    HRP_LOG_SCHED_SWITCH, in the schema of threads_scheduling (parse_sched.py).
+
+    A thread runs on a CPU from the switch that brings it in to the next switch
+    there. The sample at a switch closes the window of the outgoing thread, so
+    the intervals start 1 after it and each sample falls into a single one.
+    """
+    return (
+        df.filter(pl.col("prev_tid") != pl.col("next_tid"))
+        .sort(["cpu_id", "timestamp"])
+        .with_columns(
+            end_time_ns=pl.col("timestamp").shift(-1).over(["cpu_id", "event_epoch"])
+        )
+        .filter(pl.col("end_time_ns").is_not_null() & (pl.col("next_tid") != 0))
+        .select(
+            thread_id=pl.col("next_tid").cast(pl.Int64),
+            core_number=pl.col("cpu_id").cast(pl.Int32),
+            start_time_ns=(pl.col("timestamp") + 1).cast(pl.Int64),
+            end_time_ns=pl.col("end_time_ns").cast(pl.Int64),
+        )
+    )
+
+
 def create_tables(
     con: duckdb.DuckDBPyConnection,
     use_raw: bool,
@@ -86,8 +283,12 @@ def create_tables(
     use_write_est: bool,
     use_rdt: bool,
     use_rdt_local_bw: bool,
+    metric_columns: list = None,
 ):
     """Create database tables if they don't exist."""
+    if metric_columns is None:
+        metric_columns = []
+    metric_cols = "".join(f", {c} DOUBLE" for c in metric_columns)
     if use_raw:
         if use_offcore:
             if use_write_est:
@@ -103,7 +304,7 @@ def create_tables(
                         offcore_read_rate DOUBLE,
                         write_estimate_rate DOUBLE,
                         memory_bandwidth_bytes_per_us DOUBLE,
-                        time_delta_ns UBIGINT,
+                        time_delta_ns UBIGINT{},
                         stall_mem UBIGINT,
                         inst_retire UBIGINT,
                         cpu_unhalt UBIGINT,
@@ -113,6 +314,7 @@ def create_tables(
                         {}
                     )
                 """.format(
+                        metric_cols,
                         ", imc_read UBIGINT, imc_write UBIGINT" if use_imc else "",
                         ", total_bw UBIGINT, {} occupancy UBIGINT".format(
                             "local_bw UBIGINT, " if use_rdt_local_bw else ""
@@ -134,7 +336,7 @@ def create_tables(
                         offcore_read_rate DOUBLE,
                         offcore_write_rate DOUBLE,
                         memory_bandwidth_bytes_per_us DOUBLE,
-                        time_delta_ns UBIGINT,
+                        time_delta_ns UBIGINT{},
                         stall_mem UBIGINT,
                         inst_retire UBIGINT,
                         cpu_unhalt UBIGINT,
@@ -144,6 +346,7 @@ def create_tables(
                         {}
                     )
                 """.format(
+                        metric_cols,
                         ", imc_read UBIGINT, imc_write UBIGINT" if use_imc else "",
                         ", total_bw UBIGINT, {} occupancy UBIGINT".format(
                             "local_bw UBIGINT, " if use_rdt_local_bw else ""
@@ -165,7 +368,7 @@ def create_tables(
                     llc_misses_rate DOUBLE,
                     sw_prefetch_rate DOUBLE,
                     memory_bandwidth_bytes_per_us DOUBLE,
-                    time_delta_ns UBIGINT,
+                    time_delta_ns UBIGINT{},
                     stall_mem UBIGINT,
                     inst_retire UBIGINT,
                     cpu_unhalt UBIGINT,
@@ -175,6 +378,7 @@ def create_tables(
                     {}
                 )
             """.format(
+                    metric_cols,
                     ", imc_read UBIGINT, imc_write UBIGINT" if use_imc else "",
                     ", total_bw UBIGINT, {} occupancy UBIGINT".format(
                         "local_bw UBIGINT, " if use_rdt_local_bw else ""
@@ -198,11 +402,12 @@ def create_tables(
                         offcore_read_rate DOUBLE,
                         write_estimate_rate DOUBLE,
                         memory_bandwidth_bytes_per_us DOUBLE,
-                        time_delta_ns UBIGINT
+                        time_delta_ns UBIGINT{}
                         {}
                         {}
                     )
                 """.format(
+                        metric_cols,
                         ", imc_read UBIGINT, imc_write UBIGINT" if use_imc else "",
                         ", total_bw UBIGINT, {} occupancy UBIGINT".format(
                             "local_bw UBIGINT, " if use_rdt_local_bw else ""
@@ -224,11 +429,12 @@ def create_tables(
                         offcore_read_rate DOUBLE,
                         offcore_write_rate DOUBLE,
                         memory_bandwidth_bytes_per_us DOUBLE,
-                        time_delta_ns UBIGINT
+                        time_delta_ns UBIGINT{}
                         {}
                         {}
                     )
                 """.format(
+                        metric_cols,
                         ", imc_read UBIGINT, imc_write UBIGINT" if use_imc else "",
                         ", total_bw UBIGINT, {} occupancy UBIGINT".format(
                             "local_bw UBIGINT, " if use_rdt_local_bw else ""
@@ -250,11 +456,12 @@ def create_tables(
                     llc_misses_rate DOUBLE,
                     sw_prefetch_rate DOUBLE,
                     memory_bandwidth_bytes_per_us DOUBLE,
-                    time_delta_ns UBIGINT
+                    time_delta_ns UBIGINT{}
                     {}
                     {}
                 )
             """.format(
+                    metric_cols,
                     ", imc_read UBIGINT, imc_write UBIGINT" if use_imc else "",
                     ", total_bw UBIGINT, {} occupancy UBIGINT".format(
                         "local_bw UBIGINT, " if use_rdt_local_bw else ""
@@ -286,14 +493,134 @@ def parse_hrperf_log_polars(
     use_rdt: bool,
     use_rdt_local_bw: bool,
     rdt_scaling: int,
+    use_mux: bool = False,
+    use_all_counters: bool = False,
+    use_topdown: bool = False,
+    use_freq: bool = False,
+    header: dict = None,
 ):
     print("Reading all log entries into memory...")
 
-    numpy_data = read_logs_to_numpy(perf_log_path, use_imc, use_rdt, use_rdt_local_bw)
+    numpy_data = read_logs_to_numpy(
+        perf_log_path,
+        use_imc,
+        use_rdt,
+        use_rdt_local_bw,
+        use_mux,
+        use_all_counters,
+        use_topdown,
+        use_freq,
+        header,
+    )
     if numpy_data.size == 0:
         print("Log file is empty or could not be read.")
         return
 
+    # Flight-recorder dumps, the history before each dump was written at once
+    is_dump = (numpy_data["cpu_id"] == HRP_LOG_MARKER_CPU) & (
+        numpy_data["stall_mem"] == HRP_LOG_MARKER_DUMP
+    )
+    dump_times = numpy_data["timestamp"][is_dump]
+    if dump_times.size:
+        print(f"Found {dump_times.size} flight-recorder dumps.")
+
+    # Bursts of the poller (HRP_BURST_SAMPLING), the samples in them are denser
+    is_marker = numpy_data["cpu_id"] <= HRP_LOG_MARKER_CPU
+    burst_starts = numpy_data[is_marker & (numpy_data["stall_mem"] == HRP_LOG_MARKER_BURST_START)]
+    if burst_starts.size:
+        # a CPU id, or -1 - node for a NUMA node
+        hot_cpu = burst_starts[HRP_MARKER_ARG_FIELDS[0]].astype(np.int64)
+        hot_nodes = sorted(set((-1 - hot_cpu[hot_cpu < 0]).tolist()))
+        print(
+            f"Found {burst_starts.size} bursts, {np.count_nonzero(hot_cpu >= 0)} started by a "
+            f"CPU and {np.count_nonzero(hot_cpu < 0)} by a node {hot_nodes}, peak "
+            f"{int(burst_starts[HRP_MARKER_ARG_FIELDS[1]].max())} MB/s on a CPU and "
+            f"{int(burst_starts[HRP_MARKER_ARG_FIELDS[2]].max())} MB/s on a node."
+        )
+
+    # RDT counters read by the housekeeping threads (HRP_RDT_BATCHED), widened
+    # and in raw units like the RDT fields of the samples
+    rdt_records = numpy_data[is_marker & (numpy_data["stall_mem"] == HRP_LOG_MARKER_RDT)]
+    rdt_records_df = None
+    if rdt_records.size:
+        index = rdt_records[HRP_MARKER_ARG_FIELDS[0]].astype(np.uint64)
+        core = ((index >> np.uint64(32)) & np.uint64(0xFFFF)).astype(np.int32)
+        scale = header["rdt_scale"] if header is not None else (rdt_scaling or 1)
+        rdt_records_df = pl.DataFrame(
+            {
+                "timestamp_ns": rdt_records["timestamp"],
+                "node": (index >> np.uint64(48)).astype(np.int32),
+                "core_id": np.where(core == HRP_MBM_NO_CORE, -1, core),
+                "rmid": (index & np.uint64(0xFFFFFFFF)).astype(np.uint32),
+                "total_bw": rdt_records[HRP_MARKER_ARG_FIELDS[1]] * np.uint64(scale),
+                "local_bw": rdt_records[HRP_MARKER_ARG_FIELDS[2]] * np.uint64(scale),
+                "occupancy": rdt_records[HRP_MARKER_ARG_FIELDS[3]] * np.uint64(scale),
+            }
+        )
+        print(
+            f"Found {rdt_records.size} batched RDT records of "
+            f"{rdt_records_df['rmid'].n_unique()} RMIDs."
+        )
+
+    numpy_data, event_sets = split_markers(numpy_data)
+    # e.g. the markers were drained before the consumer started, fall back to
+    # the events in the header
+    if not event_sets and header is not None:
+        event_sets = [
+            (
+                header["start_kts"],
+                {
+                    g: {
+                        pmc: (evtsel, offcore_rsp, HRP_EVENT_NAMES.get(name_id, f"event_{name_id}"))
+                        for pmc, (evtsel, offcore_rsp, name_id) in events.items()
+                    }
+                    for g, events in header["events"].items()
+                },
+            )
+        ]
+    for ts, groups in event_sets:
+        for g, events in sorted(groups.items()):
+            desc = ", ".join(
+                f"PMC{pmc}={name} (0x{evtsel:x})"
+                for pmc, (evtsel, _, name) in sorted(events.items())
+            )
+            print(f"Events programmed at {ts}, group {g}: {desc}")
+
+    # The first event selection in the log overrides the command line flags
+    if event_sets:
+        names = [
+            name
+            for events in event_sets[0][1].values()
+            for _, _, name in events.values()
+        ]
+        log_offcore = "offcore_read" in names
+        log_write_est = "write_estimate" in names
+        if log_offcore != use_offcore or (log_offcore and log_write_est != use_write_est):
+            print(
+                "Warning: --use_offcore/--use_write_est do not match the events recorded in the log, using the log."
+            )
+        use_offcore = log_offcore
+        use_write_est = log_write_est
+        if len(event_sets) > 1:
+            print(
+                "Warning: the events were reprogrammed during the run, columns are named after the first selection."
+            )
+
+    # Gaps in the per-ring sequence numbers are samples dropped because the
+    # ring was full (HRP_LOG_SEQ)
+    if "seq" in numpy_data.dtype.names:
+        for cpu in np.unique(numpy_data["cpu_id"]):
+            seq = numpy_data["seq"][numpy_data["cpu_id"] == cpu].astype(np.int64)
+            lost = int(np.sum((np.diff(seq) - 1) % (1 << 32)))
+            if lost:
+                if cpu >= 0:
+                    ring = f"CPU {cpu}"
+                elif cpu == HRP_LOG_MARKER_CPU:
+                    ring = "The marker ring"
+                else:
+                    ring = f"The RDT ring of node {-2 - cpu}"
+                print(f"Warning: {ring} dropped {lost} entries ({lost / (lost + seq.size):.2%}).")
+
     # Process the NumPy data
     print("Converting to Polars DataFrame...")
     df = pl.from_numpy(numpy_data)
@@ -315,17 +642,74 @@ def parse_hrperf_log_polars(
         "DataFrame height does not match NumPy array size."
     )
 
+    # Samples taken under different event selections must not be differenced
+    # against each other, tag each sample with the selection it was taken under.
+    # The same holds across flight-recorder dumps, the samples in between were
+    # overwritten.
+    epoch_starts = np.sort(
+        np.concatenate(
+            [np.array([ts for ts, _ in event_sets[1:]], dtype=np.uint64), dump_times]
+        )
+    )
+    df = df.with_columns(
+        event_epoch=pl.Series(
+            np.searchsorted(epoch_starts, df["timestamp"].to_numpy(), side="right")
+        )
+    )
+
     # Sort by cpu_id and timestamp to ensure correct order for delta calculations
     df = df.sort(["cpu_id", "timestamp"])
 
+    sched_df = None
+    if "prev_tid" in df.columns:
+        sched_df = sched_intervals(df)
+        print(f"Found {sched_df.height} thread run intervals in the context switch samples.")
+
+    group = ["cpu_id", "event_epoch"]
     df = df.with_columns(
-        pl.col("timestamp").shift(1).over("cpu_id").alias("prev_timestamp"),
-        pl.col("stall_mem").shift(1).over("cpu_id").alias("prev_stall_mem"),
-        pl.col("inst_retire").shift(1).over("cpu_id").alias("prev_inst_retire"),
-        pl.col("cpu_unhalt").shift(1).over("cpu_id").alias("prev_cpu_unhalt"),
-        pl.col("llc_misses").shift(1).over("cpu_id").alias("prev_llc_misses"),
-        pl.col("sw_prefetch").shift(1).over("cpu_id").alias("prev_sw_prefetch"),
+        pl.col("timestamp").shift(1).over(group).alias("prev_timestamp"),
+        pl.col("stall_mem").shift(1).over(group).alias("prev_stall_mem"),
+        pl.col("inst_retire").shift(1).over(group).alias("prev_inst_retire"),
+        pl.col("cpu_unhalt").shift(1).over(group).alias("prev_cpu_unhalt"),
+        pl.col("llc_misses").shift(1).over(group).alias("prev_llc_misses"),
+        pl.col("sw_prefetch").shift(1).over(group).alias("prev_sw_prefetch"),
     )
+    if use_freq:
+        df = df.with_columns(
+            pl.col("aperf").shift(1).over(group).alias("prev_aperf"),
+            pl.col("mperf").shift(1).over(group).alias("prev_mperf"),
+        )
+
+    # Extra counters of HRP_USE_ALL_COUNTERS, with multiplexing the PMCs are
+    # estimated per group instead
+    extra_counters = {}
+    if use_all_counters:
+        extra_counters = {"ref_cycles": "ref_cycles", "slots": "slots"}
+        events = event_sets[0][1].get(0, {}) if event_sets else {}
+        for pmc in range(3, HRP_NUM_GP_EVENTS):
+            if use_mux or (events and events.get(pmc, (0,))[0] == 0):
+                continue
+            name = events[pmc][2] if pmc in events else HRP_PMC_FIELDS[pmc]
+            if name in extra_counters.values():
+                name = f"pmc{pmc}_{name}"
+            extra_counters[HRP_PMC_FIELDS[pmc]] = name
+        df = df.with_columns(
+            [
+                pl.col(f).shift(1).over(group).alias(f"prev_{f}")
+                for f in extra_counters
+            ]
+        )
+
+    if use_mux:
+        if not event_sets:
+            print("Error: no event groups recorded in the log, cannot parse multiplexed counters.")
+            return
+        kts_per_us = tsc_per_us if use_tsc_ts else 1e3
+        df = multiplexed_event_rates(df, event_sets[0][1], kts_per_us)
+        if use_raw:
+            print(
+                "Warning: raw PMC counters of a multiplexed log belong to the group in group_id."
+            )
 
     # Calculate time delta
     if use_tsc_ts:
@@ -362,6 +746,69 @@ def parse_hrperf_log_polars(
         * 64
     )
 
+    # With multiplexing, the PMC rates come from the per-group estimates
+    if use_mux:
+        if use_offcore:
+            first = "offcore_read"
+            second = "write_estimate" if use_write_est else "offcore_write"
+        else:
+            first, second = "llc_misses", "sw_prefetch"
+
+        def rate_of(name):
+            col = f"mux_{name}_rate"
+            return pl.col(col) if col in df.columns else pl.lit(None, dtype=pl.Float64)
+
+        df = df.with_columns(
+            stalls_per_us=rate_of("stall_mem"),
+            llc_misses_rate=rate_of(first),
+            sw_prefetch_rate=rate_of(second),
+        ).with_columns(
+            memory_bandwidth_bytes_per_us=(
+                pl.col("llc_misses_rate") + pl.col("sw_prefetch_rate")
+            )
+            * 64
+        )
+
+    # PERF_METRICS is cleared at every sample, so each sample holds the top-down
+    # breakdown of its own window
+    if use_topdown:
+        has_slots = pl.col("td_slots") > 0
+        df = df.with_columns(
+            [
+                pl.when(has_slots)
+                .then(((pl.col("perf_metrics") >> (8 * i)) & 0xFF) / 255.0)
+                .alias(name)
+                for i, name in enumerate(HRP_PERF_METRICS_FIELDS)
+            ]
+        ).with_columns(
+            light_operations=pl.col("retiring") - pl.col("heavy_operations"),
+            machine_clears=pl.col("bad_speculation") - pl.col("branch_mispredicts"),
+            fetch_bandwidth=pl.col("frontend_bound") - pl.col("fetch_latency"),
+            core_bound=pl.col("backend_bound") - pl.col("memory_bound"),
+        )
+
+    # MPERF ticks at the TSC frequency and APERF at the actual one, both only in
+    # C0, so their ratio gives the frequency while busy
+    if use_freq:
+        d_aperf = pl.col("aperf") - pl.col("prev_aperf")
+        d_mperf = pl.col("mperf") - pl.col("prev_mperf")
+        df = df.with_columns(
+            effective_ghz=pl.when(d_mperf > 0).then(
+                d_aperf / d_mperf * tsc_per_us / 1e3
+            ),
+            busy_ratio=d_mperf / (tsc_per_us * pl.col("time_delta_us")),
+        )
+
+    if extra_counters:
+        df = df.with_columns(
+            [
+                ((pl.col(f) - pl.col(f"prev_{f}")) / pl.col("time_delta_us")).alias(
+                    f"extra_{name}_rate"
+                )
+                for f, name in extra_counters.items()
+            ]
+        )
+
     # Prepare final performance_events table
     final_cols = [
         "cpu_id",
@@ -374,6 +821,22 @@ def parse_hrperf_log_polars(
         "memory_bandwidth_bytes_per_us",
         "time_delta_ns",
     ]
+    metric_columns = []
+    if use_topdown:
+        metric_columns.extend(HRP_TOPDOWN_COLUMNS)
+    if use_freq:
+        metric_columns.extend(["effective_ghz", "busy_ratio"])
+    if "interval" in df.columns:
+        # Adaptive interval logs: the rates above already use the gap to the
+        # previous logged sample, the logged interval is kept for reference
+        kts_per_us = tsc_per_us if use_tsc_ts else 1e3
+        df = df.with_columns(sample_interval_us=pl.col("interval") / kts_per_us)
+        metric_columns.append("sample_interval_us")
+        print(
+            f"Adaptive sampling interval: median {df['sample_interval_us'].median():.1f} us, "
+            f"min {df['sample_interval_us'].min():.1f} us, max {df['sample_interval_us'].max():.1f} us"
+        )
+    final_cols.extend(metric_columns)
     if use_raw:
         final_cols.extend(
             ["stall_mem", "inst_retire", "cpu_unhalt", "llc_misses", "sw_prefetch"]
@@ -411,20 +874,101 @@ def parse_hrperf_log_polars(
     print("Writing data to DuckDB...")
     con = duckdb.connect(database=db_path)
     create_tables(
-        con, use_raw, use_offcore, use_imc, use_write_est, use_rdt, use_rdt_local_bw
+        con,
+        use_raw,
+        use_offcore,
+        use_imc,
+        use_write_est,
+        use_rdt,
+        use_rdt_local_bw,
+        metric_columns,
     )
 
     con.execute("INSERT INTO performance_events SELECT * FROM perf_df")
     con.execute("INSERT INTO node_memory_bandwidth SELECT * FROM node_bw_df")
 
+    if sched_df is not None:
+        sched_exists = con.execute(
+            """
+            SELECT COUNT(*) FROM information_schema.tables
+            WHERE table_name = 'threads_scheduling' AND table_schema = 'main'
+            """
+        ).fetchone()[0]
+        if sched_exists:
+            print("Warning: table 'threads_scheduling' already exists, not replaced.")
+            sched_df = None
+        else:
+            con.execute("CREATE TABLE threads_scheduling AS SELECT * FROM sched_df")
+            con.execute("CREATE INDEX idx_thread_id ON threads_scheduling (thread_id)")
+
+    if use_mux:
+        mux_cols = ["cpu_id", "timestamp_ns", "group_id", "time_enabled", "time_running"]
+        mux_cols += [c for c in df.columns if c.startswith("mux_")]
+        mux_df = df.rename({"timestamp": "timestamp_ns"}).select(mux_cols)
+        con.execute(
+            "CREATE TABLE IF NOT EXISTS multiplexed_events AS SELECT * FROM mux_df LIMIT 0"
+        )
+        con.execute("INSERT INTO multiplexed_events SELECT * FROM mux_df")
+
+    if extra_counters:
+        extra_df = df.rename({"timestamp": "timestamp_ns"}).select(
+            ["cpu_id", "timestamp_ns"]
+            + [
+                pl.col(f"extra_{name}_rate").alias(f"{name}_rate")
+                for name in extra_counters.values()
+            ]
+        )
+        con.execute(
+            "CREATE TABLE IF NOT EXISTS extra_counter_events AS SELECT * FROM extra_df LIMIT 0"
+        )
+        con.execute("INSERT INTO extra_counter_events SELECT * FROM extra_df")
+
+    # HRP_RDT_TAGS: total_bw and occupancy belong to the RMID of the task that
+    # was running, not to the core
+    use_rdt_tags = use_rdt and "rmid" in df.columns
+    if use_rdt_tags:
+        rdt_cols = ["cpu_id", "timestamp_ns", "rmid", "total_bw"]
+        if use_rdt_local_bw:
+            rdt_cols.append("local_bw")
+        rdt_cols.append("occupancy")
+        rdt_df = df.rename({"timestamp": "timestamp_ns"}).select(rdt_cols)
+        con.execute("CREATE TABLE IF NOT EXISTS rdt_samples AS SELECT * FROM rdt_df LIMIT 0")
+        con.execute("INSERT INTO rdt_samples SELECT * FROM rdt_df")
+
+    if rdt_records_df is not None:
+        con.execute(
+            "CREATE TABLE IF NOT EXISTS rdt_records AS SELECT * FROM rdt_records_df LIMIT 0"
+        )
+        con.execute("INSERT INTO rdt_records SELECT * FROM rdt_records_df")
+
     con.close()
 
     print(
         f"Processed performance data has been inserted into 'performance_events' table in '{db_path}'."
     )
+    if extra_counters:
+        print(
+            f"Extra counter rates (per us) have been inserted into 'extra_counter_events' table in '{db_path}'."
+        )
+    if use_mux:
+        print(
+            f"Multiplexed event estimates have been inserted into 'multiplexed_events' table in '{db_path}'."
+        )
+    if use_rdt_tags:
+        print(
+            f"RDT counters with their RMIDs have been inserted into 'rdt_samples' table in '{db_path}'."
+        )
+    if rdt_records_df is not None:
+        print(
+            f"Batched RDT records have been inserted into 'rdt_records' table in '{db_path}'."
+        )
     print(
         f"Node memory bandwidth data has been inserted into 'node_memory_bandwidth' table in '{db_path}'."
     )
+    if sched_df is not None:
+        print(
+            f"Thread run intervals have been inserted into 'threads_scheduling' table in '{db_path}'."
+        )
 
 
 def main():
@@ -432,7 +976,9 @@ def main():
         description="Parse hiresperf log files and store results in DuckDB."
     )
     parser.add_argument(
-        "perf_log_path", type=str, help="Path to the hiresperf log file."
+        "perf_log_path",
+        type=str,
+        help="Path to the hiresperf log file, or to the directory of the per-node logs.",
     )
     parser.add_argument(
         "--raw_counter",
@@ -445,8 +991,7 @@ def main():
     parser.add_argument(
         "--tsc_freq",
         type=float,
-        required=True,
-        help="TSC frequency in cycles per microsecond.",
+        help="TSC frequency in cycles per microsecond (required for logs without a header).",
     )
     parser.add_argument(
         "--use_offcore",
@@ -473,6 +1018,26 @@ def main():
         action="store_true",
         help="Indicates if RDT local bandwidth is included (input data has additional local_bw field).",
     )
+    parser.add_argument(
+        "--use_mux",
+        action="store_true",
+        help="Indicates if counter multiplexing is used (input data has group_id, time_enabled and time_running fields).",
+    )
+    parser.add_argument(
+        "--use_all_counters",
+        action="store_true",
+        help="Indicates if all counters are used (input data has ref_cycles, slots and pmc3-pmc7 fields).",
+    )
+    parser.add_argument(
+        "--use_topdown",
+        action="store_true",
+        help="Indicates if topdown metrics are used (input data has td_slots and perf_metrics fields).",
+    )
+    parser.add_argument(
+        "--use_freq",
+        action="store_true",
+        help="Indicates if APERF/MPERF are logged (input data has aperf and mperf fields).",
+    )
     parser.add_argument(
         "--rdt_scaling",
         type=int,
@@ -486,12 +1051,47 @@ def main():
     )
     args = parser.parse_args()
 
-    if not os.path.isfile(args.perf_log_path):
-        print(f"Error: File '{args.perf_log_path}' does not exist.")
+    paths = log_paths(args.perf_log_path)
+    if not paths or not all(os.path.isfile(p) for p in paths):
+        print(f"Error: No hiresperf log at '{args.perf_log_path}'.")
+        sys.exit(1)
+    if len(paths) > 1:
+        print(f"Merging {len(paths)} logs: {', '.join(os.path.basename(p) for p in paths)}")
+
+    header = read_log_header(paths[0])
+    if header is not None:
+        # Logs with a header describe themselves, the layout flags, the clock
+        # and the scaling factors all come from the log
+        print(f"Found {describe_log_header(header)}")
+        flags = {
+            "use_imc": has_field(header, "imc_read"),
+            "use_rdt": has_field(header, "total_bw"),
+            "use_rdt_local_bw": has_field(header, "local_bw"),
+            "use_mux": has_field(header, "group_id"),
+            "use_all_counters": has_field(header, "ref_cycles"),
+            "use_topdown": has_field(header, "td_slots"),
+            "use_freq": has_field(header, "aperf"),
+            "tsc_ts": header["clock"] == HRP_LOG_CLOCK_TSC,
+        }
+        for flag, value in flags.items():
+            if getattr(args, flag) and not value:
+                print(f"Warning: --{flag} does not match the log header, ignoring it.")
+            setattr(args, flag, value)
+        if header["tsc_per_us"] > 0:
+            if args.tsc_freq is not None and abs(args.tsc_freq - header["tsc_per_us"]) > 1:
+                print(
+                    f"Warning: --tsc_freq {args.tsc_freq} differs from the log header, using {header['tsc_per_us']}."
+                )
+            args.tsc_freq = header["tsc_per_us"]
+        if args.use_rdt:
+            args.rdt_scaling = header["rdt_scale"]
+
+    if args.tsc_freq is None:
+        print("Error: --tsc_freq is required for logs without a header.")
         sys.exit(1)
 
-    # Read config flag
-    hrp_use_tsc = read_hrp_tsc_config()
+    # Read config flag, only needed for logs without a header
+    hrp_use_tsc = args.tsc_ts if header is not None else read_hrp_tsc_config()
     use_tsc_ts = args.tsc_ts
     tsc_per_us = args.tsc_freq
     use_offcore = args.use_offcore
@@ -499,7 +1099,9 @@ def main():
     use_rdt = args.use_rdt
     use_rdt_local_bw = args.use_rdt_local_bw
     rdt_scaling = args.rdt_scaling
-    hrp_use_offcore = read_hrp_use_offcore_config()
+    hrp_use_offcore = (
+        args.use_offcore if header is not None else read_hrp_use_offcore_config()
+    )
 
     # Validate RDT scaling parameter
     if use_rdt and rdt_scaling is None:
@@ -532,6 +1134,10 @@ def main():
     print(f"Using imc counters: {use_imc}")
     print(f"Using RDT counters: {use_rdt}")
     print(f"Using RDT local bandwidth: {use_rdt_local_bw}")
+    print(f"Using counter multiplexing: {args.use_mux}")
+    print(f"Using all counters: {args.use_all_counters}")
+    print(f"Using topdown metrics: {args.use_topdown}")
+    print(f"Using APERF/MPERF: {args.use_freq}")
     if use_rdt:
         print(f"RDT scaling factor: {rdt_scaling}")
 
@@ -547,6 +1153,11 @@ def main():
         use_rdt=args.use_rdt,
         use_rdt_local_bw=args.use_rdt_local_bw,
         rdt_scaling=rdt_scaling,
+        use_mux=args.use_mux,
+        use_all_counters=args.use_all_counters,
+        use_topdown=args.use_topdown,
+        use_freq=args.use_freq,
+        header=header,
     )
 
 if __name__ == "__main__":
@@ -2,6 +2,7 @@ from dataclasses import dataclass
 import numpy as np
 import pandas as pd
 import argparse
+from hrp_log_header import describe_log_header, has_field, log_dtype, log_paths, read_log_header, read_merged_log_entries
 
 parser = argparse.ArgumentParser(description="Parse HRP instructed profile.")
 parser.add_argument("--use_imc", action="store_true", help="Use IMC counters")
@@ -9,11 +10,13 @@ parser.add_argument("--use_offcore", action="store_true", help="Use offcore coun
 parser.add_argument(
     "--use_write_est", action="store_true", help="Use write estimate counter"
 )
+parser.add_argument(
+    "--use_freq", action="store_true", help="APERF/MPERF are logged (HRP_LOG_FREQ)"
+)
 parser.add_argument(
     "--tsc_freq",
     type=float,
-    required=True,
-    help="TSC frequency in cycles per microsecond.",
+    help="TSC frequency in cycles per microsecond (required for logs without a header).",
 )
 parser.add_argument(
     "--cpu_store_imc",
@@ -31,10 +34,29 @@ parser.add_argument(
     "--bin_path",
     type=str,
     default="/hrperf_log.bin",
-    help="Path to the HRP instructed profile binary file (default: /hrperf_log.bin)",
+    help="Path to the HRP instructed profile binary file, or to the directory of the per-node logs (default: /hrperf_log.bin)",
 )
 args = parser.parse_args()
 
+# Keep in sync with HRP_EVENT_ID_* in src/config.h
+HRP_EVENT_ID_OCR_READS = 4
+HRP_EVENT_ID_OCR_WRITE_EST = 6
+
+# Logs with a header describe their layout, events and TSC frequency
+bin_paths = log_paths(args.bin_path)
+header = read_log_header(bin_paths[0]) if bin_paths else None
+if header is not None:
+    print(f"Found {describe_log_header(header)}")
+    args.use_imc = has_field(header, "imc_read")
+    args.use_freq = has_field(header, "aperf")
+    name_ids = {pmc: name_id for pmc, (_, _, name_id) in header["events"].get(0, {}).items()}
+    args.use_offcore = name_ids.get(0) == HRP_EVENT_ID_OCR_READS
+    args.use_write_est = name_ids.get(1) == HRP_EVENT_ID_OCR_WRITE_EST
+    if header["tsc_per_us"] > 0:
+        args.tsc_freq = header["tsc_per_us"]
+if args.tsc_freq is None:
+    parser.error("--tsc_freq is required for logs without a header")
+
 c1_name = None
 c2_name = None
 
@@ -47,6 +69,8 @@ class TimeRangeData:
     imc_write_diff: int
     start_ts: int
     end_ts: int
+    effective_ghz: float = float('nan')
+    busy_ratio: float = float('nan')
 
 def prepare_core_name():
     global c1_name, c2_name
@@ -65,7 +89,12 @@ def prepare_core_name():
 def read_logs_to_numpy(file_path: str) -> np.ndarray:
     global c1_name, c2_name, args
 
-    if args.use_imc:
+    freq_fields = [('aperf', np.uint64), ('mperf', np.uint64)] if args.use_freq else []
+
+    if header is not None:
+        dt = log_dtype(header)
+        dt.names = tuple({'llc_misses': c1_name, 'sw_prefetch': c2_name}.get(n, n) for n in dt.names)
+    elif args.use_imc:
         # Matches "iQQQQQQQQ" -> int32, uint64, uint64, ...
         dt = np.dtype([
             ('cpu_id', np.int32),
@@ -77,7 +106,7 @@ def read_logs_to_numpy(file_path: str) -> np.ndarray:
             (f'{c2_name}', np.uint64),
             ('imc_read', np.uint64),
             ('imc_write', np.uint64),
-        ])
+        ] + freq_fields)
     else:
         # Matches "iQQQQQQ"
         dt = np.dtype([
@@ -88,12 +117,17 @@ def read_logs_to_numpy(file_path: str) -> np.ndarray:
             ('cpu_unhalt', np.uint64),
             (f'{c1_name}', np.uint64),
             (f'{c2_name}', np.uint64),
-        ])
+        ] + freq_fields)
 
     try:
-        data = np.fromfile(file_path, dtype=dt)
+        if header is not None:
+            # raw or compact, see the format in the header
+            data = read_merged_log_entries(log_paths(file_path), header).view(dt)
+        else:
+            data = np.fromfile(file_path, dtype=dt)
         print(f"Read {len(data)} records to successfully.")
-        return data
+        # drop marker records (cpu_id -1), e.g. the programmed events
+        return data[data['cpu_id'] >= 0]
     except Exception as e:
         print(f"Error reading file with NumPy: {e}")
         return np.array([])
@@ -103,7 +137,8 @@ def read_into_df(file_path: str) -> pd.DataFrame:
     df = pd.DataFrame(data)
     return df
 
-def calc_data_in_range(time_range: tuple[int, int], df: pd.DataFrame) -> TimeRangeData:
+def calc_data_in_range(time_range: tuple[pd.DataFrame, pd.DataFrame]) -> TimeRangeData:
+    """Counts between the start and the end samples of a range, one per CPU each."""
     global c1_name, c2_name, args
     c1_diff_name = f'{c1_name}_diff'
     c2_diff_name = f'{c2_name}_diff'
@@ -119,14 +154,11 @@ def calc_data_in_range(time_range: tuple[int, int], df: pd.DataFrame) -> TimeRan
     )
 
     start, end = time_range
-    mask = (df['timestamp'] >= start) & (df['timestamp'] <= end)
-    df_in_range = df.loc[mask]
-    assert len(df_in_range["timestamp"].unique()) == 2, "There should be exactly two unique timestamps in the specified range."
-    timestamp_min = df_in_range['timestamp'].min()
-    timestamp_max = df_in_range['timestamp'].max()
+    timestamp_min = start['timestamp'].min()
+    timestamp_max = end['timestamp'].max()
 
-    data_at_start = df.loc[df['timestamp'] == timestamp_min, ['cpu_id', f'{c1_name}', f'{c2_name}']]
-    data_at_end = df.loc[df['timestamp'] == timestamp_max, ['cpu_id', f'{c1_name}', f'{c2_name}']]
+    data_at_start = start[['cpu_id', f'{c1_name}', f'{c2_name}']]
+    data_at_end = end[['cpu_id', f'{c1_name}', f'{c2_name}']]
 
     merged = pd.merge(data_at_end, data_at_start, on='cpu_id', suffixes=('_end', '_start'))
     
@@ -151,6 +183,20 @@ def calc_data_in_range(time_range: tuple[int, int], df: pd.DataFrame) -> TimeRan
     time_range_d.c2_diff = diff_sum[c2_diff_name]
     time_range_d.start_ts = timestamp_min
     time_range_d.end_ts = timestamp_max
+
+    if args.use_freq:
+        # MPERF ticks at the TSC frequency and APERF at the actual one, both only in C0
+        freq_cols = ['cpu_id', 'aperf', 'mperf']
+        freq = pd.merge(end[freq_cols], start[freq_cols],
+                        on='cpu_id', suffixes=('_end', '_start'))
+        if args.cpu_id != -1:
+            freq = freq[freq['cpu_id'] == args.cpu_id]
+        aperf_diff = (freq['aperf_end'] - freq['aperf_start']).sum()
+        mperf_diff = (freq['mperf_end'] - freq['mperf_start']).sum()
+        if mperf_diff > 0:
+            time_range_d.effective_ghz = aperf_diff / mperf_diff * args.tsc_freq / 1e3
+        if len(freq) > 0 and timestamp_max > timestamp_min:
+            time_range_d.busy_ratio = mperf_diff / (len(freq) * (timestamp_max - timestamp_min))
     
     # total_ = diff_sum.sum()
     # print(f"Total diff: {total_}")
@@ -159,8 +205,8 @@ def calc_data_in_range(time_range: tuple[int, int], df: pd.DataFrame) -> TimeRan
     if args.use_imc:
         imc_col_names = ['imc_read', 'imc_write']
 
-        start_imc = df.loc[(df['timestamp'] == timestamp_min) & (df['cpu_id'] == args.cpu_store_imc), imc_col_names]
-        end_imc = df.loc[(df['timestamp'] == timestamp_max) & (df['cpu_id'] == args.cpu_store_imc), imc_col_names]
+        start_imc = start.loc[start['cpu_id'] == args.cpu_store_imc, imc_col_names]
+        end_imc = end.loc[end['cpu_id'] == args.cpu_store_imc, imc_col_names]
 
         if not start_imc.empty and not end_imc.empty:
             imc_read_diff = int(end_imc['imc_read'].values[0]) - int(start_imc['imc_read'].values[0])
@@ -174,20 +220,36 @@ def calc_data_in_range(time_range: tuple[int, int], df: pd.DataFrame) -> TimeRan
 
     return time_range_d
 
-def get_all_time_ranges(df: pd.DataFrame) -> list[tuple[int, int]]:
-    timestamps = df['timestamp'].unique()
-    timestamps.sort()
-    
-    if len(timestamps) < 2:
-        print("Not enough timestamps to form a time range.")
-        return []
+def get_all_time_ranges(df: pd.DataFrame) -> list[tuple[pd.DataFrame, pd.DataFrame]]:
+    """Pair the start and end polls of each range by their poll_id.
 
+    The samples of an instructed poll carry its number (HRP_LOG_POLL_ID),
+    whichever CPUs it sampled. The polls of a thread (poll_tid, if logged) on
+    the same CPUs alternate start and end, so each poll ends the open range of
+    its thread on those CPUs, or else opens one. A targeted poll of other CPUs
+    in between, e.g. a SELF poll among full polls, does not shift the pairs.
+    """
+    if 'poll_id' not in df.columns:
+        # full polls only, every poll stamps all CPUs alike
+        print("No poll_id in the log, pairing the full polls by timestamp.")
+        timestamps = np.sort(df['timestamp'].unique())
+        return [(df[df['timestamp'] == timestamps[i]], df[df['timestamp'] == timestamps[i + 1]])
+                for i in range(0, len(timestamps) - 1, 2)]
+
+    df = df[df['poll_id'] != 0]
+    open_polls = {}
     time_ranges = []
-    # Pair timestamps as (0,1), (2,3), (4,5), ...
-    for i in range(0, len(timestamps) - 1, 2):
-        start = timestamps[i]
-        end = timestamps[i + 1]
-        time_ranges.append((start, end))
+    for _, rows in df.groupby('poll_id', sort=True):
+        tid = int(rows['poll_tid'].iloc[0]) if 'poll_tid' in rows.columns else 0
+        key = (tid, tuple(sorted(rows['cpu_id'])))
+        start = open_polls.pop(key, None)
+        if start is None:
+            open_polls[key] = rows
+        else:
+            time_ranges.append((start, rows))
+    if not time_ranges:
+        print("Not enough polls to form a time range.")
+    time_ranges.sort(key=lambda r: r[0]['poll_id'].iloc[0])
     return time_ranges
 
 def parse_hrp_instructed_profile(file_path: str) -> list[TimeRangeData]:
@@ -203,7 +265,7 @@ def parse_hrp_instructed_profile(file_path: str) -> list[TimeRangeData]:
 
     results = []
     for time_range in time_ranges:
-        result = calc_data_in_range(time_range, df)
+        result = calc_data_in_range(time_range)
         results.append(result)
     return results
 
@@ -226,6 +288,9 @@ def print_avg_time_ranges_data(time_ranges_data: list[TimeRangeData]):
     print(f"Average IMC Read Diff: {avg_imc_read_diff}")
     print(f"Average IMC Write Diff: {avg_imc_write_diff}")
     print(f"Average IMC Total Transferred ((read+write) * 64): {(avg_imc_read_diff + avg_imc_write_diff) * 64 / 1e6:.2f} MB")
+    if args.use_freq:
+        print(f"Average effective_ghz: {np.nanmean([data.effective_ghz for data in time_ranges_data]):.3f}")
+        print(f"Average busy_ratio: {np.nanmean([data.busy_ratio for data in time_ranges_data]):.3f}")
 
 def main():
     global args
@@ -236,11 +301,14 @@ def main():
         print("Using offcore")
     if args.use_write_est:
         print("Using write estimate counter")
+    if args.use_freq:
+        print("Using APERF/MPERF")
         
     file_path = args.bin_path
     trs = parse_hrp_instructed_profile(file_path) 
     for tr in trs:
-        print(f"Time Range: {tr.start_ts} - {tr.end_ts}, Duration: {tr.duration_ms:.2f} ms, {c1_name} Diff: {tr.c1_diff}, {c2_name} Diff: {tr.c2_diff}, IMC Read Diff: {tr.imc_read_diff}, IMC Write Diff: {tr.imc_write_diff}")
+        print(f"Time Range: {tr.start_ts} - {tr.end_ts}, Duration: {tr.duration_ms:.2f} ms, {c1_name} Diff: {tr.c1_diff}, {c2_name} Diff: {tr.c2_diff}, IMC Read Diff: {tr.imc_read_diff}, IMC Write Diff: {tr.imc_write_diff}"
+              + (f", effective_ghz: {tr.effective_ghz:.3f}, busy_ratio: {tr.busy_ratio:.3f}" if args.use_freq else ""))
     print_avg_time_ranges_data(trs)
 
 if __name__ == "__main__":
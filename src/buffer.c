@@ -72,12 +72,16 @@ static int hrp_alloc_rb_buf(HrperfRingBuffer *rb) {
 #endif
 
 inline __attribute__((always_inline)) bool is_full(const HrperfRingBuffer *rb) {
-    return ((rb->tail + 1) % HRP_PMC_BUFFER_SIZE) == rb->head;
+    return ((rb->tail + 1) % HRP_PMC_BUFFER_SIZE) == rb_head(rb);
 }
 
 inline __attribute__((always_inline)) int init_ring_buffer(HrperfRingBuffer *rb) {
     rb->head = 0;
     rb->tail = 0;
+    rb->max_occupancy = 0;
+    rb->produced = 0;
+    rb->dropped = 0;
+    rb->logged_bytes = 0;
 #if HRP_HEAP_ALLOCATED_RB
     int r = hrp_alloc_rb_buf(rb);
     return r;
@@ -86,14 +90,80 @@ inline __attribute__((always_inline)) int init_ring_buffer(HrperfRingBuffer *rb)
 #endif
 }
 
+#if HRP_MMAP_RB
+HrperfRingBuffer *alloc_ring_buffer(void) {
+    // page aligned and zeroed, so it can be remapped to user space as is
+    HrperfRingBuffer *rb = vmalloc_user(HRP_RB_MMAP_SIZE);
+    if (!rb) {
+        pr_err("hrperf: Failed to allocate mmap-able ring buffer of size %lu\n",
+               (unsigned long)HRP_RB_MMAP_SIZE);
+        return NULL;
+    }
+    init_ring_buffer(rb);
+    return rb;
+}
+
+void free_ring_buffer(HrperfRingBuffer *rb) {
+    vfree(rb);
+}
+#endif
+
 inline __attribute__((always_inline)) void enqueue(HrperfRingBuffer *rb, HrperfLogEntry data) {
     unsigned int next_tail = (rb->tail + 1) % HRP_PMC_BUFFER_SIZE;
+    unsigned int head = rb_head(rb);
+    unsigned int occupancy;
 
-    if (next_tail == rb->head) {
+#if HRP_LOG_SEQ
+    data.seq = (unsigned int)rb->produced;
+#endif
+    rb->produced++;
+
+    if (next_tail == head) {
         // buffer is full, data will be lost
+        rb->dropped++;
         return;
     }
 
     rb->buffer[rb->tail] = data;
     smp_store_release(&rb->tail, next_tail);
+
+    occupancy = (next_tail + HRP_PMC_BUFFER_SIZE - head) % HRP_PMC_BUFFER_SIZE;
+    if (occupancy > rb->max_occupancy) {
+        rb->max_occupancy = occupancy;
+    }
+}
+
+// Flight-recorder variant of enqueue: a full ring loses its oldest entry
+// instead of the new one. The producer moves head as well, so nothing may
+// consume the ring concurrently.
+inline __attribute__((always_inline)) void enqueue_overwrite(HrperfRingBuffer *rb, HrperfLogEntry data) {
+    unsigned int next_tail = (rb->tail + 1) % HRP_PMC_BUFFER_SIZE;
+    unsigned int head = rb_head(rb);
+    unsigned int occupancy;
+
+#if HRP_LOG_SEQ
+    data.seq = (unsigned int)rb->produced;
+#endif
+    rb->produced++;
+
+    if (next_tail == head) {
+        // the oldest entry is overwritten
+        head = (head + 1) % HRP_PMC_BUFFER_SIZE;
+        rb->head = head;
+        rb->dropped++;
+    }
+
+    rb->buffer[rb->tail] = data;
+    smp_store_release(&rb->tail, next_tail);
+
+    occupancy = (next_tail + HRP_PMC_BUFFER_SIZE - head) % HRP_PMC_BUFFER_SIZE;
+    if (occupancy > rb->max_occupancy) {
+        rb->max_occupancy = occupancy;
+    }
+}
+
+// Account an entry that was not stored, it still takes a sequence number
+inline __attribute__((always_inline)) void count_dropped(HrperfRingBuffer *rb) {
+    rb->produced++;
+    rb->dropped++;
 }
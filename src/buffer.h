@@ -3,6 +3,7 @@
 
 #include <linux/types.h>
 #include <linux/ktime.h>
+#include <linux/mm.h>
 
 #include "config.h"
 
@@ -18,31 +19,141 @@ typedef struct {
     unsigned long long imc_writes;
 #endif
 #if HRP_USE_RDT
+#if !HRP_RDT_BATCHED
     unsigned long long total_bw;
 #if HRP_RDT_INCLUDE_LOCAL_BW
     unsigned long long local_bw;
 #endif
     unsigned long long occupancy;
 #endif
+#if HRP_RDT_TAGS
+    unsigned long long rmid; // of total_bw and occupancy
+#endif
+#endif
+#if HRP_USE_MULTIPLEXING
+    unsigned long long group_id;     // the group on the PMCs for this sample
+    unsigned long long time_enabled; // log clock time since monitoring began
+    unsigned long long time_running; // log clock time this group was counted
+#endif
+#if HRP_USE_ALL_COUNTERS
+    unsigned long long ref_cycles; // fixed counter 2, 0 if not present
+    unsigned long long slots;      // fixed counter 3, 0 if not present
+    unsigned long long pmc[HRP_NUM_TICK_PMCS - 3]; // PMC3 onwards
+#endif
+#if HRP_USE_TOPDOWN
+    unsigned long long td_slots;     // slots in this sample window
+    unsigned long long perf_metrics; // PERF_METRICS of this sample window
+#endif
+#if HRP_LOG_FREQ
+    unsigned long long aperf;
+    unsigned long long mperf;
+#endif
+#if HRP_ADAPTIVE_INTERVAL
+    unsigned long long interval; // log clock time since the previous sample
+#endif
+#if HRP_LOG_SCHED_SWITCH
+    unsigned long long prev_tid; // the thread the window up to here belongs to
+    unsigned long long next_tid; // the thread running after the sample
+#endif
+#if HRP_INSTRUCTED_LOCKLESS
+    unsigned long long poll_tid; // the thread of the instructed poll, else 0
+#endif
+#if HRP_LOG_POLL_ID
+    unsigned long long poll_id; // the number of the instructed poll, else 0
+#endif
 } HrperfTick;
 
+/*
+ * Records that are not counter samples, e.g. the programmed events, carry
+ * HRP_LOG_MARKER_CPU as cpu_id and reuse the tick as a HrperfMarker.
+ */
+#define HRP_LOG_MARKER_CPU (-1)
+// the RDT records of a node (HRP_RDT_BATCHED) come from a ring of their own,
+// with its own sequence numbers, and are markers with this cpu_id
+#define HRP_LOG_RDT_CPU(node) (-2 - (node))
+#define HRP_LOG_MARKER_NARGS 4
+
+// args: (group << 16) | counter index, evtsel, offcore_rsp, name_id
+#define HRP_LOG_MARKER_EVENT_SEL 1
+// a flight-recorder dump follows, the samples before it are older; args: the
+// number of the dump
+#define HRP_LOG_MARKER_DUMP 2
+// the poller entered burst sampling; args: the CPU above burst_core_mbps, or
+// -1 - node for a NUMA node above burst_node_mbps, the highest CPU and the
+// highest node bandwidth in MB/s, burst_window_us
+#define HRP_LOG_MARKER_BURST_START 3
+// the burst ended; args: the number of poll rounds it took
+#define HRP_LOG_MARKER_BURST_END 4
+// RDT counters of an RMID read by the housekeeping thread of a node
+// (HRP_RDT_BATCHED), with HRP_LOG_RDT_CPU(node) as cpu_id; args: (node << 48) | (core << 32) | rmid, with core
+// MBM_NO_CORE for tagged RMIDs, total_bw, local_bw, occupancy
+#define HRP_LOG_MARKER_RDT 5
+
+typedef struct {
+    u64 kts;
+    unsigned long long type;
+    unsigned long long args[HRP_LOG_MARKER_NARGS];
+} HrperfMarker;
+
 typedef struct __attribute__((__packed__)) {
     int cpu_id;
-    HrperfTick tick;
+#if HRP_LOG_SEQ
+    unsigned int seq; // position in its ring's sequence, see HRP_LOG_SEQ
+#endif
+    union {
+        HrperfTick tick;
+        HrperfMarker marker;
+    };
 } HrperfLogEntry;
 
+_Static_assert(sizeof(HrperfMarker) <= sizeof(HrperfTick),
+               "a marker must fit in the smallest tick");
+
 typedef struct {
 #if HRP_HEAP_ALLOCATED_RB
     HrperfLogEntry *buffer;
 #else
     HrperfLogEntry buffer[HRP_PMC_BUFFER_SIZE];
 #endif
-    volatile unsigned int head;
     volatile unsigned int tail;
+    // statistics, logged_bytes is updated by the consumer, the rest by the
+    // producer
+    unsigned int max_occupancy;
+    unsigned long long produced;
+    unsigned long long dropped;
+    unsigned long long logged_bytes;
+#if HRP_MMAP_RB
+    // on a page of its own, the only one a user space consumer may write; read
+    // it with rb_head
+    volatile unsigned int head __aligned(PAGE_SIZE);
+#else
+    volatile unsigned int head;
+#endif
 } HrperfRingBuffer;
 
+// The consumer index, in bounds even if user space wrote garbage to it
+static __always_inline unsigned int rb_head(const HrperfRingBuffer *rb) {
+    return READ_ONCE(rb->head) % HRP_PMC_BUFFER_SIZE;
+}
+
 bool is_full(const HrperfRingBuffer *rb);
 int init_ring_buffer(HrperfRingBuffer *rb);
 void enqueue(HrperfRingBuffer *rb, HrperfLogEntry data);
+void enqueue_overwrite(HrperfRingBuffer *rb, HrperfLogEntry data);
+void count_dropped(HrperfRingBuffer *rb);
+
+#if HRP_MMAP_RB
+#if HRP_HEAP_ALLOCATED_RB
+#error "HRP_MMAP_RB requires HRP_HEAP_ALLOCATED_RB to be 0"
+#endif
+// Each ring buffer takes HRP_RB_MMAP_SIZE of the mmap offsets. The entries and
+// the producer state can only be mapped read-only, the page of the head index
+// at HRP_RB_MMAP_HEAD_OFFSET is mapped on its own and may be writable.
+#define HRP_RB_MMAP_SIZE PAGE_ALIGN(sizeof(HrperfRingBuffer))
+#define HRP_RB_MMAP_HEAD_OFFSET offsetof(HrperfRingBuffer, head)
+
+HrperfRingBuffer *alloc_ring_buffer(void);
+void free_ring_buffer(HrperfRingBuffer *rb);
+#endif
 
 #endif // BUFFER_H
@@ -11,14 +11,94 @@
 #define HRP_PMC_BUFFER_SIZE 4096
 
 // the poller thread will sleep for this interval, in microseconds
+// (defaults of the poll_interval_us_low/high module parameters)
 #define HRP_PMC_POLL_INTERVAL_US_LOW 20
 #define HRP_PMC_POLL_INTERVAL_US_HIGH 25
 
+// Sampling engines of the polling profile mode, chosen at load time by the
+// `sampling_mode` module parameter.
+// HRP_SAMPLING_MODE_IPI: the poller thread on HRP_PMC_POLLER_CPU sends IPIs to
+// all selected CPUs via smp_call_function_many, one round per poll interval.
+// HRP_SAMPLING_MODE_HRTIMER: each selected CPU arms its own pinned hrtimer and
+// polls its own PMUs locally, no poller core and no IPIs are needed. The timers
+// are phase-aligned to a shared epoch, so samples still line up across CPUs.
+// HRP_SAMPLING_MODE_OVERFLOW: each selected CPU takes a sample whenever its
+// trigger counter (PMC0 or PMC1, see `overflow_counter`) has counted another
+// `overflow_period` events, from the counter overflow interrupt (PMI). Samples
+// are dense when the trigger event is frequent and rare when the core is idle.
+// The PMI is delivered as an NMI, so the NMI watchdog should not be using the
+// PMU (nmi_watchdog=0).
+#define HRP_SAMPLING_MODE_IPI 0
+#define HRP_SAMPLING_MODE_HRTIMER 1
+#define HRP_SAMPLING_MODE_OVERFLOW 2
+#define HRP_SAMPLING_MODE_DEFAULT HRP_SAMPLING_MODE_IPI
+
+// the period of the per-CPU hrtimers, in microseconds
+// (default of the hrtimer_interval_us module parameter)
+#define HRP_PMC_HRTIMER_INTERVAL_US 20
+// delay between arming the per-CPU hrtimers and their first shared expiry,
+// must be long enough for all selected CPUs to arm their timers
+#define HRP_PMC_HRTIMER_START_DELAY_US 1000
+
+// default number of trigger counter events between two samples in the
+// overflow sampling mode
+#define HRP_PMC_OVERFLOW_PERIOD_DEFAULT 100000
+
+// Set to 1 to adapt the poll interval of the IPI sampling mode to the
+// activity of the selected CPUs. After each round, the poller looks at how much
+// the PMC0 rate (memory traffic) and the IPC of each CPU changed over the last
+// window: the interval is halved when some CPU changed by more than
+// `adaptive_threshold` permille and grows by a quarter while all CPUs are
+// steady, within [`adaptive_min_us`, `adaptive_max_us`]. A non-zero
+// `adaptive_budget` caps the samples per second over all CPUs, with bursts of
+// up to one second of budget, and wins over `adaptive_max_us`. Every sample
+// then carries the log clock time since the previous sample of its CPU
+// (`interval`), whatever the sampling mode.
+#define HRP_ADAPTIVE_INTERVAL 0
+// defaults of the adaptive_* module parameters
+#define HRP_ADAPTIVE_MIN_US 10
+#define HRP_ADAPTIVE_MAX_US 1000
+#define HRP_ADAPTIVE_THRESHOLD 100
+#define HRP_ADAPTIVE_BUDGET 0
+
+// Set to 1 to let the IPI poller switch into burst sampling on its own. It
+// polls at the base interval (`poll_interval_us_low/high`, e.g. 1000 us) and
+// computes the bandwidth of each CPU from PMC0 + PMC1 (offcore reads and
+// writes with HRP_USE_OFFCORE), and of each NUMA node as the sum of its CPUs
+// or, with HRP_LOG_IMC, from the IMC CAS counts. When a CPU goes above
+// `burst_core_mbps` or a node above `burst_node_mbps` (0 disables either), it
+// polls every `burst_interval_us` for `burst_window_us`, then falls back to the
+// base interval, or starts the next burst right away if the threshold is still
+// crossed. The start and the
+// end of each burst are recorded as markers. Cannot be combined with
+// HRP_ADAPTIVE_INTERVAL.
+#define HRP_BURST_SAMPLING 0
+// defaults of the burst_* module parameters
+#define HRP_BURST_INTERVAL_US 20
+#define HRP_BURST_WINDOW_US 10000
+#define HRP_BURST_CORE_MBPS 0
+#define HRP_BURST_NODE_MBPS 0
+
+#if HRP_BURST_SAMPLING && HRP_ADAPTIVE_INTERVAL
+#error "HRP_BURST_SAMPLING and HRP_ADAPTIVE_INTERVAL both drive the poll interval"
+#endif
+
 // how many rounds of PMC polling before each logging
+// (default of the polling_logging_ratio module parameter)
 #define HRP_PMC_POLLING_LOGGING_RATIO 1000
 
 #define HRP_PMC_LOG_PATH "/hrperf_log.bin"
 
+// Set to 1 to run one logger thread per NUMA node instead of the single one on
+// `logger_cpu`. Each logger stays on the CPUs of its node and drains only the
+// rings of the node's CPUs into its own file, `log_dir`/hrperf_log.node<N>.bin,
+// so no ring is copied across sockets. The markers go into the file of the
+// first node. parse_hrp.py merges the files of a directory.
+#define HRP_LOG_PER_NODE 0
+// default of the log_dir module parameter
+#define HRP_PMC_LOG_DIR "/"
+
+// defaults of the logger_cpu and poller_cpu module parameters
 #define HRP_PMC_LOGGER_CPU 0
 #define HRP_PMC_POLLER_CPU 1
 
@@ -55,15 +135,37 @@
 // fails
 #define HRP_EXLARGE_HEAP_ALLOCATED_RB 0
 
+// set to 1 to allow user space to mmap each CPU's ring buffer, including its
+// head/tail indices, through /dev/hrperf_device. The ring buffers are then
+// allocated with vmalloc_user, so HRP_HEAP_ALLOCATED_RB must be 0.
+// A user space consumer can drain samples without syscalls, in which case the
+// kernel logger should be disabled with the `kernel_logger=n` module parameter.
+#define HRP_MMAP_RB 0
+
 // set to 1 if you intend to use instructed profile mode concurrently,
 // e.g., invoke poll or log ioctl concurrently.
-// This will enforce synchronization across these actions.
+// Polls then run in the calling thread without a global lock: each CPU keeps
+// the time of the last poll it served and a poll stamped earlier, overtaken by
+// a later one, logs that sample again. The samples carry the polling thread as
+// `poll_tid`, the parser pairs each thread's polls by it. Logs lock the loggers
+// one by one, and changes of the events or CPUs wait for the running ops. With
+// HRP_STRICT_POLLING_SYNC, whose barrier is global, the ops are serialized and
+// the samples have no `poll_tid`.
 // If you only use instructed profile mode in a single thread, set to 0 for
 // better performance. Note: this flag only effective when instructed profile
 // mode is enabled.
 #define CONCURRENT_INSTRUCTED_PROFILE 0
+#define HRP_INSTRUCTED_LOCKLESS \
+    (CONCURRENT_INSTRUCTED_PROFILE && !HRP_STRICT_POLLING_SYNC)
+
+// set to 1 to number the instructed polls, full or targeted, and log the
+// number of its poll in each sample as `poll_id` (0 outside instructed polls).
+// The parser pairs the start and end polls of a range by it, rather than by
+// counting the samples of each CPU.
+#define HRP_LOG_POLL_ID 1
 
-// the bitmask for selecting which cores to monitor
+// the bitmask for selecting which cores to monitor, unless the cpus module
+// parameter is given
 #define HRP_PMC_CPU_SELECTION_MASK_BITS 256
 static const unsigned long hrp_pmc_cpu_selection_mask_bits[HRP_PMC_CPU_SELECTION_MASK_BITS /
                                                            64] = {
@@ -93,12 +195,125 @@ static const unsigned long hrp_pmc_cpu_selection_mask_bits[HRP_PMC_CPU_SELECTION
 #define HRP_USE_WRITE_EST                                                      \
   1 // set to 1 to use write estimation PMU events, 0 to disable
 
+// Set to 1 to multiplex several event groups on the general-purpose counters,
+// e.g. the offcore and the cache-miss/prefetch events in one run. Each selected
+// CPU switches to the next group every `mux_rotate_samples` samples, and each
+// sample carries the group id and the time the group has been enabled and
+// running, so that the parser can scale the counts. The default groups are the
+// offcore events and the cache-miss/prefetch events of HRP_ARCH_NAME, other
+// groups can be set with HRP_PMC_IOC_SET_GROUPS. Not supported by the overflow
+// sampling mode.
+#define HRP_USE_MULTIPLEXING 0
+#define HRP_MUX_MAX_GROUPS 4
+#define HRP_MUX_ROTATE_SAMPLES_DEFAULT 50
+
+// Set to 1 to use every general-purpose counter reported by CPUID leaf 0xA (up
+// to HRP_NUM_GP_EVENTS, e.g. 8 per core on Sapphire Rapids with HT off) and
+// fixed counters 2 (reference cycles) and 3 (topdown slots) where available.
+// The tick then carries PMC3-PMC7, ref_cycles and slots. By default the
+// cache-miss/prefetch events go on PMC3/PMC4 next to the offcore events on
+// PMC0-PMC2, so that one run captures both. Set to 0 for PMC0-PMC2 and fixed
+// counters 0-1 only.
+#define HRP_USE_ALL_COUNTERS 0
+
+// Set to 1 to log the top-down (TMA) level-1 and level-2 breakdown of each
+// sample window: frontend bound, bad speculation, backend bound and retiring,
+// and on Sapphire Rapids also fetch latency, branch mispredicts, memory bound
+// and heavy operations. Uses fixed counter 3 (slots) and PERF_METRICS, which
+// are read and cleared at every sample, so Ice Lake or newer is required.
+#define HRP_USE_TOPDOWN 0
+
+// Set to 1 to log APERF and MPERF in each sample. MPERF counts at the TSC
+// frequency and APERF at the actual frequency while the core is in C0, so the
+// parser can derive the effective frequency and the busy ratio of each window,
+// which cpu_unhalt alone cannot tell apart under turbo or power capping.
+#define HRP_LOG_FREQ 0
+
+// Set to 1 to also take a sample at every context switch on the selected CPUs,
+// from the sched_switch tracepoint, so that no sample window spans two threads.
+// Each sample carries the thread ids `prev_tid` and `next_tid`: the outgoing and
+// the incoming thread for a context switch, both the running thread for the
+// other samples. The window ending at a sample thus belongs to its `prev_tid`.
+// parse_hrp.py builds the threads_scheduling table from the context switches,
+// so `perf sched record` is not needed. Only in the polling profile modes, and
+// not in the overflow sampling mode. The periodic samples are then stamped with
+// the time they are read rather than the polling round or grid point, so that
+// the log of each CPU stays in order, and only they advance the rotation of
+// HRP_USE_MULTIPLEXING.
+#define HRP_LOG_SCHED_SWITCH 0
+
+// Set to 1 to keep per-thread totals of the counters over the time each thread
+// actually ran on a selected CPU. At every context switch, the counts since the
+// switch-in are added to the outgoing thread's slot in a table, read by tid
+// with HRP_PMC_IOC_TASK_COUNTERS; a thread reading its own totals also gets its
+// current run. Slots are freed when their thread exits, on any CPU. PMC0-2
+// count whatever is programmed on them, so they mix the groups with
+// HRP_USE_MULTIPLEXING, and the overflow sampling mode is not supported.
+#define HRP_TASK_COUNTERS 0
+// slots of the table, a power of 2
+#define HRP_TASK_TABLE_SIZE 8192
+// slots searched for a thread, from the one its tid maps to
+#define HRP_TASK_TABLE_PROBES 16
+
+// the sched_switch tracepoint is hooked for either of the above, or for
+// HRP_RDT_TAGS
+#define HRP_SCHED_SWITCH_HOOK \
+    (HRP_LOG_SCHED_SWITCH || HRP_TASK_COUNTERS || HRP_RDT_TAGS)
+
+// Set to 1 to number the entries of each ring buffer, the `seq` field right
+// after cpu_id. Samples dropped because the ring was full still take a number,
+// so gaps in the sequence show where data was lost. The per-ring counts are
+// also available through debugfs and HRP_PMC_IOC_GET_STATS.
+#define HRP_LOG_SEQ 1
+
+// Set to 1 to write the log file in the compact format (HRP_LOG_FORMAT_COMPACT)
+// instead of the raw entries. Every logger pass writes the new entries of each
+// ring buffer as a block: a hrp_log_block_t with the cpu_id, followed by the
+// first entry as varints and every later entry as zigzag varint deltas to the
+// one before, so the high-order counter bits that never change are not
+// written again. Only the logger thread encodes, the mmap-ed rings and
+// drain_rb keep the raw entries.
+#define HRP_LOG_COMPACT 0
+
 #define HRP_USE_RDT     0 // set to 1 to use RDT events (MBM, CMT), 0 to disable
 /*
  * Set to 1 to include local bandwidth in RDT events, 0 to exclude.
  * If HRP_USE_RDT is set to 0, this flag will be ignored.
  */ 
 #define HRP_RDT_INCLUDE_LOCAL_BW 0
+/*
+ * Each CPU reads its RDT counters at most once per this interval, the samples
+ * in between repeat the last values. MBM only updates about every millisecond
+ * and a read costs a wrmsr/rdmsr pair per event. 0 reads at every sample.
+ * Runtime tunable as rdt_interval_us. The logged total_bw and local_bw are
+ * widened to 64 bits by the module, they do not wrap.
+ */
+#define HRP_RDT_INTERVAL_US 1000
+/*
+ * Set to 1 to monitor RDT per workload instead of per core. Threads, processes
+ * or cgroups are tagged with RMIDs through HRP_PMC_IOC_RDT_TAG. At every
+ * context switch, on all CPUs, IA32_PQR_ASSOC is set to the RMID of the
+ * incoming task: its thread's tag, else its process's, else the tag of its
+ * cgroup or the closest tagged ancestor, else the core's RMID. Each sample
+ * reads the RMID active on its CPU and logs it as `rmid`. Needs HRP_USE_RDT.
+ */
+#define HRP_RDT_TAGS 0
+#if HRP_RDT_TAGS && !HRP_USE_RDT
+#error "HRP_RDT_TAGS needs HRP_USE_RDT"
+#endif
+/*
+ * Set to 1 to take the RDT reads out of the samples. A housekeeping thread per
+ * node, kept off the selected CPUs when the node has others, reads the RMIDs
+ * of the node's cores and all tagged RMIDs back to back every rdt_interval_us,
+ * without being migrated meanwhile, and logs them as HRP_LOG_MARKER_RDT records
+ * into a ring of the node, drained like the CPU rings. The samples have no
+ * total_bw, local_bw and occupancy then. Needs HRP_USE_RDT and the polling
+ * profile.
+ */
+#define HRP_RDT_BATCHED 0
+#if HRP_RDT_BATCHED && !HRP_USE_RDT
+#error "HRP_RDT_BATCHED needs HRP_USE_RDT"
+#endif
 
 // Specify which core the IMC event will be stored at.
 // when logging the IMC events, we only log the total reads/writes numbers to
@@ -134,6 +349,208 @@ typedef struct {
     u32 core_id;    // Core ID to set RMID on
 } rmid_set_info_t;
 
+// kinds of RMID tags, see HRP_PMC_IOC_RDT_TAG
+#define HRP_RDT_TAG_TID 0
+#define HRP_RDT_TAG_PID 1
+#define HRP_RDT_TAG_CGROUP 2    // id: the inode number of its cgroup2 directory
+#define HRP_RDT_N_TAG_KINDS 3
+typedef struct {
+    u32 kind;       // HRP_RDT_TAG_*
+    u32 rmid;       // RMID to tag with, 0 removes the tag
+    u64 id;         // tid, pid or cgroup id
+} rmid_tag_info_t;
+
+// describes the ring buffer mapping of each CPU, see HRP_MMAP_RB
+typedef struct {
+    u64 mmap_size;      // bytes per CPU, CPU n is mapped at offset n * mmap_size
+    u32 n_entries;      // capacity of the ring, in entries
+    u32 entry_size;     // sizeof(HrperfLogEntry)
+    u32 head_offset;    // offset of the page of the u32 head index, the
+                        // consumer's, mapped on its own and writable
+    u32 tail_offset;    // offset of the u32 tail index (producer owned), the
+                        // entries and the tail are mapped read-only
+    u32 marker_index;   // the marker ring is mapped as this CPU index,
+                        // nr_cpu_ids
+    u32 rdt_index;      // the RDT ring of node n is mapped as CPU index
+                        // rdt_index + n, for n < n_rdt_nodes
+    u32 n_rdt_nodes;    // 0 without HRP_RDT_BATCHED, some nodes may have none
+} hrp_rb_layout_t;
+
+// maximum number of general-purpose counters an event selection describes
+#define HRP_NUM_GP_EVENTS 8
+
+// number of general-purpose counters sampled in each tick
+#if HRP_USE_ALL_COUNTERS
+#define HRP_NUM_TICK_PMCS HRP_NUM_GP_EVENTS
+#else
+#define HRP_NUM_TICK_PMCS 3 // PMC0-PMC2
+#endif
+
+// ids naming the programmed events in the log, so that the parser can label
+// the PMC columns. Keep in sync with HRP_EVENT_NAMES in parsing/parse_hrp.py
+#define HRP_EVENT_ID_NONE 0
+#define HRP_EVENT_ID_LLC_MISSES 1
+#define HRP_EVENT_ID_SW_PREFETCH 2
+#define HRP_EVENT_ID_STALLS_MEM 3
+#define HRP_EVENT_ID_OCR_READS 4
+#define HRP_EVENT_ID_OCR_WRITES 5
+#define HRP_EVENT_ID_OCR_WRITE_EST 6
+
+typedef struct {
+    u64 evtsel;         // raw IA32_PERFEVTSELx value, including the enable bits
+    u64 offcore_rsp;    // OFFCORE_RSP value for offcore events, 0 otherwise
+    u32 name_id;        // one of HRP_EVENT_ID_*
+    u32 reserved;
+} hrp_event_sel_t;
+
+// events[i] is programmed on PMCi, a zero evtsel leaves the counter disabled.
+// Only the first HRP_NUM_TICK_PMCS counters present on the CPU are used.
+typedef struct {
+    hrp_event_sel_t events[HRP_NUM_GP_EVENTS];
+} hrp_event_config_t;
+
+// event groups multiplexed on the general-purpose counters, see
+// HRP_USE_MULTIPLEXING
+typedef struct {
+    u32 n_groups;       // number of valid entries in groups
+    u32 rotate_samples; // samples per group before switching, 0 to keep
+    hrp_event_config_t groups[HRP_MUX_MAX_GROUPS];
+} hrp_event_groups_t;
+
+// Header at the start of the log file, written when the file is created. It
+// describes the layout of the entries that follow and the setup of the run,
+// so that the parsers no longer depend on matching flags. The arrays follow
+// the fixed part in this order, their lengths are recorded in the header.
+#define HRP_LOG_HEADER_MAGIC "HRPERFLG"
+#define HRP_LOG_HEADER_VERSION 2
+#define HRP_LOG_MAX_FIELDS 64
+#define HRP_LOG_FIELD_NAME_LEN 24
+
+// timestamp source of the entries, see HRP_USE_TSC and HRP_USE_RAW_CLOCK
+#define HRP_LOG_CLOCK_REAL 0
+#define HRP_LOG_CLOCK_RAW 1
+#define HRP_LOG_CLOCK_TSC 2
+
+// encoding of the entries after the header, see HRP_LOG_COMPACT
+#define HRP_LOG_FORMAT_RAW 0
+#define HRP_LOG_FORMAT_COMPACT 1
+
+typedef struct {
+    char name[HRP_LOG_FIELD_NAME_LEN]; // column name used by the parsers
+    u32 offset;         // from the start of the entry
+    u32 size;           // 4 for cpu_id, 8 for the counters
+} hrp_log_field_t;
+
+typedef struct {
+    char magic[8];      // HRP_LOG_HEADER_MAGIC, not NUL-terminated
+    u32 version;        // HRP_LOG_HEADER_VERSION
+    u32 header_size;    // the entries start at this file offset
+    u32 entry_size;     // sizeof(HrperfLogEntry)
+    u32 n_fields;       // valid entries in fields
+    u32 max_fields;     // HRP_LOG_MAX_FIELDS
+    u32 cpu_mask_words; // length of cpu_mask
+    u32 max_groups;     // HRP_MUX_MAX_GROUPS
+    u32 n_gp_events;    // HRP_NUM_GP_EVENTS
+    u32 clock;          // one of HRP_LOG_CLOCK_*
+    u32 sampling_mode;  // HRP_SAMPLING_MODE_*, or -1 for instructed profile
+    u32 sampling_period; // poll or hrtimer interval in us, or overflow events
+    u32 format;         // HRP_LOG_FORMAT_*, added in version 2
+    u64 tsc_khz;        // TSC frequency
+    u64 rdt_scale;      // bytes per RDT counter unit, 0 without RDT
+    u64 start_walltime_ns; // CLOCK_REALTIME when the header was made
+    u64 start_kts;      // log clock at the same time
+    hrp_log_field_t fields[HRP_LOG_MAX_FIELDS];
+    u64 cpu_mask[HRP_PMC_CPU_SELECTION_MASK_BITS / 64]; // monitored CPUs
+    hrp_event_groups_t events; // programmed events
+} hrp_log_header_t;
+
+// A block of the compact format holds consecutive entries of one ring. The
+// payload has, for each entry, `seq` (if logged) and then every u64 of the
+// tick as LEB128 varints: plain values for the first entry of the block, and
+// zigzag-encoded differences to the previous entry for the others. Each block
+// decodes on its own.
+#define HRP_LOG_BLOCK_MAGIC 0x42505248 // "HRPB"
+
+typedef struct {
+    u32 magic;          // HRP_LOG_BLOCK_MAGIC
+    s32 cpu_id;         // of all the entries, HRP_LOG_MARKER_CPU for markers,
+                        // HRP_LOG_RDT_CPU(node) for the RDT records
+    u32 n_entries;
+    u32 size;           // bytes of payload after this struct
+} hrp_log_block_t;
+
+// statistics of one ring buffer, see HRP_PMC_IOC_GET_STATS
+typedef struct {
+    u64 produced;       // entries enqueued, including the dropped ones
+    u64 dropped;        // entries lost because the ring was full
+    u64 logged_bytes;   // bytes written to the log file by the kernel logger
+    u32 max_occupancy;  // most entries ever waiting in the ring
+    u32 valid;          // 1 if the CPU has a ring buffer
+} hrp_rb_stats_t;
+
+// statistics of the sampling pipeline, durations are in ns
+typedef struct {
+    u64 poll_rounds;    // IPI poll rounds, including instructed polls
+    u64 poll_ns_total;
+    u64 poll_ns_max;
+    u64 log_passes;     // passes of the kernel logger over all rings
+    u64 log_ns_total;
+    u64 log_ns_max;
+    hrp_rb_stats_t marker;
+    hrp_rb_stats_t rdt; // the RDT rings of all nodes, with HRP_RDT_BATCHED
+    hrp_rb_stats_t cpus[HRP_PMC_CPU_SELECTION_MASK_BITS]; // indexed by CPU id
+} hrp_stats_t;
+
+// log2 histograms of one CPU's sampling windows, see HRP_PMC_IOC_GET_HIST.
+// Bucket 0 counts the windows with a value of 0, bucket i > 0 those with a
+// value in [2^(i-1), 2^i).
+#define HRP_HIST_BUCKETS 64
+#define HRP_HIST_BANDWIDTH 0    // PMC0 + PMC1 lines, in MB/s
+#define HRP_HIST_IPC 1          // instructions per cycle, in 1/1000
+#define HRP_HIST_STALL 2        // PMC2 stall cycles per cycle, in 1/1000
+#define HRP_HIST_N_METRICS 3
+typedef struct {
+    u32 cpu;            // in: the CPU to read
+    u32 valid;          // out: 1 if the CPU is sampled
+    u64 windows;        // out: windows counted, halted windows have no IPC
+    u64 buckets[HRP_HIST_N_METRICS][HRP_HIST_BUCKETS];
+} hrp_hist_t;
+
+// totals of one thread's counters over the time it ran, see
+// HRP_PMC_IOC_TASK_COUNTERS
+typedef struct {
+    u32 tid;            // in: the thread to read
+    u32 valid;          // out: 1 if the thread has run on a selected CPU
+    u64 runs;           // times it was switched out
+    u64 run_kts;        // log clock time it ran
+    u64 stall_mem;      // PMC2
+    u64 inst_retire;
+    u64 cpu_unhalt;
+    u64 llc_misses;     // PMC0, offcore reads with HRP_USE_OFFCORE
+    u64 sw_prefetch;    // PMC1, offcore writes with HRP_USE_OFFCORE
+} hrp_task_counters_t;
+
+// a synchronous read of the counters of some CPUs, see HRP_PMC_IOC_SNAPSHOT.
+// The entries have the layout of the log entries, entry_size bytes each as
+// described by the log header, and are written by increasing CPU id.
+typedef struct {
+    u64 cpu_mask[HRP_PMC_CPU_SELECTION_MASK_BITS / 64]; // in: CPUs to read
+    u64 entries;        // in: user address of the buffer for the entries
+    u32 max_entries;    // in: entries the buffer holds
+    u32 n_entries;      // out: entries written, one per sampled CPU asked for
+} hrp_snapshot_t;
+
+// an instructed poll of some sampled CPUs only, see
+// HRP_PMC_IOC_INSTRUCTED_POLL_CPUS. With HRP_POLL_CPUS_SELF the mask is ignored
+// and the CPU running the ioctl polls itself, without an IPI.
+#define HRP_POLL_CPUS_SELF 0x1
+#define HRP_POLL_CPUS_LOG  0x2 // log afterwards, like INSTRUCTED_POLL_AND_LOG
+typedef struct {
+    u64 cpu_mask[HRP_PMC_CPU_SELECTION_MASK_BITS / 64]; // in: CPUs to poll
+    u32 flags;          // in: HRP_POLL_CPUS_*
+    u32 n_polled;       // out: sampled CPUs polled
+} hrp_poll_cpus_t;
+
 #define HRP_PMC_MAJOR_NUMBER 283
 #define HRP_PMC_DEVICE_NAME "hrperf_device"
 #define HRP_PMC_CLASS_NAME "hrperf_class"
@@ -147,6 +564,20 @@ typedef struct {
 #define HRP_PMC_IOC_TSC_FREQ                _IOR(HRP_PMC_IOC_MAGIC, 10, u64)
 #define HRP_PMC_IOC_RDT_SCALE_FACTOR        _IOR(HRP_PMC_IOC_MAGIC, 11, u32)
 #define HRP_PMC_IOC_RDT_MAX_RMID            _IOR(HRP_PMC_IOC_MAGIC, 12, u32)
+#define HRP_PMC_IOC_RB_LAYOUT               _IOR(HRP_PMC_IOC_MAGIC, 13, hrp_rb_layout_t)
+#define HRP_PMC_IOC_SET_EVENTS              _IOW(HRP_PMC_IOC_MAGIC, 14, hrp_event_config_t)
+#define HRP_PMC_IOC_GET_EVENTS              _IOR(HRP_PMC_IOC_MAGIC, 15, hrp_event_config_t)
+#define HRP_PMC_IOC_SET_GROUPS              _IOW(HRP_PMC_IOC_MAGIC, 16, hrp_event_groups_t)
+#define HRP_PMC_IOC_GET_GROUPS              _IOR(HRP_PMC_IOC_MAGIC, 17, hrp_event_groups_t)
+#define HRP_PMC_IOC_LOG_HEADER              _IOR(HRP_PMC_IOC_MAGIC, 18, hrp_log_header_t)
+#define HRP_PMC_IOC_GET_STATS               _IOR(HRP_PMC_IOC_MAGIC, 19, hrp_stats_t)
+#define HRP_PMC_IOC_DUMP                    _IO(HRP_PMC_IOC_MAGIC, 20)
+#define HRP_PMC_IOC_GET_HIST                _IOWR(HRP_PMC_IOC_MAGIC, 21, hrp_hist_t)
+#define HRP_PMC_IOC_RESET_HIST              _IO(HRP_PMC_IOC_MAGIC, 22)
+#define HRP_PMC_IOC_TASK_COUNTERS           _IOWR(HRP_PMC_IOC_MAGIC, 23, hrp_task_counters_t)
+#define HRP_PMC_IOC_RDT_TAG                 _IOW(HRP_PMC_IOC_MAGIC, 24, rmid_tag_info_t)
+#define HRP_PMC_IOC_SNAPSHOT                _IOWR(HRP_PMC_IOC_MAGIC, 25, hrp_snapshot_t)
+#define HRP_PMC_IOC_INSTRUCTED_POLL_CPUS    _IOWR(HRP_PMC_IOC_MAGIC, 26, hrp_poll_cpus_t)
 
 /*
     BPF Component Configurations, CURRENTLY NOT USED!
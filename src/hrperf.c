@@ -1,9 +1,12 @@
 #include <linux/bitmap.h>
 #include <linux/cdev.h>
+#include <linux/completion.h>
 #include <linux/cpumask.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
 #include <linux/ioctl.h>
 #include <linux/kernel.h>
@@ -11,12 +14,20 @@
 #include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/percpu-rwsem.h>
 #include <linux/percpu.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/smp.h>
+#include <linux/tracepoint.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <asm/apic.h>
+#include <asm/nmi.h>
+#include <asm/tsc.h>
 
 #include "buffer.h"
 #include "config.h"
@@ -31,25 +42,284 @@
 #include "uncore_pmu.h"
 
 static bool instructed_profile = false;
-#if CONCURRENT_INSTRUCTED_PROFILE
+#if !HRP_INSTRUCTED_LOCKLESS
+// serializes the instructed polls and logs: the workqueue runs the full polls
+// one at a time, targeted polls run from their calling threads
 static DEFINE_MUTEX(instructed_profile_lock);
 #endif
+// held for reading by the instructed ops, for writing by the changes of the
+// events and CPUs they depend on
+DEFINE_STATIC_PERCPU_RWSEM(hrp_instructed_sem);
+#if HRP_INSTRUCTED_LOCKLESS
+// log clock time of the last instructed poll each CPU served, and its sample
+static DEFINE_PER_CPU(u64, per_cpu_instructed_seq);
+static DEFINE_PER_CPU(HrperfLogEntry, per_cpu_instructed_last);
+#endif
+#if HRP_LOG_POLL_ID
+// the number of the last instructed poll
+static atomic64_t hrp_poll_id = ATOMIC64_INIT(0);
+#endif
 module_param(instructed_profile, bool, S_IRUGO);
 MODULE_PARM_DESC(instructed_profile,
                  "Enable instructed profiling where only one poll upon each "
                  "request (default: false)");
 
+static int sampling_mode = HRP_SAMPLING_MODE_DEFAULT;
+module_param(sampling_mode, int, S_IRUGO);
+MODULE_PARM_DESC(sampling_mode,
+                 "Sampling engine of the polling profile: 0 for IPIs from the "
+                 "poller thread, 1 for per-CPU pinned hrtimers, 2 for counter "
+                 "overflow interrupts (default: 0)");
+
+static uint overflow_period = HRP_PMC_OVERFLOW_PERIOD_DEFAULT;
+module_param(overflow_period, uint, S_IRUGO);
+MODULE_PARM_DESC(overflow_period,
+                 "Trigger counter events between two samples in the overflow "
+                 "sampling mode");
+
+static int overflow_counter = 0;
+module_param(overflow_counter, int, S_IRUGO);
+MODULE_PARM_DESC(overflow_counter,
+                 "Trigger counter of the overflow sampling mode: 0 for PMC0 "
+                 "(offcore reads or LLC misses), 1 for PMC1 (default: 0)");
+
+#if HRP_USE_MULTIPLEXING
+static uint mux_rotate_samples = HRP_MUX_ROTATE_SAMPLES_DEFAULT;
+module_param(mux_rotate_samples, uint, S_IRUGO);
+MODULE_PARM_DESC(mux_rotate_samples,
+                 "Samples taken with each event group before switching to the "
+                 "next one");
+#endif
+
+static bool kernel_logger = true;
+module_param(kernel_logger, bool, S_IRUGO);
+MODULE_PARM_DESC(kernel_logger,
+                 "Run the logger thread that writes the ring buffers to the "
+                 "log file, disable it when draining the buffers through mmap "
+                 "(default: true)");
+
+static bool flight_recorder = false;
+module_param(flight_recorder, bool, S_IRUGO);
+MODULE_PARM_DESC(flight_recorder,
+                 "Keep the latest samples in the ring buffers, overwriting the "
+                 "oldest, and write them to the log only on HRP_PMC_IOC_DUMP "
+                 "or a write to the dump parameter (default: false)");
+// set while a flight-recorder dump copies the rings, the samples are skipped
+static bool hrp_rb_frozen = false;
+static u64 hrp_n_dumps = 0;
+
+static bool histograms = false;
+module_param(histograms, bool, S_IRUGO);
+MODULE_PARM_DESC(histograms,
+                 "Add each sample to per-CPU histograms of bandwidth, IPC and "
+                 "stall rate, read with HRP_PMC_IOC_GET_HIST, instead of "
+                 "logging it (default: false)");
+
+#if HRP_LOG_PER_NODE
+static char *log_dir = HRP_PMC_LOG_DIR;
+module_param(log_dir, charp, S_IRUGO);
+MODULE_PARM_DESC(log_dir, "Directory of the per-node log files");
+#endif
+
+// Tunables of the polling profile, the defaults come from src/config.h. They
+// are also writable through /sys/module/hrperf/parameters/ while paused, see
+// the setters above cleanup().
+static uint poll_interval_us_low = HRP_PMC_POLL_INTERVAL_US_LOW;
+static uint poll_interval_us_high = HRP_PMC_POLL_INTERVAL_US_HIGH;
+static uint hrtimer_interval_us = HRP_PMC_HRTIMER_INTERVAL_US;
+static uint polling_logging_ratio = HRP_PMC_POLLING_LOGGING_RATIO;
+static uint poller_cpu = HRP_PMC_POLLER_CPU;
+static uint logger_cpu = HRP_PMC_LOGGER_CPU;
+#if HRP_ADAPTIVE_INTERVAL
+static uint adaptive_min_us = HRP_ADAPTIVE_MIN_US;
+static uint adaptive_max_us = HRP_ADAPTIVE_MAX_US;
+static uint adaptive_threshold = HRP_ADAPTIVE_THRESHOLD;
+static uint adaptive_budget = HRP_ADAPTIVE_BUDGET;
+#endif
+#if HRP_BURST_SAMPLING
+static uint burst_interval_us = HRP_BURST_INTERVAL_US;
+static uint burst_window_us = HRP_BURST_WINDOW_US;
+static uint burst_core_mbps = HRP_BURST_CORE_MBPS;
+static uint burst_node_mbps = HRP_BURST_NODE_MBPS;
+#endif
+#if HRP_USE_RDT
+static uint rdt_interval_us = HRP_RDT_INTERVAL_US;
+#endif
+// serializes START/PAUSE, event changes and the tunables above
+static DEFINE_MUTEX(hrp_state_lock);
+static bool hrp_initialized = false;
+
 // for the poller, logger, and buffers
 typedef struct hrperf_poller_data {
   u64 kts;
+#if HRP_INSTRUCTED_LOCKLESS
+  u32 tid; // the thread of an instructed poll
+#endif
+#if HRP_LOG_POLL_ID
+  u64 id; // the number of an instructed poll, 0 for the periodic polls
+#endif
 } hrperf_poller_data_t;
 
 // for instructed profiling mode, to delegate the log handling to a specified
 // CPU.
 static struct workqueue_struct *instructed_profile_wq = NULL;
-static DEFINE_PER_CPU(struct work_struct, instructed_profile_w);
 typedef void (*instructed_profile_func_t)(struct work_struct *work);
 
+// for the per-CPU hrtimer sampling engine
+typedef struct hrperf_hrtimer_data {
+  struct hrtimer timer;
+  u64 slot; // index of the current expiry on the shared sampling grid
+} hrperf_hrtimer_data_t;
+
+static DEFINE_PER_CPU(hrperf_hrtimer_data_t, per_cpu_hrtimer);
+// All per-CPU timers expire at hrtimer_epoch + slot * hrtimer_interval
+// (CLOCK_MONOTONIC), and each sample is stamped with the same grid point
+// expressed in the log clock, so samples of one slot share one timestamp.
+static ktime_t hrtimer_epoch;
+static ktime_t hrtimer_interval;
+static u64 hrtimer_epoch_kts;
+static u64 hrtimer_interval_kts;
+
+// for the overflow sampling engine. The trigger counter is preloaded so that it
+// overflows after overflow_period events, the events it counted before each
+// preload are accumulated in base, so the logged value keeps counting up.
+typedef struct hrperf_overflow_data {
+  u64 base;
+  bool armed;
+} hrperf_overflow_data_t;
+
+static DEFINE_PER_CPU(hrperf_overflow_data_t, per_cpu_overflow);
+static u64 overflow_preload;
+
+#if HRP_USE_MULTIPLEXING
+// for counter multiplexing. The PMCs restart from 0 whenever a group is
+// scheduled, the counts and running time of each group are accumulated here
+// when it is descheduled, so the logged counts of a group keep counting up.
+typedef struct hrperf_mux_data {
+  u64 count[HRP_MUX_MAX_GROUPS][HRP_NUM_TICK_PMCS];
+  u64 running[HRP_MUX_MAX_GROUPS];
+  u64 enabled;     // enabled time accumulated before the last resume
+  u64 enabled_kts; // when monitoring was last resumed
+  u64 sched_kts;   // when the current group was scheduled
+  u32 group;
+  u32 samples; // samples taken since the current group was scheduled
+} hrperf_mux_data_t;
+
+static DEFINE_PER_CPU(hrperf_mux_data_t, per_cpu_mux);
+#endif
+
+// counters in use, discovered with CPUID leaf 0xA if HRP_USE_ALL_COUNTERS
+static u32 hrp_n_gp_counters = 3;
+static u32 hrp_n_fixed_counters = 2;
+// IA32_PERF_GLOBAL_CTRL value of the selected CPUs
+static u64 hrp_global_ctrl;
+
+#if HRP_USE_TOPDOWN
+// GLOBAL_CTRL enable bits of fixed counter 3 and of PERF_METRICS
+#define HRP_TOPDOWN_CTRL_BITS ((1ULL << 35) | (1ULL << 48))
+// fixed counter 3 restarts at every sample, the slots of the previous windows
+// are accumulated here for the cumulative slots of HRP_USE_ALL_COUNTERS
+static DEFINE_PER_CPU(u64, per_cpu_slots);
+#endif
+
+#if HRP_ADAPTIVE_INTERVAL
+// log clock time of the previous sample of each CPU, for the interval field
+static DEFINE_PER_CPU(u64, per_cpu_last_kts);
+
+// activity of each CPU in its last window, maintained by the IPI poller
+typedef struct hrperf_activity {
+  u64 pmc0, inst, cycles; // counters at the previous sample
+  u64 pmc0_rate, ipc;     // of the previous window, 10-bit fixed point
+  u32 change;             // largest relative change of the two, in permille
+} hrperf_activity_t;
+
+static DEFINE_PER_CPU(hrperf_activity_t, per_cpu_activity);
+
+// state of the poller's interval controller
+typedef struct hrperf_adaptive {
+  u32 interval_us;
+  s64 tokens; // samples left in the budget
+  u64 refill_ns;
+} hrperf_adaptive_t;
+#endif
+
+// histograms of each CPU in the histogram mode, with the counters at its
+// previous sample
+typedef struct hrperf_hist {
+  u64 kts, lines, inst, cycles, stall;
+  u64 windows;
+  u64 buckets[HRP_HIST_N_METRICS][HRP_HIST_BUCKETS];
+} hrperf_hist_t;
+
+static DEFINE_PER_CPU(hrperf_hist_t, per_cpu_hist);
+
+#if HRP_RDT_TAGS
+// RMID in IA32_PQR_ASSOC of each CPU, RMID0 until its first context switch
+static DEFINE_PER_CPU(u32, per_cpu_rdt_rmid);
+#endif
+
+#if HRP_USE_RDT && !HRP_RDT_BATCHED
+// last RDT read of each CPU, repeated in its samples until the next read
+typedef struct hrperf_rdt_cache {
+  u64 next_kts;
+  u32 rmid;
+  u64 total_bw;
+  u64 local_bw;
+  u64 occupancy;
+} hrperf_rdt_cache_t;
+
+static DEFINE_PER_CPU(hrperf_rdt_cache_t, per_cpu_rdt_cache);
+#endif
+
+#if HRP_TASK_COUNTERS
+// counters of a thread, in the order of hrp_task_counters_t
+#define HRP_TASK_N_COUNTERS 5
+
+// A thread's totals. Only the CPU switching the thread out writes them, a
+// free slot is claimed with cmpxchg on its tid.
+typedef struct hrperf_task_slot {
+  u32 tid;        // 0 when free
+  u64 start_time; // of the thread, tells a reused tid apart
+  u64 runs;
+  u64 run_kts;
+  u64 counters[HRP_TASK_N_COUNTERS];
+} hrperf_task_slot_t;
+
+static hrperf_task_slot_t *hrp_task_table;
+// switches whose thread found no slot
+static atomic64_t hrp_task_table_full = ATOMIC64_INIT(0);
+
+// counters of each CPU at its last context switch
+typedef struct hrperf_task_base {
+  bool valid;
+  u64 kts;
+  u64 counters[HRP_TASK_N_COUNTERS];
+} hrperf_task_base_t;
+
+static DEFINE_PER_CPU(hrperf_task_base_t, per_cpu_task_base);
+#endif
+
+#if HRP_BURST_SAMPLING
+// bandwidth of each CPU in its last window, maintained by the IPI poller
+typedef struct hrperf_traffic {
+  u64 kts;       // of the previous sample
+  u64 lines;     // PMC0 + PMC1 at the previous sample
+  u64 imc;       // IMC reads + writes at the previous sample
+  u64 core_mbps; // of the previous window
+  u64 imc_mbps;  // only on HRP_IMC_DATA_ASSOCIATED_CORE
+} hrperf_traffic_t;
+
+static DEFINE_PER_CPU(hrperf_traffic_t, per_cpu_traffic);
+
+// state of the poller's burst trigger
+typedef struct hrperf_burst {
+  bool active;
+  u64 end_ns; // of the current burst
+  u64 rounds; // poll rounds in the current burst
+  u64 *node_mbps; // per NUMA node, scratch of hrperf_burst_update
+} hrperf_burst_t;
+#endif
+
 #if HRP_STRICT_POLLING_SYNC
 // for forcing synchronization across all PMUs polling.
 static atomic_t ready_cpus;
@@ -59,11 +329,54 @@ static atomic_t done_cpus;
 static u32 N_CPUS = 0;
 static u32 N_POLLING_CPUS = 0; // Actual number of CPUs that will poll
 
+#if HRP_MMAP_RB
+static DEFINE_PER_CPU(HrperfRingBuffer *, per_cpu_buffer);
+#define hrp_cpu_rb(cpu) (*per_cpu_ptr(&per_cpu_buffer, (cpu)))
+#define hrp_this_rb() (*this_cpu_ptr(&per_cpu_buffer))
+static HrperfRingBuffer *marker_rb;
+#else
 static DEFINE_PER_CPU(HrperfRingBuffer, per_cpu_buffer);
+#define hrp_cpu_rb(cpu) per_cpu_ptr(&per_cpu_buffer, (cpu))
+#define hrp_this_rb() this_cpu_ptr(&per_cpu_buffer)
+static HrperfRingBuffer marker_rb_storage;
+static HrperfRingBuffer *marker_rb = &marker_rb_storage;
+#endif
+// markers can be emitted from any context, producers serialize on this lock
+static DEFINE_SPINLOCK(marker_lock);
 static struct task_struct *poller_thread;
-static struct task_struct *logger_thread;
-struct file *log_file;
+// completed by the poller thread when it parks, after its last poll round
+static DECLARE_COMPLETION(hrp_poller_parked);
+// the hrtimers are set up or the PMI handler is registered, for cleanup()
+static bool hrp_sampler_ready = false;
+static hrp_log_header_t log_header;
+
+// timings of the poll rounds and the logger passes, see hrp_stats_t
+typedef struct hrperf_timing {
+  u64 n;
+  u64 ns_total;
+  u64 ns_max;
+} hrperf_timing_t;
+// of the poll rounds started on each CPU, summed by hrperf_collect_stats
+static DEFINE_PER_CPU(hrperf_timing_t, per_cpu_poll_timing);
+
+// a logger thread and its file, one per NUMA node with HRP_LOG_PER_NODE
+typedef struct hrperf_logger {
+  struct task_struct *thread; // NULL when the rings are drained otherwise
+  HrperfLogFile log;
+  int node;               // NUMA_NO_NODE for the single logger
+  bool markers;           // also drains the marker ring
+  hrperf_timing_t timing; // of its passes
+#if HRP_INSTRUCTED_LOCKLESS
+  struct mutex lock;      // serializes concurrent instructed logs
+#endif
+} hrperf_logger_t;
+static hrperf_logger_t *hrp_loggers;
+static int hrp_n_loggers;
+static struct dentry *hrp_debugfs_dir;
 static cpumask_t hrp_selected_cpus; // Using cpumask_t for CPU selection
+static bool hrp_cpus_param_set = false; // selection given by the cpus param
+// CPUs whose ring buffer has been set up, deselected CPUs keep their rings
+static cpumask_t hrp_rb_cpus;
 static bool hrperf_running = false;
 
 // for the char device
@@ -74,8 +387,16 @@ static struct cdev char_dev;
 
 static long hrperf_ioctl(struct file *file, unsigned int cmd,
                          unsigned long arg);
-static struct file_operations fops = {.owner = THIS_MODULE,
-                                      .unlocked_ioctl = hrperf_ioctl};
+#if HRP_MMAP_RB
+static int hrperf_mmap(struct file *file, struct vm_area_struct *vma);
+#endif
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = hrperf_ioctl,
+#if HRP_MMAP_RB
+    .mmap = hrperf_mmap,
+#endif
+};
 
 static void enable_rdpmc_in_user_space(void *info) {
   unsigned long cr4_value;
@@ -90,289 +411,1870 @@ static void enable_rdpmc_in_user_space(void *info) {
   asm volatile("mov %0, %%cr4" ::"r"(cr4_value));
 }
 
-#if HRP_USE_OFFCORE
-static void hrperf_pmc_enable_and_esel(void *info) {
-  // enable the counters
-  wrmsrl(MSR_IA32_FIXED_CTR_CTRL,
-         0x033); // fixed counter 0 for inst retire, 1 for cpu unhalt
-  wrmsrl(MSR_IA32_GLOBAL_CTRL, 1UL | (1UL << 1) | (1UL << 2) | (1UL << 3) |
-                                   (1UL << 32) |
-                                   (1UL << 33)); // arch 0,1,2,3, fixed 0,1
+// default event groups, see HRP_USE_OFFCORE and HRP_USE_MULTIPLEXING
+#define HRP_EVENTS_OFFCORE                                                     \
+  {                                                                            \
+    {PMC_OCR_READS_TO_CORE_DRAM_ARCH_FINAL,                                    \
+     PMC_OCR_READS_TO_CORE_DRAM_RSP_ARCH, HRP_EVENT_ID_OCR_READS, 0},          \
+    {PMC_OCR_MODIFIED_WRITE_ANY_RESPONSE_ARCH_FINAL,                           \
+     PMC_OCR_MODIFIED_WRITE_ANY_RESPONSE_RSP_ARCH,                             \
+     HRP_USE_WRITE_EST ? HRP_EVENT_ID_OCR_WRITE_EST : HRP_EVENT_ID_OCR_WRITES, \
+     0},                                                                       \
+    {PMC_CYCLE_STALLS_MEM_SKYLAKE_FINAL, 0, HRP_EVENT_ID_STALLS_MEM, 0},       \
+  }
+#define HRP_EVENTS_CACHE                                                       \
+  {                                                                            \
+    {PMC_LLC_MISSES_FINAL, 0, HRP_EVENT_ID_LLC_MISSES, 0},                     \
+    {PMC_SW_PREFETCH_ANY_ARCH_FINAL, 0, HRP_EVENT_ID_SW_PREFETCH, 0},          \
+    {PMC_CYCLE_STALLS_MEM_ARCH_FINAL, 0, HRP_EVENT_ID_STALLS_MEM, 0},          \
+  }
+// offcore events on PMC0-PMC2 and cache-miss/prefetch events on PMC3-PMC4
+#define HRP_EVENTS_ALL                                                         \
+  {                                                                            \
+    {PMC_OCR_READS_TO_CORE_DRAM_ARCH_FINAL,                                    \
+     PMC_OCR_READS_TO_CORE_DRAM_RSP_ARCH, HRP_EVENT_ID_OCR_READS, 0},          \
+    {PMC_OCR_MODIFIED_WRITE_ANY_RESPONSE_ARCH_FINAL,                           \
+     PMC_OCR_MODIFIED_WRITE_ANY_RESPONSE_RSP_ARCH,                             \
+     HRP_USE_WRITE_EST ? HRP_EVENT_ID_OCR_WRITE_EST : HRP_EVENT_ID_OCR_WRITES, \
+     0},                                                                       \
+    {PMC_CYCLE_STALLS_MEM_ARCH_FINAL, 0, HRP_EVENT_ID_STALLS_MEM, 0},          \
+    {PMC_LLC_MISSES_FINAL, 0, HRP_EVENT_ID_LLC_MISSES, 0},                     \
+    {PMC_SW_PREFETCH_ANY_ARCH_FINAL, 0, HRP_EVENT_ID_SW_PREFETCH, 0},          \
+  }
 
-  // make event selections and offcore response selections
-  wrmsrl(MSR_IA32_PERFEVTSEL0, PMC_OCR_READS_TO_CORE_DRAM_ARCH_FINAL);
-  wrmsrl(MSR_OFFCORE_RSP0, PMC_OCR_READS_TO_CORE_DRAM_RSP_ARCH);
-  wrmsrl(MSR_IA32_PERFEVTSEL1, PMC_OCR_MODIFIED_WRITE_ANY_RESPONSE_ARCH_FINAL);
-  wrmsrl(MSR_OFFCORE_RSP1, PMC_OCR_MODIFIED_WRITE_ANY_RESPONSE_RSP_ARCH);
-  wrmsrl(MSR_IA32_PERFEVTSEL2, PMC_CYCLE_STALLS_MEM_SKYLAKE_FINAL);
-}
+// the events programmed on the general-purpose counters. Without
+// HRP_USE_MULTIPLEXING there is a single group.
+static hrp_event_groups_t hrp_groups = {
+#if HRP_USE_MULTIPLEXING
+    .n_groups = 2,
+    .rotate_samples = HRP_MUX_ROTATE_SAMPLES_DEFAULT,
+    .groups = {{.events = HRP_EVENTS_OFFCORE}, {.events = HRP_EVENTS_CACHE}},
+#elif HRP_USE_ALL_COUNTERS
+    .n_groups = 1,
+    .groups = {{.events = HRP_EVENTS_ALL}},
+#elif HRP_USE_OFFCORE
+    .n_groups = 1,
+    .groups = {{.events = HRP_EVENTS_OFFCORE}},
 #else
-static void hrperf_pmc_enable_and_esel(void *info) {
-  // enable the counters
-  wrmsrl(MSR_IA32_FIXED_CTR_CTRL,
-         0x033); // fixed counter 0 for inst retire, 1 for cpu unhalt
-  wrmsrl(MSR_IA32_GLOBAL_CTRL, 1UL | (1UL << 1) | (1UL << 2) | (1UL << 3) |
-                                   (1UL << 32) |
-                                   (1UL << 33)); // arch 0,1,2,3, fixed 0,1
-
-  // make event selections
-  wrmsrl(MSR_IA32_PERFEVTSEL0, PMC_LLC_MISSES_FINAL);
-  wrmsrl(MSR_IA32_PERFEVTSEL1, PMC_SW_PREFETCH_ANY_ARCH_FINAL);
-  wrmsrl(MSR_IA32_PERFEVTSEL2, PMC_CYCLE_STALLS_MEM_ARCH_FINAL);
-}
+    .n_groups = 1,
+    .groups = {{.events = HRP_EVENTS_CACHE}},
 #endif
+};
 
-// Function to be called on each CPU by smp_call_function_many
-static void hrperf_poller_func(void *info) {
-#if HRP_STRICT_POLLING_SYNC
-  preempt_disable();
-  atomic_inc(&ready_cpus);
+// Offcore events take their response type from OFFCORE_RSP0 or OFFCORE_RSP1,
+// depending on the event code, not on the counter they are programmed on.
+static __always_inline u32 hrp_offcore_rsp_msr(u64 evtsel) {
+  u8 event = evtsel & 0xFF;
+  return (event == 0xBB || event == 0x2B) ? MSR_OFFCORE_RSP1 : MSR_OFFCORE_RSP0;
+}
 
-  // Wait for all CPUs to be ready with timeout
-  unsigned long timeout = jiffies + msecs_to_jiffies(150);
-  while (!atomic_read(&start_flag)) {
-    if (time_after(jiffies, timeout)) {
-      pr_err("hrperf: Timeout waiting for start flag on CPU %d\n",
-             smp_processor_id());
-      atomic_inc(&done_cpus); // Mark as done to prevent main thread hang
-      preempt_enable();
-      return;
+// Bits of an event selection that user space may set: event, umask, USR, OS,
+// edge, enable, invert and cmask. The PMI enable belongs to the overflow mode.
+#define HRP_ESEL_USER_BITS                                                     \
+  (0xFFFFULL | PMC_ESEL_USR | PMC_ESEL_OS | PMC_ESEL_EDGE | PMC_ESEL_ENABLE |  \
+   PMC_ESEL_INV | (0xFFULL << PMC_ESEL_CMASK_SHIFT))
+
+// Check the event selections of a user's config before they reach the MSRs
+static int hrperf_check_events(const hrp_event_config_t *config) {
+  for (int i = 0; i < hrp_n_gp_counters; i++) {
+    u64 allowed = HRP_ESEL_USER_BITS;
+    u64 evtsel = config->events[i].evtsel;
+
+    if (!instructed_profile && sampling_mode == HRP_SAMPLING_MODE_OVERFLOW &&
+        i == overflow_counter) {
+      allowed |= PMC_ESEL_INT;
+    }
+    if (evtsel & ~allowed) {
+      pr_err("hrperf: Invalid bits 0x%llx in the event selection of PMC%d.\n",
+             evtsel & ~allowed, i);
+      return -EINVAL;
     }
-    cpu_relax();
-  }
-#endif
-
-  HrperfLogEntry entry;
-  entry.cpu_id = smp_processor_id();
-  hrperf_poller_data_t *data = (hrperf_poller_data_t *)info;
-  entry.tick.kts = data->kts;
-  rdmsrl(MSR_IA32_PMC2, entry.tick.stall_mem);
-  rdmsrl(MSR_IA32_FIXED_CTR0, entry.tick.inst_retire);
-  rdmsrl(MSR_IA32_FIXED_CTR1, entry.tick.cpu_unhalt);
-  rdmsrl(MSR_IA32_PMC0, entry.tick.llc_misses);
-  rdmsrl(MSR_IA32_PMC1, entry.tick.sw_prefetch);
-
-#if HRP_LOG_IMC
-  if (entry.cpu_id == HRP_IMC_DATA_ASSOCIATED_CORE) {
-    freeze_all_counters();
-    entry.tick.imc_reads = get_imc_reads();
-    entry.tick.imc_writes = get_imc_writes();
-    unfreeze_all_counters();
-  } else {
-    entry.tick.imc_reads = 0;
-    entry.tick.imc_writes = 0;
   }
-#endif
+  return 0;
+}
 
-#if HRP_USE_RDT
-  mbm_counter_data_t mbm_data;
-  mbm_data.status = MBM_COUNTER_READ_SUCCESS;
-  struct rmid_info *rmid_info = mbm_get_rmid_info_for_core(entry.cpu_id);
-  if (rmid_info == NULL) {
-    pr_err("hrperf: Failed to get RMID info for CPU %d\n",
-            entry.cpu_id);
-  } else {
-    mbm_data.rmid = rmid_info->rmid;
-    mbm_read_counters(&mbm_data);
-    if (mbm_data.status != MBM_COUNTER_READ_SUCCESS) {
-      pr_warn("Core %d RMID %u: Failed to read MBM counters, status: %d\n",
-              entry.cpu_id, mbm_data.rmid, mbm_data.status);
-    } else {
-      entry.tick.total_bw = mbm_data.total_bw;
-#if HRP_RDT_INCLUDE_LOCAL_BW
-      entry.tick.local_bw = mbm_data.local_bw;
-#endif
-      entry.tick.occupancy = mbm_data.occupancy;
+// make event selections and offcore response selections on the local CPU,
+// -EINVAL if the CPU refuses one, e.g. reserved offcore response bits
+static __always_inline int hrperf_pmc_esel(const hrp_event_config_t *config) {
+  for (int i = 0; i < hrp_n_gp_counters; i++) {
+    const hrp_event_sel_t *ev = &config->events[i];
+    if (ev->offcore_rsp != 0 &&
+        wrmsrl_safe(hrp_offcore_rsp_msr(ev->evtsel), ev->offcore_rsp) != 0) {
+      return -EINVAL;
+    }
+    if (wrmsrl_safe(MSR_IA32_PERFEVTSEL0 + i, ev->evtsel) != 0) {
+      return -EINVAL;
     }
   }
-#endif
-
-#if HRP_STRICT_POLLING_SYNC
-  atomic_inc(&done_cpus);
-  preempt_enable();
-#endif
-
-  enqueue(this_cpu_ptr(&per_cpu_buffer), entry);
+  return 0;
 }
 
-static __always_inline void smp_poll_pmus(hrperf_poller_data_t *poller_data) {
-#if CONCURRENT_INSTRUCTED_PROFILE
-  if (instructed_profile) {
-    mutex_lock(&instructed_profile_lock);
-  }
+// Read the timestamp for a new round of polling, in the configured log clock
+static __always_inline u64 hrp_read_kts(void) {
+#if HRP_USE_TSC
+  return __rdtsc();
+#else
+#if HRP_USE_RAW_CLOCK
+  ktime_t ts = ktime_get_raw();
+#else
+  ktime_t ts = ktime_get_real();
 #endif
-
-#if HRP_STRICT_POLLING_SYNC
-  preempt_disable();
+  // consider negative ktime_t values as errors and set to 0
+  return (ts < 0) ? 0 : (u64)ts;
 #endif
+}
 
+// NMI-safe variant of hrp_read_kts(), for the overflow interrupt handler
+static __always_inline u64 hrp_read_kts_nmi(void) {
 #if HRP_USE_TSC
-  poller_data->kts = __rdtsc();
+  return __rdtsc();
 #else
 #if HRP_USE_RAW_CLOCK
-  // consider negative ktime_t values as errors and set to 0
-  ktime_t ts = ktime_get_raw();
-  poller_data->kts = (ts < 0) ? 0 : (u64)ts;
+  return ktime_get_raw_fast_ns();
 #else
-  // consider negative ktime_t values as errors and set to 0
-  ktime_t ts = ktime_get_real();
-  poller_data->kts = (ts < 0) ? 0 : (u64)ts;
+  return ktime_get_real_fast_ns();
 #endif
 #endif
+}
 
-#if HRP_STRICT_POLLING_SYNC
-  atomic_set(&ready_cpus, 0);
-  atomic_set(&start_flag, 0);
-  atomic_set(&done_cpus, 0);
+// What a tick is read for. Only the periodic samples advance the rotation of
+// HRP_USE_MULTIPLEXING, so that the context switches do not shorten it. A
+// snapshot only reads: the topdown counters keep running, and the window of the
+// next sample still starts at the previous one.
+typedef enum {
+  HRP_TICK_PERIODIC,
+  HRP_TICK_SWITCH,
+  HRP_TICK_SNAPSHOT,
+} hrp_tick_kind_t;
+
+// Microseconds in log clock ticks
+static __always_inline u64 hrperf_us_to_kts(u64 us) {
+#if HRP_USE_TSC
+  return us * cycles_per_us;
+#else
+  return us * 1000;
+#endif
+}
 
-  // Create a CPU mask excluding the poller CPU if it shouldn't poll
-  cpumask_var_t polling_cpus;
-  if (!alloc_cpumask_var(&polling_cpus, GFP_KERNEL)) {
-    pr_err("hrperf: Failed to allocate CPU mask for polling\n");
-    return;
+// Access the field of the tick holding PMCi. The log entry is packed, so no
+// pointers into the tick are taken.
+static __always_inline u64 hrp_tick_get_pmc(const HrperfLogEntry *entry,
+                                            int i) {
+  switch (i) {
+  case 0:
+    return entry->tick.llc_misses;
+  case 1:
+    return entry->tick.sw_prefetch;
+  case 2:
+    return entry->tick.stall_mem;
   }
-
-  cpumask_copy(polling_cpus, &hrp_selected_cpus);
-#if (HRP_POLL_POLLER_CORE != 1)
-  cpumask_clear_cpu(HRP_PMC_POLLER_CPU, polling_cpus);
+#if HRP_USE_ALL_COUNTERS
+  return entry->tick.pmc[i - 3];
+#else
+  return 0;
 #endif
+}
 
-  smp_call_function_many(polling_cpus, hrperf_poller_func, (void *)poller_data,
-                         0);
-#if HRP_POLL_POLLER_CORE
-  // Current CPU also participates
-  atomic_inc(&ready_cpus);
+static __always_inline void hrp_tick_set_pmc(HrperfLogEntry *entry, int i,
+                                             u64 value) {
+  switch (i) {
+  case 0:
+    entry->tick.llc_misses = value;
+    return;
+  case 1:
+    entry->tick.sw_prefetch = value;
+    return;
+  case 2:
+    entry->tick.stall_mem = value;
+    return;
+  }
+#if HRP_USE_ALL_COUNTERS
+  entry->tick.pmc[i - 3] = value;
 #endif
+}
 
-  // Wait for all polling CPUs to be ready with timeout
-  unsigned long timeout = jiffies + msecs_to_jiffies(200);
-  while (atomic_read(&ready_cpus) < N_POLLING_CPUS) {
-    if (time_after(jiffies, timeout)) {
-      pr_err("hrperf: Timeout waiting for CPUs to be ready. Ready: %d, "
-             "Expected: %u\n",
-             atomic_read(&ready_cpus), N_POLLING_CPUS);
-      free_cpumask_var(polling_cpus);
-      return;
-    }
-    cpu_relax();
+#if HRP_USE_MULTIPLEXING
+// Schedule a group on the local CPU, its PMCs restart from 0
+static __always_inline void hrperf_mux_schedule(hrperf_mux_data_t *mux,
+                                                u32 group, u64 kts) {
+  hrperf_pmc_esel(&hrp_groups.groups[group]);
+  for (int i = 0; i < hrp_n_gp_counters; i++) {
+    wrmsrl(MSR_IA32_PMC0 + i, 0);
+  }
+  mux->group = group;
+  mux->samples = 0;
+  mux->sched_kts = kts;
+}
+
+// Deschedule the current group, accumulating what it has counted so far
+static __always_inline void hrperf_mux_deschedule(hrperf_mux_data_t *mux,
+                                                  const u64 *raw, u64 kts) {
+  u32 g = mux->group;
+  for (int i = 0; i < hrp_n_gp_counters; i++) {
+    mux->count[g][i] += raw[i];
   }
+  // samples on the hrtimer grid may be stamped slightly before sched_kts
+  if (kts > mux->sched_kts) {
+    mux->running[g] += kts - mux->sched_kts;
+  }
+}
 
-  atomic_set(&start_flag, 1);
+// Called on each selected CPU after (re)programming the groups, the counts
+// and times of all groups restart from 0
+static void hrperf_mux_reset(void *info) {
+  hrperf_mux_data_t *mux = this_cpu_ptr(&per_cpu_mux);
+  u64 kts = hrp_read_kts();
 
-#if HRP_POLL_POLLER_CORE
-  hrperf_poller_func((void *)poller_data);
-#endif
+  memset(mux, 0, sizeof(*mux));
+  mux->enabled_kts = kts;
+  hrperf_mux_schedule(mux, 0, kts);
+}
 
-  preempt_enable();
+// Called on each selected CPU when monitoring is paused, so that the paused
+// time is neither enabled nor running time
+static void hrperf_mux_pause(void *info) {
+  hrperf_mux_data_t *mux = this_cpu_ptr(&per_cpu_mux);
+  u64 kts = hrp_read_kts();
+  u64 raw[HRP_NUM_TICK_PMCS];
 
-  // Wait for all polling CPUs to complete with timeout
-  timeout = jiffies + msecs_to_jiffies(200);
-  while (atomic_read(&done_cpus) < N_POLLING_CPUS) {
-    if (time_after(jiffies, timeout)) {
-      pr_err("hrperf: Timeout waiting for CPUs to complete. Done: %d, "
-             "Expected: %u\n",
-             atomic_read(&done_cpus), N_POLLING_CPUS);
-      break;
-    }
-    cpu_relax();
+  for (int i = 0; i < hrp_n_gp_counters; i++) {
+    rdmsrl(MSR_IA32_PMC0 + i, raw[i]);
   }
+  hrperf_mux_deschedule(mux, raw, kts);
+  mux->enabled += kts - mux->enabled_kts;
+}
 
-  free_cpumask_var(polling_cpus);
-#else
-  smp_call_function_many(&hrp_selected_cpus, hrperf_poller_func,
-                         (void *)poller_data, 1);
-#if HRP_POLL_POLLER_CORE
-  hrperf_poller_func((void *)poller_data);
-#endif
-#endif
+// Called on each selected CPU when monitoring is resumed
+static void hrperf_mux_resume(void *info) {
+  hrperf_mux_data_t *mux = this_cpu_ptr(&per_cpu_mux);
+  u64 kts = hrp_read_kts();
 
-#if CONCURRENT_INSTRUCTED_PROFILE
-  if (instructed_profile) {
-    mutex_unlock(&instructed_profile_lock);
-  }
-#endif
+  mux->enabled_kts = kts;
+  hrperf_mux_schedule(mux, mux->group, kts);
 }
 
-// Single poller thread function for initiating the smp_call_function_many
-static int hrperf_poller_thread(void *arg) {
-  hrperf_poller_data_t poller_data;
-  while (!kthread_should_stop()) {
-    if (!hrperf_running) {
-      set_current_state(TASK_INTERRUPTIBLE);
-      schedule(); // pause execution here
-    }
+// Turn the raw PMC values of the entry into the counts of the scheduled group,
+// and switch to the next group every mux_rotate_samples periodic samples
+static __always_inline void hrperf_mux_tick(HrperfLogEntry *entry, u64 kts,
+                                            hrp_tick_kind_t kind) {
+  hrperf_mux_data_t *mux = this_cpu_ptr(&per_cpu_mux);
+  u32 g = mux->group;
+  u64 raw[HRP_NUM_TICK_PMCS];
+  u64 running = kts > mux->sched_kts ? kts - mux->sched_kts : 0;
+  u64 enabled = kts > mux->enabled_kts ? kts - mux->enabled_kts : 0;
+
+  for (int i = 0; i < hrp_n_gp_counters; i++) {
+    raw[i] = hrp_tick_get_pmc(entry, i);
+    hrp_tick_set_pmc(entry, i, mux->count[g][i] + raw[i]);
+  }
+  entry->tick.group_id = g;
+  entry->tick.time_enabled = mux->enabled + enabled;
+  entry->tick.time_running = mux->running[g] + running;
 
-    smp_poll_pmus(&poller_data);
-    usleep_range(HRP_PMC_POLL_INTERVAL_US_LOW, HRP_PMC_POLL_INTERVAL_US_HIGH);
+  if (kind != HRP_TICK_PERIODIC) {
+    return;
+  }
+  if (++mux->samples >= hrp_groups.rotate_samples && hrp_groups.n_groups > 1) {
+    hrperf_mux_deschedule(mux, raw, kts);
+    hrperf_mux_schedule(mux, (g + 1) % hrp_groups.n_groups, kts);
   }
-  return 0;
 }
+#endif
 
-static __always_inline void log_for_all_cpus(void) {
-#if CONCURRENT_INSTRUCTED_PROFILE
-  if (instructed_profile) {
-    mutex_lock(&instructed_profile_lock);
-  }
+#if HRP_USE_ALL_COUNTERS
+// Discover the general-purpose and fixed counters of the PMU, assumed to be
+// the same on all selected CPUs
+static void hrperf_discover_counters(void) {
+  u32 eax, ebx, ecx, edx;
+
+  cpuid(0xA, &eax, &ebx, &ecx, &edx);
+  hrp_n_gp_counters = min_t(u32, (eax >> 8) & 0xFF, HRP_NUM_TICK_PMCS);
+  hrp_n_fixed_counters = min_t(u32, edx & 0x1F, 4);
+  pr_info("hrperf: PMU version %u, using %u of %u general-purpose and %u of %u "
+          "fixed counters\n",
+          eax & 0xFF, hrp_n_gp_counters, (eax >> 8) & 0xFF,
+          hrp_n_fixed_counters, edx & 0x1F);
+}
 #endif
 
-  int cpu;
-  for_each_cpu(cpu, &hrp_selected_cpus) {
-    log_and_clear(per_cpu_ptr(&per_cpu_buffer, cpu), log_file);
-  }
+// CPUs that refused an event selection in hrperf_pmc_enable_and_esel
+static atomic_t hrp_esel_failed = ATOMIC_INIT(0);
 
-#if CONCURRENT_INSTRUCTED_PROFILE
-  if (instructed_profile) {
-    mutex_unlock(&instructed_profile_lock);
+static void hrperf_pmc_enable_and_esel(void *info) {
+  // enable the counters
+#if HRP_USE_ALL_COUNTERS
+  // fixed counter 0 for inst retire, 1 for cpu unhalt, 2 for ref cycles, 3 for
+  // topdown slots, counting in both rings
+  u64 fixed_ctrl = 0;
+  for (int i = 0; i < hrp_n_fixed_counters; i++) {
+    fixed_ctrl |= 0x3ULL << (4 * i);
+  }
+  hrp_global_ctrl = ((1ULL << hrp_n_gp_counters) - 1) |
+                    (((1ULL << hrp_n_fixed_counters) - 1) << 32);
+#else
+  u64 fixed_ctrl = 0x033; // fixed counter 0 for inst retire, 1 for cpu unhalt
+  hrp_global_ctrl = 1UL | (1UL << 1) | (1UL << 2) | (1UL << 3) | (1UL << 32) |
+                    (1UL << 33); // arch 0,1,2,3, fixed 0,1
+#endif
+#if HRP_USE_TOPDOWN
+  // fixed counter 3 for topdown slots, PERF_METRICS breaks them down
+  fixed_ctrl |= 0x3ULL << 12;
+  hrp_global_ctrl |= HRP_TOPDOWN_CTRL_BITS;
+  wrmsrl(MSR_IA32_FIXED_CTR3, 0);
+  wrmsrl(MSR_PERF_METRICS, 0);
+  this_cpu_write(per_cpu_slots, 0);
+#endif
+  wrmsrl(MSR_IA32_FIXED_CTR_CTRL, fixed_ctrl);
+  wrmsrl(MSR_IA32_GLOBAL_CTRL, hrp_global_ctrl);
+
+#if HRP_USE_MULTIPLEXING
+  // the later groups are only programmed when they rotate in, try each once
+  for (u32 g = 0; g < hrp_groups.n_groups; g++) {
+    if (hrperf_pmc_esel(&hrp_groups.groups[g]) != 0) {
+      atomic_inc(&hrp_esel_failed);
+    }
+  }
+  // programs the first group
+  hrperf_mux_reset(NULL);
+#else
+  if (hrperf_pmc_esel(&hrp_groups.groups[0]) != 0) {
+    atomic_inc(&hrp_esel_failed);
   }
 #endif
+#if HRP_TASK_COUNTERS
+  // the running thread's counts cannot be told apart from the new events
+  this_cpu_ptr(&per_cpu_task_base)->valid = false;
+#endif
 }
 
-// Logger thread function
-static int hrperf_logger_thread(void *arg) {
-  while (!kthread_should_stop()) {
-    if (!hrperf_running) {
-      set_current_state(TASK_INTERRUPTIBLE);
-      schedule(); // pause execution here
-    }
+// the event groups before the last change, to go back to if the CPUs refuse
+// the new ones; under hrp_state_lock
+static hrp_event_groups_t hrp_groups_prev;
+
+// Program the changed hrp_groups on the selected CPUs, after saving the old
+// ones in hrp_groups_prev. Called with hrp_state_lock held.
+static int hrperf_program_groups(void) {
+  atomic_set(&hrp_esel_failed, 0);
+  on_each_cpu_mask(&hrp_selected_cpus, hrperf_pmc_enable_and_esel, NULL, 1);
+  if (atomic_read(&hrp_esel_failed) == 0) {
+    return 0;
+  }
+  pr_err("hrperf: %d CPUs refused the event selection, keeping the old one.\n",
+         atomic_read(&hrp_esel_failed));
+  hrp_groups = hrp_groups_prev;
+  on_each_cpu_mask(&hrp_selected_cpus, hrperf_pmc_enable_and_esel, NULL, 1);
+  return -EINVAL;
+}
 
-    if (kthread_should_stop())
-      break;
+static __always_inline u32 hrp_overflow_pmc_msr(void) {
+  return overflow_counter == 0 ? MSR_IA32_PMC0 : MSR_IA32_PMC1;
+}
+
+// the legacy PMC MSRs sign-extend writes from bit 31, use full-width writes
+static __always_inline u32 hrp_overflow_pmc_write_msr(void) {
+  return overflow_counter == 0 ? MSR_IA32_A_PMC0 : MSR_IA32_A_PMC1;
+}
 
-    usleep_range(HRP_PMC_POLL_INTERVAL_US_LOW * HRP_PMC_POLLING_LOGGING_RATIO,
-                 HRP_PMC_POLL_INTERVAL_US_HIGH * HRP_PMC_POLLING_LOGGING_RATIO);
-    log_for_all_cpus();
+// Check for the full-width PMC writes (PERF_CAPABILITIES bit 13) of
+// hrp_overflow_pmc_write_msr, the overflow mode writes the whole counter
+static int hrperf_check_fw_write(void) {
+  u32 eax, ebx, ecx, edx;
+  u64 caps;
+
+  cpuid(0x1, &eax, &ebx, &ecx, &edx);
+  if (!(ecx & (1U << 15))) { // PDCM, PERF_CAPABILITIES is present
+    pr_err("hrperf: IA32_PERF_CAPABILITIES is not supported.\n");
+    return -ENODEV;
+  }
+  rdmsrl(MSR_IA32_PERF_CAPABILITIES, caps);
+  if (!(caps & (1ULL << 13))) {
+    pr_err("hrperf: The overflow sampling mode needs full-width PMC "
+           "writes.\n");
+    return -ENODEV;
   }
   return 0;
 }
 
-static void instructed_poll_op(struct work_struct *work) {
-  hrperf_poller_data_t poller_data;
-  poller_data.kts = 0; // Initialize kts to 0, will be set in the poller
-  smp_poll_pmus(&poller_data);
+static __always_inline u32 hrp_overflow_evtsel_msr(void) {
+  return overflow_counter == 0 ? MSR_IA32_PERFEVTSEL0 : MSR_IA32_PERFEVTSEL1;
 }
 
-static void instructed_log_op(struct work_struct *work) { log_for_all_cpus(); }
-
-static void instructed_poll_and_log(struct work_struct *work) {
-  instructed_poll_op(work);
-  instructed_log_op(work);
+// Events counted by the trigger counter so far, given its raw value
+static __always_inline u64 hrp_overflow_count(u64 raw) {
+  return this_cpu_ptr(&per_cpu_overflow)->base +
+         ((raw - overflow_preload) & PMC_COUNTER_MASK);
 }
 
-static __always_inline int
-enqueue_instructed_profile_op(instructed_profile_func_t func) {
-  if (instructed_profile) {
-    struct work_struct *work = this_cpu_ptr(&instructed_profile_w);
-    INIT_WORK(work, func);
-    if (work == NULL) {
-      pr_err("hrperf: Instructed log work struct is NULL.\n");
-      return -EFAULT;
-    }
+#if HRP_USE_TOPDOWN
+// Read the slots and their breakdown of the window since the last sample, then
+// start a new window. Fixed counter 3 and PERF_METRICS must be cleared
+// together while they are stopped.
+static __always_inline void hrperf_read_topdown(HrperfLogEntry *entry,
+                                                hrp_tick_kind_t kind) {
+  u64 slots;
+
+  rdmsrl(MSR_IA32_FIXED_CTR3, slots);
+  rdmsrl(MSR_PERF_METRICS, entry->tick.perf_metrics);
+  entry->tick.td_slots = slots;
+
+  if (kind == HRP_TICK_SNAPSHOT) {
+#if HRP_USE_ALL_COUNTERS
+    entry->tick.slots = this_cpu_read(per_cpu_slots) + slots;
+#endif
+    return;
+  }
+
+  wrmsrl(MSR_IA32_GLOBAL_CTRL, hrp_global_ctrl & ~HRP_TOPDOWN_CTRL_BITS);
+  wrmsrl(MSR_IA32_FIXED_CTR3, 0);
+  wrmsrl(MSR_PERF_METRICS, 0);
+  wrmsrl(MSR_IA32_GLOBAL_CTRL, hrp_global_ctrl);
+
+#if HRP_USE_ALL_COUNTERS
+  entry->tick.slots = this_cpu_add_return(per_cpu_slots, slots);
+#endif
+}
+
+// Check for fixed counter 3 and PERF_METRICS (PERF_CAPABILITIES bit 15)
+static int hrperf_check_topdown(void) {
+  u32 eax, ebx, ecx, edx;
+  u64 caps;
+
+  cpuid(0xA, &eax, &ebx, &ecx, &edx);
+  if ((edx & 0x1F) < 4) {
+    pr_err("hrperf: Topdown metrics need fixed counter 3, only %u fixed "
+           "counters present.\n",
+           edx & 0x1F);
+    return -ENODEV;
+  }
+  cpuid(0x1, &eax, &ebx, &ecx, &edx);
+  if (!(ecx & (1U << 15))) { // PDCM, PERF_CAPABILITIES is present
+    pr_err("hrperf: IA32_PERF_CAPABILITIES is not supported.\n");
+    return -ENODEV;
+  }
+  rdmsrl(MSR_IA32_PERF_CAPABILITIES, caps);
+  if (!(caps & (1ULL << 15))) {
+    pr_err("hrperf: PERF_METRICS is not supported.\n");
+    return -ENODEV;
+  }
+  return 0;
+}
+#endif
+
+#if HRP_USE_RDT
+// RMID whose counters belong to this CPU's samples: the running task's if it
+// is tagged, else the core's; RMID0 if the core has none
+static __always_inline u32 hrperf_rdt_active_rmid(int cpu) {
+  struct rmid_info *rmid_info = mbm_get_rmid_info_for_core(cpu);
+  if (rmid_info == NULL) {
+    // no printk from the PMI handler
+    if (!in_nmi()) {
+      pr_err("hrperf: Failed to get RMID info for CPU %d\n", cpu);
+    }
+    return RMID0;
+  }
+#if HRP_RDT_TAGS
+  if (this_cpu_read(per_cpu_rdt_rmid) != RMID0) {
+    return this_cpu_read(per_cpu_rdt_rmid);
+  }
+#endif
+  return rmid_info->rmid;
+}
+#endif
+
+#if HRP_USE_RDT && !HRP_RDT_BATCHED
+// RDT counters of the RMID active on this CPU, read again once rdt_interval_us
+// passed since the last read or when the RMID changed. A snapshot reads them
+// directly and leaves the cache of the samples alone.
+static __always_inline void hrperf_read_rdt(HrperfLogEntry *entry, u64 kts,
+                                            hrp_tick_kind_t kind) {
+  hrperf_rdt_cache_t snapshot;
+  hrperf_rdt_cache_t *cache = kind == HRP_TICK_SNAPSHOT
+                                  ? &snapshot
+                                  : this_cpu_ptr(&per_cpu_rdt_cache);
+  mbm_counter_data_t mbm_data;
+  mbm_data.status = MBM_COUNTER_READ_SUCCESS;
+  mbm_data.rmid = hrperf_rdt_active_rmid(entry->cpu_id);
+#if HRP_RDT_TAGS
+  entry->tick.rmid = mbm_data.rmid;
+#endif
+  if (mbm_data.rmid == RMID0) {
+    return;
+  }
+
+  if (kind == HRP_TICK_SNAPSHOT || mbm_data.rmid != cache->rmid ||
+      kts >= cache->next_kts) {
+    mbm_read_counters(&mbm_data);
+    if (mbm_data.status != MBM_COUNTER_READ_SUCCESS) {
+      pr_warn("Core %d RMID %u: Failed to read MBM counters, status: %d\n",
+              entry->cpu_id, mbm_data.rmid, mbm_data.status);
+      return;
+    }
+    cache->rmid = mbm_data.rmid;
+    cache->next_kts = kts + hrperf_us_to_kts(rdt_interval_us);
+    cache->total_bw = mbm_data.total_bw;
+    cache->local_bw = mbm_data.local_bw;
+    cache->occupancy = mbm_data.occupancy;
+  }
+  entry->tick.total_bw = cache->total_bw;
+#if HRP_RDT_INCLUDE_LOCAL_BW
+  entry->tick.local_bw = cache->local_bw;
+#endif
+  entry->tick.occupancy = cache->occupancy;
+}
+#endif
+
+// Read the PMUs of the local CPU into the entry
+static __always_inline void hrperf_read_tick(HrperfLogEntry *entry, u64 kts,
+                                             hrp_tick_kind_t kind) {
+  entry->cpu_id = smp_processor_id();
+  entry->tick.kts = kts;
+#if HRP_ADAPTIVE_INTERVAL
+  u64 last_kts = this_cpu_read(per_cpu_last_kts);
+  entry->tick.interval = last_kts && kts > last_kts ? kts - last_kts : 0;
+  if (kind != HRP_TICK_SNAPSHOT) {
+    this_cpu_write(per_cpu_last_kts, kts);
+  }
+#endif
+#if HRP_LOG_SCHED_SWITCH
+  entry->tick.prev_tid = entry->tick.next_tid = current->pid;
+#endif
+#if HRP_INSTRUCTED_LOCKLESS
+  entry->tick.poll_tid = 0;
+#endif
+#if HRP_LOG_POLL_ID
+  entry->tick.poll_id = 0;
+#endif
+  rdmsrl(MSR_IA32_PMC2, entry->tick.stall_mem);
+  rdmsrl(MSR_IA32_FIXED_CTR0, entry->tick.inst_retire);
+  rdmsrl(MSR_IA32_FIXED_CTR1, entry->tick.cpu_unhalt);
+  rdmsrl(MSR_IA32_PMC0, entry->tick.llc_misses);
+  rdmsrl(MSR_IA32_PMC1, entry->tick.sw_prefetch);
+#if HRP_USE_ALL_COUNTERS
+  for (int i = 3; i < HRP_NUM_TICK_PMCS; i++) {
+    entry->tick.pmc[i - 3] = 0;
+    if (i < hrp_n_gp_counters) {
+      rdmsrl(MSR_IA32_PMC0 + i, entry->tick.pmc[i - 3]);
+    }
+  }
+  entry->tick.ref_cycles = 0;
+  entry->tick.slots = 0;
+  if (hrp_n_fixed_counters > 2) {
+    rdmsrl(MSR_IA32_FIXED_CTR2, entry->tick.ref_cycles);
+  }
+#if !HRP_USE_TOPDOWN
+  if (hrp_n_fixed_counters > 3) {
+    rdmsrl(MSR_IA32_FIXED_CTR3, entry->tick.slots);
+  }
+#endif
+#endif
+#if HRP_USE_TOPDOWN
+  hrperf_read_topdown(entry, kind);
+#endif
+#if HRP_LOG_FREQ
+  rdmsrl(MSR_IA32_APERF, entry->tick.aperf);
+  rdmsrl(MSR_IA32_MPERF, entry->tick.mperf);
+#endif
+  if (this_cpu_ptr(&per_cpu_overflow)->armed) {
+    if (overflow_counter == 0) {
+      entry->tick.llc_misses = hrp_overflow_count(entry->tick.llc_misses);
+    } else {
+      entry->tick.sw_prefetch = hrp_overflow_count(entry->tick.sw_prefetch);
+    }
+  }
+#if HRP_USE_MULTIPLEXING
+  hrperf_mux_tick(entry, kts, kind);
+#endif
+
+#if HRP_LOG_IMC
+  if (entry->cpu_id == HRP_IMC_DATA_ASSOCIATED_CORE) {
+    freeze_all_counters();
+    entry->tick.imc_reads = get_imc_reads();
+    entry->tick.imc_writes = get_imc_writes();
+    unfreeze_all_counters();
+  } else {
+    entry->tick.imc_reads = 0;
+    entry->tick.imc_writes = 0;
+  }
+#endif
+
+#if HRP_RDT_BATCHED
+#if HRP_RDT_TAGS
+  entry->tick.rmid = hrperf_rdt_active_rmid(entry->cpu_id);
+#endif
+#elif HRP_USE_RDT
+  hrperf_read_rdt(entry, kts, kind);
+#endif
+}
+
+#if HRP_ADAPTIVE_INTERVAL
+// Relative difference of two rates, in permille of the larger one
+static __always_inline u32 hrperf_rel_change(u64 a, u64 b) {
+  u64 hi = max(a, b);
+  if (hi == 0) {
+    return 0;
+  }
+  return div64_u64((a > b ? a - b : b - a) * 1000, hi);
+}
+
+// Compare the PMC0 rate and the IPC of this CPU's last window with the
+// previous one, for hrperf_adapt_interval
+static __always_inline void hrperf_update_activity(const HrperfLogEntry *entry) {
+  hrperf_activity_t *act = this_cpu_ptr(&per_cpu_activity);
+  u64 interval = entry->tick.interval;
+  u64 pmc0 = entry->tick.llc_misses;
+  u64 inst = entry->tick.inst_retire;
+  u64 cycles = entry->tick.cpu_unhalt;
+  u64 pmc0_rate = 0, ipc = 0;
+
+  if (interval != 0) {
+    pmc0_rate = div64_u64((pmc0 - act->pmc0) << 10, interval);
+  }
+  if (cycles != act->cycles) {
+    ipc = div64_u64((inst - act->inst) << 10, cycles - act->cycles);
+  }
+  act->change = max(hrperf_rel_change(pmc0_rate, act->pmc0_rate),
+                    hrperf_rel_change(ipc, act->ipc));
+  act->pmc0 = pmc0;
+  act->inst = inst;
+  act->cycles = cycles;
+  act->pmc0_rate = pmc0_rate;
+  act->ipc = ipc;
+}
+#endif
+
+// Cache lines per log clock tick to MB/s
+static __always_inline u64 hrperf_lines_to_mbps(u64 lines, u64 kts) {
+  return kts != 0 ? div64_u64(lines * 64 * hrperf_us_to_kts(1), kts) : 0;
+}
+
+#if HRP_BURST_SAMPLING
+// Bandwidth of this CPU over its last window, for hrperf_burst_update
+static __always_inline void hrperf_update_traffic(const HrperfLogEntry *entry) {
+  hrperf_traffic_t *t = this_cpu_ptr(&per_cpu_traffic);
+  u64 kts = entry->tick.kts;
+  u64 lines = entry->tick.llc_misses + entry->tick.sw_prefetch;
+#if HRP_LOG_IMC
+  u64 imc = entry->tick.imc_reads + entry->tick.imc_writes;
+#else
+  u64 imc = 0;
+#endif
+
+  // the first sample of a run only sets the baseline
+  if (t->kts != 0 && kts > t->kts) {
+    t->core_mbps = hrperf_lines_to_mbps(lines - t->lines, kts - t->kts);
+    t->imc_mbps = hrperf_lines_to_mbps(imc - t->imc, kts - t->kts);
+  }
+  t->kts = kts;
+  t->lines = lines;
+  t->imc = imc;
+}
+#endif
+
+static __always_inline void hrperf_hist_bucket(u64 *buckets, u64 value) {
+  buckets[min(fls64(value), HRP_HIST_BUCKETS - 1)]++;
+}
+
+// Add the window since this CPU's previous sample to its histograms
+static __always_inline void hrperf_hist_add(const HrperfLogEntry *entry) {
+  hrperf_hist_t *h = this_cpu_ptr(&per_cpu_hist);
+  u64 kts = entry->tick.kts;
+  u64 lines = entry->tick.llc_misses + entry->tick.sw_prefetch;
+  u64 inst = entry->tick.inst_retire;
+  u64 cycles = entry->tick.cpu_unhalt;
+  u64 stall = entry->tick.stall_mem;
+
+  // the first sample of a run only sets the baseline
+  if (h->kts != 0 && kts > h->kts) {
+    hrperf_hist_bucket(h->buckets[HRP_HIST_BANDWIDTH],
+                       hrperf_lines_to_mbps(lines - h->lines, kts - h->kts));
+    if (cycles != h->cycles) {
+      u64 dc = cycles - h->cycles;
+      hrperf_hist_bucket(h->buckets[HRP_HIST_IPC],
+                         div64_u64((inst - h->inst) * 1000, dc));
+      hrperf_hist_bucket(h->buckets[HRP_HIST_STALL],
+                         div64_u64((stall - h->stall) * 1000, dc));
+    }
+    h->windows++;
+  }
+  h->kts = kts;
+  h->lines = lines;
+  h->inst = inst;
+  h->cycles = cycles;
+  h->stall = stall;
+}
+
+// Store a sample of this CPU. A full ring drops it, unless in the flight
+// recorder, which overwrites the oldest sample instead. The histogram mode only
+// counts it.
+static __always_inline void hrperf_enqueue_sample(HrperfLogEntry entry) {
+  if (histograms) {
+    hrperf_hist_add(&entry);
+    return;
+  }
+  if (!flight_recorder) {
+    enqueue(hrp_this_rb(), entry);
+    return;
+  }
+  // a dump waits for the preempt-disabled sections to end, see
+  // hrperf_flight_dump
+  preempt_disable();
+  if (READ_ONCE(hrp_rb_frozen)) {
+    count_dropped(hrp_this_rb());
+  } else {
+    enqueue_overwrite(hrp_this_rb(), entry);
+  }
+  preempt_enable();
+}
+
+// Feed a tick of the local CPU to the sampling policies and its ring
+static __always_inline void hrperf_store_sample(HrperfLogEntry *entry) {
+#if HRP_ADAPTIVE_INTERVAL
+  hrperf_update_activity(entry);
+#endif
+#if HRP_BURST_SAMPLING
+  hrperf_update_traffic(entry);
+#endif
+  hrperf_enqueue_sample(*entry);
+}
+
+// Function to be called on each CPU by smp_call_function_many
+static void hrperf_poller_func(void *info) {
+#if HRP_STRICT_POLLING_SYNC
+  preempt_disable();
+  atomic_inc(&ready_cpus);
+
+  // Wait for all CPUs to be ready with timeout
+  unsigned long timeout = jiffies + msecs_to_jiffies(150);
+  while (!atomic_read(&start_flag)) {
+    if (time_after(jiffies, timeout)) {
+      pr_err("hrperf: Timeout waiting for start flag on CPU %d\n",
+             smp_processor_id());
+      atomic_inc(&done_cpus); // Mark as done to prevent main thread hang
+      preempt_enable();
+      return;
+    }
+    cpu_relax();
+  }
+#endif
+
+  HrperfLogEntry entry;
+  hrperf_poller_data_t *data = (hrperf_poller_data_t *)info;
+#if HRP_LOG_SCHED_SWITCH
+  // a context switch between the round's timestamp and this IPI would be
+  // stamped after the sample, keep the log of the CPU monotonic
+  hrperf_read_tick(&entry, hrp_read_kts(), HRP_TICK_PERIODIC);
+#else
+  hrperf_read_tick(&entry, data->kts, HRP_TICK_PERIODIC);
+#endif
+
+#if HRP_STRICT_POLLING_SYNC
+  atomic_inc(&done_cpus);
+  preempt_enable();
+#endif
+
+#if HRP_LOG_POLL_ID
+  entry.tick.poll_id = data->id;
+#endif
+  hrperf_store_sample(&entry);
+}
+
+#if HRP_TASK_COUNTERS
+static __always_inline void hrperf_task_read(u64 counters[HRP_TASK_N_COUNTERS]) {
+  rdmsrl(MSR_IA32_PMC2, counters[0]);
+  rdmsrl(MSR_IA32_FIXED_CTR0, counters[1]);
+  rdmsrl(MSR_IA32_FIXED_CTR1, counters[2]);
+  rdmsrl(MSR_IA32_PMC0, counters[3]);
+  rdmsrl(MSR_IA32_PMC1, counters[4]);
+}
+
+// The slot of a thread, a free one is claimed if it has none and `claim` is
+// set. NULL if there is none. tids are mostly sequential, the low bits spread
+// them over the table.
+static hrperf_task_slot_t *hrperf_task_slot(u32 tid, bool claim) {
+  hrperf_task_slot_t *slot;
+  u32 i;
+
+  for (i = 0; i < HRP_TASK_TABLE_PROBES; i++) {
+    slot = &hrp_task_table[(tid + i) & (HRP_TASK_TABLE_SIZE - 1)];
+    if (READ_ONCE(slot->tid) == tid) {
+      return slot;
+    }
+  }
+  if (!claim) {
+    return NULL;
+  }
+  for (i = 0; i < HRP_TASK_TABLE_PROBES; i++) {
+    slot = &hrp_task_table[(tid + i) & (HRP_TASK_TABLE_SIZE - 1)];
+    if (READ_ONCE(slot->tid) == 0 && cmpxchg(&slot->tid, 0, tid) == 0) {
+      return slot;
+    }
+  }
+  atomic64_inc(&hrp_task_table_full);
+  return NULL;
+}
+
+// Free the slot of an exiting thread, called on whichever CPU it last runs so
+// that the threads exiting off the selected CPUs do not fill the table
+static void hrperf_task_exit(struct task_struct *prev) {
+  hrperf_task_slot_t *slot = hrperf_task_slot(prev->pid, false);
+
+  if (slot != NULL) {
+    memset(&slot->start_time, 0,
+           sizeof(*slot) - offsetof(hrperf_task_slot_t, start_time));
+    smp_store_release(&slot->tid, 0);
+  }
+}
+
+// Add the counts since the last context switch of this CPU to the outgoing
+// thread, unless it is exiting
+static void hrperf_task_switch(struct task_struct *prev, bool dead) {
+  hrperf_task_base_t *base = this_cpu_ptr(&per_cpu_task_base);
+  u64 now[HRP_TASK_N_COUNTERS];
+  u64 kts = hrp_read_kts();
+
+  hrperf_task_read(now);
+  // the idle threads all have tid 0
+  if (base->valid && prev->pid != 0 && !dead) {
+    hrperf_task_slot_t *slot = hrperf_task_slot(prev->pid, true);
+    if (slot != NULL) {
+      if (slot->start_time != prev->start_time) {
+        memset(&slot->start_time, 0,
+               sizeof(*slot) - offsetof(hrperf_task_slot_t, start_time));
+        slot->start_time = prev->start_time;
+      }
+      slot->runs++;
+      slot->run_kts += kts - base->kts;
+      for (int i = 0; i < HRP_TASK_N_COUNTERS; i++) {
+        slot->counters[i] += (now[i] - base->counters[i]) & PMC_COUNTER_MASK;
+      }
+    }
+  }
+  base->valid = true;
+  base->kts = kts;
+  memcpy(base->counters, now, sizeof(now));
+}
+
+// Totals of tc->tid, with the current run if it is the caller
+static void hrperf_task_collect(hrp_task_counters_t *tc) {
+  u32 tid = tc->tid;
+  u64 totals[HRP_TASK_N_COUNTERS] = {0};
+
+  memset(tc, 0, sizeof(*tc));
+  tc->tid = tid;
+  if (tid == 0) {
+    return;
+  }
+
+  // no context switch can update the caller's slot or base meanwhile
+  preempt_disable();
+  hrperf_task_slot_t *slot = hrperf_task_slot(tid, false);
+  if (slot != NULL) {
+    tc->valid = 1;
+    tc->runs = READ_ONCE(slot->runs);
+    tc->run_kts = READ_ONCE(slot->run_kts);
+    for (int i = 0; i < HRP_TASK_N_COUNTERS; i++) {
+      totals[i] = READ_ONCE(slot->counters[i]);
+    }
+  }
+  hrperf_task_base_t *base = this_cpu_ptr(&per_cpu_task_base);
+  if (tid == current->pid && base->valid &&
+      cpumask_test_cpu(smp_processor_id(), &hrp_selected_cpus)) {
+    u64 now[HRP_TASK_N_COUNTERS];
+    if (slot != NULL && slot->start_time != current->start_time) {
+      // a previous thread with this tid
+      tc->runs = 0;
+      tc->run_kts = 0;
+      memset(totals, 0, sizeof(totals));
+    }
+    hrperf_task_read(now);
+    tc->valid = 1;
+    tc->run_kts += hrp_read_kts() - base->kts;
+    for (int i = 0; i < HRP_TASK_N_COUNTERS; i++) {
+      totals[i] += (now[i] - base->counters[i]) & PMC_COUNTER_MASK;
+    }
+  }
+  preempt_enable();
+
+  tc->stall_mem = totals[0];
+  tc->inst_retire = totals[1];
+  tc->cpu_unhalt = totals[2];
+  tc->llc_misses = totals[3];
+  tc->sw_prefetch = totals[4];
+}
+#endif
+
+#if HRP_RDT_TAGS
+// Associate this CPU with the RMID of the incoming task, or the core's
+static __always_inline void hrperf_rdt_switch(struct task_struct *next) {
+  u32 rmid = mbm_rmid_for_task(next);
+
+  if (rmid == RMID0) {
+    struct rmid_info *info = mbm_get_rmid_info_for_core(smp_processor_id());
+    rmid = info != NULL ? info->rmid : RMID0;
+  }
+  if (rmid != this_cpu_read(per_cpu_rdt_rmid)) {
+    mbm_set_rmid(rmid);
+    this_cpu_write(per_cpu_rdt_rmid, rmid);
+  }
+}
+#endif
+
+#if HRP_SCHED_SWITCH_HOOK
+// the sched_switch tracepoint, found by name as it is not exported to modules
+static struct tracepoint *hrp_sched_switch_tp;
+
+static void hrperf_find_sched_switch(struct tracepoint *tp, void *priv) {
+  if (strcmp(tp->name, "sched_switch") == 0) {
+    hrp_sched_switch_tp = tp;
+  }
+}
+
+// Account and sample the counters of the outgoing task and switch the RMID to
+// the incoming one, runs with interrupts disabled
+static void hrperf_sched_switch(void *data, bool preempt,
+                                struct task_struct *prev,
+                                struct task_struct *next
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+                                ,
+                                unsigned int prev_state
+#endif
+) {
+#if HRP_RDT_TAGS
+  // tagged tasks are monitored wherever they run
+  hrperf_rdt_switch(next);
+#endif
+#if HRP_TASK_COUNTERS
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+  bool dead = prev_state == TASK_DEAD;
+#else
+  bool dead = prev->exit_state != 0;
+#endif
+  if (dead && prev->pid != 0) {
+    hrperf_task_exit(prev);
+  }
+#endif
+  if (!cpumask_test_cpu(smp_processor_id(), &hrp_selected_cpus)) {
+    return;
+  }
+#if HRP_TASK_COUNTERS
+  hrperf_task_switch(prev, dead);
+#endif
+#if HRP_LOG_SCHED_SWITCH
+  if (READ_ONCE(hrperf_running)) {
+    HrperfLogEntry entry;
+    hrperf_read_tick(&entry, hrp_read_kts(), HRP_TICK_SWITCH);
+    entry.tick.prev_tid = prev->pid;
+    entry.tick.next_tid = next->pid;
+    hrperf_enqueue_sample(entry);
+  }
+#endif
+}
+#endif
+
+static __always_inline void hrperf_timing_add(hrperf_timing_t *timing,
+                                              u64 start_ns) {
+  u64 ns = ktime_get_ns() - start_ns;
+  timing->n++;
+  timing->ns_total += ns;
+  if (ns > timing->ns_max) {
+    timing->ns_max = ns;
+  }
+}
+
+// Concurrent polls from other CPUs share no lock or cache line for their
+// timing. The polls run in task context, so no preemption suffices.
+static __always_inline void hrperf_poll_timing_add(u64 start_ns) {
+  preempt_disable();
+  hrperf_timing_add(this_cpu_ptr(&per_cpu_poll_timing), start_ns);
+  preempt_enable();
+}
+
+static __always_inline void smp_poll_pmus(hrperf_poller_data_t *poller_data) {
+#if !HRP_INSTRUCTED_LOCKLESS
+  if (instructed_profile) {
+    mutex_lock(&instructed_profile_lock);
+  }
+#endif
+  u64 start_ns = ktime_get_ns();
+
+#if HRP_STRICT_POLLING_SYNC
+  preempt_disable();
+#endif
+
+  poller_data->kts = hrp_read_kts();
+
+#if HRP_STRICT_POLLING_SYNC
+  atomic_set(&ready_cpus, 0);
+  atomic_set(&start_flag, 0);
+  atomic_set(&done_cpus, 0);
+
+  // Create a CPU mask excluding the poller CPU if it shouldn't poll
+  cpumask_var_t polling_cpus;
+  if (!alloc_cpumask_var(&polling_cpus, GFP_KERNEL)) {
+    pr_err("hrperf: Failed to allocate CPU mask for polling\n");
+    return;
+  }
+
+  cpumask_copy(polling_cpus, &hrp_selected_cpus);
+#if (HRP_POLL_POLLER_CORE != 1)
+  cpumask_clear_cpu(poller_cpu, polling_cpus);
+#endif
+
+  smp_call_function_many(polling_cpus, hrperf_poller_func, (void *)poller_data,
+                         0);
+#if HRP_POLL_POLLER_CORE
+  // Current CPU also participates
+  atomic_inc(&ready_cpus);
+#endif
+
+  // Wait for all polling CPUs to be ready with timeout
+  unsigned long timeout = jiffies + msecs_to_jiffies(200);
+  while (atomic_read(&ready_cpus) < N_POLLING_CPUS) {
+    if (time_after(jiffies, timeout)) {
+      pr_err("hrperf: Timeout waiting for CPUs to be ready. Ready: %d, "
+             "Expected: %u\n",
+             atomic_read(&ready_cpus), N_POLLING_CPUS);
+      free_cpumask_var(polling_cpus);
+      return;
+    }
+    cpu_relax();
+  }
+
+  atomic_set(&start_flag, 1);
+
+#if HRP_POLL_POLLER_CORE
+  hrperf_poller_func((void *)poller_data);
+#endif
+
+  preempt_enable();
+
+  // Wait for all polling CPUs to complete with timeout
+  timeout = jiffies + msecs_to_jiffies(200);
+  while (atomic_read(&done_cpus) < N_POLLING_CPUS) {
+    if (time_after(jiffies, timeout)) {
+      pr_err("hrperf: Timeout waiting for CPUs to complete. Done: %d, "
+             "Expected: %u\n",
+             atomic_read(&done_cpus), N_POLLING_CPUS);
+      break;
+    }
+    cpu_relax();
+  }
+
+  free_cpumask_var(polling_cpus);
+#else
+  smp_call_function_many(&hrp_selected_cpus, hrperf_poller_func,
+                         (void *)poller_data, 1);
+#if HRP_POLL_POLLER_CORE
+  hrperf_poller_func((void *)poller_data);
+#endif
+#endif
+  hrperf_poll_timing_add(start_ns);
+
+#if !HRP_INSTRUCTED_LOCKLESS
+  if (instructed_profile) {
+    mutex_unlock(&instructed_profile_lock);
+  }
+#endif
+}
+
+#if HRP_INSTRUCTED_LOCKLESS
+// Sample this CPU for the instructed poll `data`, tagged with its thread. A
+// poll that started later may already have sampled this CPU, after this poll
+// was requested: its sample stands for both and is logged again with this
+// poll's thread, so that every poll has a sample on each of its CPUs and the
+// timestamps of the CPU stay ordered.
+static void hrperf_instructed_sample(const hrperf_poller_data_t *data) {
+  u64 *seq = this_cpu_ptr(&per_cpu_instructed_seq);
+  HrperfLogEntry *last = this_cpu_ptr(&per_cpu_instructed_last);
+
+  if (data->kts <= *seq) {
+    HrperfLogEntry entry = *last;
+    entry.tick.poll_tid = data->tid;
+#if HRP_LOG_POLL_ID
+    entry.tick.poll_id = data->id;
+#endif
+    hrperf_enqueue_sample(entry);
+    return;
+  }
+  *seq = data->kts;
+  hrperf_read_tick(last, data->kts, HRP_TICK_PERIODIC);
+  last->tick.poll_tid = data->tid;
+#if HRP_LOG_POLL_ID
+  last->tick.poll_id = data->id;
+#endif
+  hrperf_store_sample(last);
+}
+
+static void hrperf_instructed_poll_func(void *info) {
+#if (HRP_POLL_POLLER_CORE != 1)
+  if (smp_processor_id() == poller_cpu) {
+    return;
+  }
+#endif
+  hrperf_instructed_sample(info);
+}
+
+// An instructed poll from the calling thread. Concurrent polls only meet in
+// the IPI handlers of each CPU, which run one at a time.
+static void hrperf_instructed_poll(hrperf_poller_data_t *poller_data) {
+  u64 start_ns = ktime_get_ns();
+
+  poller_data->kts = hrp_read_kts();
+  poller_data->tid = current->pid;
+  on_each_cpu_mask(&hrp_selected_cpus, hrperf_instructed_poll_func,
+                   (void *)poller_data, 1);
+  hrperf_poll_timing_add(start_ns);
+}
+#endif
+
+// Wait for the running instructed ops before the events or CPUs change, and
+// keep new ones out until hrperf_unblock_instructed. Called with
+// hrp_state_lock held.
+static __always_inline void hrperf_block_instructed(void) {
+  percpu_down_write(&hrp_instructed_sem);
+}
+
+static __always_inline void hrperf_unblock_instructed(void) {
+  percpu_up_write(&hrp_instructed_sem);
+}
+
+// Sleep for `ratio` poll intervals, a high bound below the low one is ignored
+static __always_inline void hrperf_sleep_intervals(uint ratio) {
+  unsigned long low = poll_interval_us_low;
+  unsigned long high = max(poll_interval_us_high, poll_interval_us_low);
+  usleep_range(low * ratio, high * ratio);
+}
+
+#if HRP_ADAPTIVE_INTERVAL
+// Next poll interval in us: halved when the largest change of the last round
+// is above adaptive_threshold, grown by a quarter when it is below a quarter of
+// it. Once the budget is spent, the interval is stretched to the budget's rate.
+static u32 hrperf_adapt_interval(hrperf_adaptive_t *state) {
+  u32 change = 0;
+  u32 iv = state->interval_us;
+  int cpu;
+
+  for_each_cpu(cpu, &hrp_selected_cpus) {
+    change = max(change, READ_ONCE(per_cpu_ptr(&per_cpu_activity, cpu)->change));
+  }
+  if (change > adaptive_threshold) {
+    iv /= 2;
+  } else if (change < adaptive_threshold / 4) {
+    iv += max(iv / 4, 1U);
+  }
+  // a minimum above the maximum wins
+  iv = max(min(iv, adaptive_max_us), adaptive_min_us);
+  state->interval_us = iv;
+
+  if (adaptive_budget != 0) {
+    u64 now = ktime_get_ns();
+    u64 elapsed = min_t(u64, now - state->refill_ns, NSEC_PER_SEC);
+    state->refill_ns = now;
+    state->tokens = min_t(s64, state->tokens + div64_u64(elapsed * adaptive_budget,
+                                                       NSEC_PER_SEC),
+                          adaptive_budget);
+    state->tokens -= N_POLLING_CPUS;
+    if (state->tokens < 0) {
+      iv = max_t(u64, iv,
+                 div64_u64((u64)N_POLLING_CPUS * USEC_PER_SEC, adaptive_budget));
+    }
+  }
+  return iv;
+}
+#endif
+
+#if HRP_BURST_SAMPLING
+static void hrperf_emit_marker(u64 type, const u64 args[HRP_LOG_MARKER_NARGS]);
+
+// End the current burst once its window has passed, and start one when a CPU
+// or a NUMA node is above its threshold. Returns whether the poller is
+// bursting.
+static bool hrperf_burst_update(hrperf_burst_t *burst) {
+  u64 core_max = 0, node_max = 0;
+  int cpu, node, hot_cpu = -1, hot_node = 0;
+
+  memset(burst->node_mbps, 0, nr_node_ids * sizeof(*burst->node_mbps));
+  for_each_cpu(cpu, &hrp_selected_cpus) {
+    const hrperf_traffic_t *t = per_cpu_ptr(&per_cpu_traffic, cpu);
+    u64 core = READ_ONCE(t->core_mbps);
+    if (core > core_max) {
+      core_max = core;
+      hot_cpu = cpu;
+    }
+#if HRP_LOG_IMC
+    // only the CPU reading the IMCs carries their counts, on its node
+    burst->node_mbps[cpu_to_node(cpu)] += READ_ONCE(t->imc_mbps);
+#else
+    burst->node_mbps[cpu_to_node(cpu)] += core;
+#endif
+  }
+  for (node = 0; node < nr_node_ids; node++) {
+    if (burst->node_mbps[node] > node_max) {
+      node_max = burst->node_mbps[node];
+      hot_node = node;
+    }
+  }
+
+  u64 now = ktime_get_ns();
+  if (burst->active) {
+    burst->rounds++;
+    if (now < burst->end_ns) {
+      return true;
+    }
+    u64 args[HRP_LOG_MARKER_NARGS] = {burst->rounds};
+    hrperf_emit_marker(HRP_LOG_MARKER_BURST_END, args);
+    burst->active = false;
+  }
+
+  bool core_hot = burst_core_mbps != 0 && core_max >= burst_core_mbps;
+  bool node_hot = burst_node_mbps != 0 && node_max >= burst_node_mbps;
+  if (core_hot || node_hot) {
+    u64 args[HRP_LOG_MARKER_NARGS] = {
+        core_hot ? (u64)hot_cpu : (u64)(-1 - hot_node), core_max, node_max,
+        burst_window_us};
+    hrperf_emit_marker(HRP_LOG_MARKER_BURST_START, args);
+    burst->active = true;
+    burst->end_ns = now + (u64)burst_window_us * NSEC_PER_USEC;
+    burst->rounds = 0;
+  }
+  return burst->active;
+}
+#endif
+
+// Single poller thread function for initiating the smp_call_function_many
+static int hrperf_poller_thread(void *arg) {
+  hrperf_poller_data_t poller_data = {0};
+#if HRP_ADAPTIVE_INTERVAL
+  hrperf_adaptive_t adaptive = {
+      .interval_us = adaptive_min_us,
+      .tokens = adaptive_budget,
+      .refill_ns = ktime_get_ns(),
+  };
+#endif
+#if HRP_BURST_SAMPLING
+  hrperf_burst_t burst = {.active = false};
+
+  burst.node_mbps = kcalloc(nr_node_ids, sizeof(*burst.node_mbps), GFP_KERNEL);
+  if (burst.node_mbps == NULL) {
+    pr_err("hrperf: Failed to allocate the burst state, polling without "
+           "bursts.\n");
+  }
+#endif
+  while (!kthread_should_stop()) {
+    if (!hrperf_running) {
+      set_current_state(TASK_INTERRUPTIBLE);
+      complete(&hrp_poller_parked);
+      schedule(); // pause execution here
+    }
+
+    smp_poll_pmus(&poller_data);
+#if HRP_ADAPTIVE_INTERVAL
+    u32 iv = hrperf_adapt_interval(&adaptive);
+    usleep_range(iv, iv + iv / 4);
+#elif HRP_BURST_SAMPLING
+    if (burst.node_mbps != NULL && hrperf_burst_update(&burst)) {
+      usleep_range(burst_interval_us, burst_interval_us + burst_interval_us / 4);
+    } else {
+      hrperf_sleep_intervals(1);
+    }
+#else
+    hrperf_sleep_intervals(1);
+#endif
+  }
+#if HRP_BURST_SAMPLING
+  kfree(burst.node_mbps);
+#endif
+  return 0;
+}
+
+static void hrperf_fill_marker(HrperfLogEntry *entry, int cpu_id, u64 kts,
+                               u64 type, const u64 args[HRP_LOG_MARKER_NARGS]) {
+  memset(entry, 0, sizeof(*entry));
+  entry->cpu_id = cpu_id;
+  entry->marker.kts = kts;
+  entry->marker.type = type;
+  for (int i = 0; i < HRP_LOG_MARKER_NARGS; i++) {
+    entry->marker.args[i] = args[i];
+  }
+}
+
+static void hrperf_emit_marker_at(u64 kts, u64 type,
+                                  const u64 args[HRP_LOG_MARKER_NARGS]) {
+  HrperfLogEntry entry;
+  unsigned long flags;
+
+  hrperf_fill_marker(&entry, HRP_LOG_MARKER_CPU, kts, type, args);
+  spin_lock_irqsave(&marker_lock, flags);
+  enqueue(marker_rb, entry);
+  spin_unlock_irqrestore(&marker_lock, flags);
+}
+
+static void hrperf_emit_marker(u64 type,
+                               const u64 args[HRP_LOG_MARKER_NARGS]) {
+  hrperf_emit_marker_at(hrp_read_kts(), type, args);
+}
+
+#if HRP_RDT_BATCHED
+// RMIDs a housekeeping thread reads per round, the cores of its node and tags
+#define HRP_RDT_BATCH_MAX (MAX_CORES + MAX_RMID_TAGS)
+
+// RDT housekeeping thread of a node, its batch and the ring of its records.
+// A batch is as many records as the node has RMIDs, too many for the shared
+// marker ring between two logger passes.
+typedef struct hrperf_rdt_node {
+  struct task_struct *thread; // NULL for nodes without CPUs
+  HrperfRingBuffer *rb;       // the thread is its only producer
+  int node;
+  mbm_counter_data_t data[HRP_RDT_BATCH_MAX];
+  u32 core_ids[HRP_RDT_BATCH_MAX];
+} hrperf_rdt_node_t;
+
+static hrperf_rdt_node_t *hrp_rdt_nodes;
+static cpumask_t hrp_rdt_cpus;
+
+// Housekeeping thread of a node, `arg` is its hrperf_rdt_node_t: reads the RDT
+// counters of the node's RMIDs in one batch per rdt_interval_us and logs them
+// with the time of the batch, as HRP_LOG_RDT_CPU(node)
+static int hrperf_rdt_thread(void *arg) {
+  hrperf_rdt_node_t *rn = arg;
+
+  while (!kthread_should_stop()) {
+    if (!hrperf_running) {
+      set_current_state(TASK_INTERRUPTIBLE);
+      schedule(); // pause execution here
+    }
+
+    if (kthread_should_stop())
+      break;
+
+    u64 kts = hrp_read_kts();
+    int n = mbm_rmid_poll_node(rn->node, rn->data, rn->core_ids,
+                               HRP_RDT_BATCH_MAX);
+    for (int i = 0; i < n; i++) {
+      const mbm_counter_data_t *d = &rn->data[i];
+      if (d->status != MBM_COUNTER_READ_SUCCESS) {
+        pr_warn_ratelimited("hrperf: Node %d RMID %u: Failed to read MBM "
+                            "counters, status: %d\n",
+                            rn->node, d->rmid, d->status);
+        continue;
+      }
+      u64 args[HRP_LOG_MARKER_NARGS] = {
+          ((u64)rn->node << 48) | ((u64)rn->core_ids[i] << 32) | d->rmid,
+          d->total_bw, d->local_bw, d->occupancy};
+      HrperfLogEntry entry;
+      hrperf_fill_marker(&entry, HRP_LOG_RDT_CPU(rn->node), kts,
+                         HRP_LOG_MARKER_RDT, args);
+      enqueue(rn->rb, entry);
+    }
+
+    if (rdt_interval_us != 0) {
+      usleep_range(rdt_interval_us, rdt_interval_us + rdt_interval_us / 4);
+    } else {
+      hrperf_sleep_intervals(1);
+    }
+  }
+  return 0;
+}
+
+// One housekeeping thread per node with CPUs, on the node's CPUs that are not
+// sampled if there are any
+static int hrperf_start_rdt_threads(void) {
+  int node;
+
+  hrp_rdt_nodes = vzalloc(nr_node_ids * sizeof(*hrp_rdt_nodes));
+  if (hrp_rdt_nodes == NULL) {
+    return -ENOMEM;
+  }
+  for_each_online_node(node) {
+    hrperf_rdt_node_t *rn = &hrp_rdt_nodes[node];
+
+    if (cpumask_empty(cpumask_of_node(node))) {
+      continue;
+    }
+    rn->node = node;
+#if HRP_MMAP_RB
+    rn->rb = alloc_ring_buffer();
+#else
+    rn->rb = vzalloc(sizeof(*rn->rb));
+    if (rn->rb != NULL && init_ring_buffer(rn->rb) != 0) {
+      vfree(rn->rb);
+      rn->rb = NULL;
+    }
+#endif
+    if (rn->rb == NULL) {
+      pr_err("hrperf: Failed to allocate the RDT ring of node %d\n", node);
+      return -ENOMEM;
+    }
+    rn->thread = kthread_create_on_node(hrperf_rdt_thread, rn, node,
+                                        "hrperf_rdt/%d", node);
+    if (IS_ERR(rn->thread)) {
+      int ret = PTR_ERR(rn->thread);
+      rn->thread = NULL;
+      pr_err("hrperf: Failed to create the RDT thread of node %d\n", node);
+      return ret;
+    }
+    if (!cpumask_andnot(&hrp_rdt_cpus, cpumask_of_node(node),
+                        &hrp_selected_cpus)) {
+      cpumask_copy(&hrp_rdt_cpus, cpumask_of_node(node));
+    }
+    set_cpus_allowed_ptr(rn->thread, &hrp_rdt_cpus);
+    wake_up_process(rn->thread);
+  }
+  return 0;
+}
+#endif
+
+// Record the programmed events in the log, one marker per group and counter
+static void hrperf_emit_event_markers(void) {
+  for (u32 g = 0; g < hrp_groups.n_groups; g++) {
+    for (int i = 0; i < hrp_n_gp_counters; i++) {
+      const hrp_event_sel_t *ev = &hrp_groups.groups[g].events[i];
+      u64 args[HRP_LOG_MARKER_NARGS] = {((u64)g << 16) | i, ev->evtsel,
+                                        ev->offcore_rsp, ev->name_id};
+      hrperf_emit_marker(HRP_LOG_MARKER_EVENT_SEL, args);
+    }
+  }
+}
+
+// Describe the run for the log header, the entry layout is filled by log.c
+static void hrperf_fill_log_header(hrp_log_header_t *header) {
+  int cpu;
+
+  hrperf_log_header_init(header);
+#if HRP_USE_TSC
+  header->clock = HRP_LOG_CLOCK_TSC;
+#elif HRP_USE_RAW_CLOCK
+  header->clock = HRP_LOG_CLOCK_RAW;
+#else
+  header->clock = HRP_LOG_CLOCK_REAL;
+#endif
+  if (instructed_profile) {
+    header->sampling_mode = (u32)-1;
+  } else {
+    header->sampling_mode = sampling_mode;
+    if (sampling_mode == HRP_SAMPLING_MODE_HRTIMER) {
+      header->sampling_period = hrtimer_interval_us;
+    } else if (sampling_mode == HRP_SAMPLING_MODE_OVERFLOW) {
+      header->sampling_period = overflow_period;
+    } else {
+#if HRP_ADAPTIVE_INTERVAL
+      // variable, the `interval` field has the actual one of each sample
+      header->sampling_period = adaptive_min_us;
+#else
+      header->sampling_period = poll_interval_us_low;
+#endif
+    }
+  }
+  // prefer our own calibration, the TSC timestamps are converted with it
+  header->tsc_khz = cycles_per_us != 0 ? cycles_per_us * 1000 : tsc_khz;
+#if HRP_USE_RDT
+  header->rdt_scale = mbm_get_scaling_factor();
+#endif
+  for_each_cpu(cpu, &hrp_selected_cpus) {
+    if (cpu < HRP_PMC_CPU_SELECTION_MASK_BITS) {
+      header->cpu_mask[cpu / 64] |= 1ULL << (cpu % 64);
+    }
+  }
+  header->events = hrp_groups;
+
+  preempt_disable();
+  header->start_walltime_ns = ktime_get_real_ns();
+  header->start_kts = hrp_read_kts();
+  preempt_enable();
+}
+
+// Per-CPU hrtimer callback, polls the local PMUs at each point of the grid
+static enum hrtimer_restart hrperf_hrtimer_func(struct hrtimer *timer) {
+  hrperf_hrtimer_data_t *data =
+      container_of(timer, hrperf_hrtimer_data_t, timer);
+
+  if (!hrperf_running) {
+    return HRTIMER_NORESTART;
+  }
+
+  HrperfLogEntry entry;
+#if HRP_LOG_SCHED_SWITCH
+  // the grid point is before the expiry, and maybe before a context switch
+  // sampled since, keep the log of the CPU monotonic
+  hrperf_read_tick(&entry, hrp_read_kts(), HRP_TICK_PERIODIC);
+#else
+  hrperf_read_tick(&entry,
+                   hrtimer_epoch_kts + data->slot * hrtimer_interval_kts,
+                   HRP_TICK_PERIODIC);
+#endif
+  hrperf_enqueue_sample(entry);
+
+  // skip the grid points we have missed, if any, to stay phase-aligned
+  data->slot += hrtimer_forward_now(timer, hrtimer_interval);
+  return HRTIMER_RESTART;
+}
+
+// Called on each selected CPU, the timer must be started locally to be pinned
+static void hrperf_hrtimer_arm(void *info) {
+  hrperf_hrtimer_data_t *data = this_cpu_ptr(&per_cpu_hrtimer);
+  data->slot = 0;
+  hrtimer_start(&data->timer, hrtimer_epoch, HRTIMER_MODE_ABS_PINNED_HARD);
+}
+
+static void hrperf_hrtimer_start_all(void) {
+  // Place the shared epoch a bit in the future so that every CPU has armed
+  // its timer before the first expiry, and map it to the log clock.
+  preempt_disable();
+  ktime_t now = ktime_get();
+  u64 now_kts = hrp_read_kts();
+  preempt_enable();
+
+  hrtimer_interval = ns_to_ktime(hrtimer_interval_us * 1000ULL);
+  hrtimer_epoch = ktime_add_ns(now, HRP_PMC_HRTIMER_START_DELAY_US * 1000ULL);
+#if HRP_USE_TSC
+  hrtimer_epoch_kts = now_kts + HRP_PMC_HRTIMER_START_DELAY_US * cycles_per_us;
+  hrtimer_interval_kts = hrtimer_interval_us * cycles_per_us;
+#else
+  hrtimer_epoch_kts = now_kts + HRP_PMC_HRTIMER_START_DELAY_US * 1000ULL;
+  hrtimer_interval_kts = hrtimer_interval_us * 1000ULL;
+#endif
+
+  on_each_cpu_mask(&hrp_selected_cpus, hrperf_hrtimer_arm, NULL, 1);
+}
+
+static void hrperf_hrtimer_cancel_all(void) {
+  int cpu;
+  for_each_cpu(cpu, &hrp_selected_cpus) {
+    hrtimer_cancel(&per_cpu_ptr(&per_cpu_hrtimer, cpu)->timer);
+  }
+}
+
+static void hrperf_hrtimer_init_all(void) {
+  int cpu;
+  for_each_cpu(cpu, &hrp_selected_cpus) {
+    hrperf_hrtimer_data_t *data = per_cpu_ptr(&per_cpu_hrtimer, cpu);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&data->timer, hrperf_hrtimer_func, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_ABS_PINNED_HARD);
+#else
+    hrtimer_init(&data->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED_HARD);
+    data->timer.function = hrperf_hrtimer_func;
+#endif
+  }
+}
+
+// PMI handler of the overflow sampling engine, runs in NMI context
+static int hrperf_pmi_handler(unsigned int cmd, struct pt_regs *regs) {
+  u64 status, raw;
+  u64 ovf_bit = 1ULL << overflow_counter;
+
+  if (!cpumask_test_cpu(smp_processor_id(), &hrp_selected_cpus) ||
+      !this_cpu_ptr(&per_cpu_overflow)->armed) {
+    return NMI_DONE;
+  }
+  rdmsrl(MSR_IA32_GLOBAL_STATUS, status);
+  if (!(status & ovf_bit)) {
+    return NMI_DONE;
+  }
+
+  if (hrperf_running) {
+    HrperfLogEntry entry;
+    hrperf_read_tick(&entry, hrp_read_kts_nmi(), HRP_TICK_PERIODIC);
+    hrperf_enqueue_sample(entry);
+  }
+
+  // account the events including the skid past the overflow, then re-arm
+  rdmsrl(hrp_overflow_pmc_msr(), raw);
+  this_cpu_ptr(&per_cpu_overflow)->base = hrp_overflow_count(raw);
+  wrmsrl_safe(hrp_overflow_pmc_write_msr(), overflow_preload);
+  wrmsrl(MSR_IA32_GLOBAL_OVF_CTRL, ovf_bit);
+
+  // the LVT entry is masked when a PMI is delivered, unmask it for the next one
+  apic_write(APIC_LVTPC, APIC_DM_NMI);
+  return NMI_HANDLED;
+}
+
+// Claim the trigger counter from the kernel's PMU users. perf, including the NMI
+// watchdog, reserves all counters while it has events and would take over the
+// PMI of LVTPC, so the overflow mode refuses to load next to it and perf
+// refuses new events while hrperf is loaded.
+static int hrperf_overflow_reserve(void) {
+  if (!reserve_perfctr_nmi(MSR_ARCH_PERFMON_PERFCTR0 + overflow_counter)) {
+    pr_err("hrperf: PMC%d is in use by perf or the NMI watchdog "
+           "(nmi_watchdog=0).\n",
+           overflow_counter);
+    return -EBUSY;
+  }
+  if (!reserve_evntsel_nmi(MSR_ARCH_PERFMON_EVENTSEL0 + overflow_counter)) {
+    release_perfctr_nmi(MSR_ARCH_PERFMON_PERFCTR0 + overflow_counter);
+    pr_err("hrperf: The event select of PMC%d is in use by perf.\n",
+           overflow_counter);
+    return -EBUSY;
+  }
+  return 0;
+}
+
+static void hrperf_overflow_release(void) {
+  release_evntsel_nmi(MSR_ARCH_PERFMON_EVENTSEL0 + overflow_counter);
+  release_perfctr_nmi(MSR_ARCH_PERFMON_PERFCTR0 + overflow_counter);
+}
+
+// Called on each selected CPU to preload the trigger counter and enable its PMI
+static void hrperf_overflow_arm(void *info) {
+  u64 raw, evtsel;
+
+  rdmsrl(hrp_overflow_pmc_msr(), raw);
+  if (wrmsrl_safe(hrp_overflow_pmc_write_msr(), overflow_preload) != 0) {
+    pr_err("hrperf: CPU %d refused the preload of PMC%d.\n",
+           smp_processor_id(), overflow_counter);
+    return;
+  }
+  this_cpu_ptr(&per_cpu_overflow)->base = raw;
+  this_cpu_ptr(&per_cpu_overflow)->armed = true;
+
+  rdmsrl(hrp_overflow_evtsel_msr(), evtsel);
+  wrmsrl(hrp_overflow_evtsel_msr(), evtsel | PMC_ESEL_INT);
+  apic_write(APIC_LVTPC, APIC_DM_NMI);
+}
+
+// Called on each selected CPU to disable the PMI, the trigger counter goes back
+// to free-running from the events it has accumulated
+static void hrperf_overflow_disarm(void *info) {
+  u64 raw, evtsel;
+
+  // hrperf_overflow_arm failed on this CPU, the counter was left alone
+  if (!this_cpu_ptr(&per_cpu_overflow)->armed) {
+    return;
+  }
+  rdmsrl(hrp_overflow_evtsel_msr(), evtsel);
+  wrmsrl(hrp_overflow_evtsel_msr(), evtsel & ~PMC_ESEL_INT);
+
+  rdmsrl(hrp_overflow_pmc_msr(), raw);
+  raw = hrp_overflow_count(raw);
+  this_cpu_ptr(&per_cpu_overflow)->base = 0;
+  this_cpu_ptr(&per_cpu_overflow)->armed = false;
+  wrmsrl_safe(hrp_overflow_pmc_write_msr(), raw & PMC_COUNTER_MASK);
+  wrmsrl(MSR_IA32_GLOBAL_OVF_CTRL, 1ULL << overflow_counter);
+}
+
+// Drain the rings of a logger's CPUs into its file
+static __always_inline void hrperf_logger_pass(hrperf_logger_t *logger) {
+  if (logger->log.file == NULL) {
+    return;
+  }
+
+  u64 start_ns = ktime_get_ns();
+  if (logger->markers) {
+    log_and_clear(marker_rb, &logger->log);
+  }
+#if HRP_RDT_BATCHED
+  for (int node = 0; hrp_rdt_nodes != NULL && node < nr_node_ids; node++) {
+    HrperfRingBuffer *rb = hrp_rdt_nodes[node].rb;
+    if (rb != NULL &&
+        (logger->node == NUMA_NO_NODE || node == logger->node)) {
+      log_and_clear(rb, &logger->log);
+    }
+  }
+#endif
+
+  // also flushes the rings of CPUs deselected at runtime
+  int cpu;
+  for_each_cpu(cpu, &hrp_rb_cpus) {
+    if (logger->node == NUMA_NO_NODE || cpu_to_node(cpu) == logger->node) {
+      log_and_clear(hrp_cpu_rb(cpu), &logger->log);
+    }
+  }
+  hrperf_timing_add(&logger->timing, start_ns);
+}
+
+static __always_inline void log_for_all_cpus(void) {
+#if !HRP_INSTRUCTED_LOCKLESS
+  if (instructed_profile) {
+    mutex_lock(&instructed_profile_lock);
+  }
+#endif
+
+  for (int i = 0; i < hrp_n_loggers; i++) {
+#if HRP_INSTRUCTED_LOCKLESS
+    // a ring has a single consumer, concurrent logs take turns per logger
+    mutex_lock(&hrp_loggers[i].lock);
+    hrperf_logger_pass(&hrp_loggers[i]);
+    mutex_unlock(&hrp_loggers[i].lock);
+#else
+    hrperf_logger_pass(&hrp_loggers[i]);
+#endif
+  }
+
+#if !HRP_INSTRUCTED_LOCKLESS
+  if (instructed_profile) {
+    mutex_unlock(&instructed_profile_lock);
+  }
+#endif
+}
+
+// Logger thread function, `arg` is its hrperf_logger_t
+static int hrperf_logger_thread(void *arg) {
+  hrperf_logger_t *logger = arg;
+  while (!kthread_should_stop()) {
+    if (!hrperf_running) {
+      set_current_state(TASK_INTERRUPTIBLE);
+      schedule(); // pause execution here
+    }
+
+    if (kthread_should_stop())
+      break;
+
+    hrperf_sleep_intervals(polling_logging_ratio);
+    hrperf_logger_pass(logger);
+  }
+  return 0;
+}
+
+// Open the log files, one per NUMA node with CPUs or the single one
+static int hrperf_init_loggers(void) {
+#if HRP_LOG_PER_NODE
+  size_t len = strlen(log_dir);
+  const char *sep = len > 0 && log_dir[len - 1] == '/' ? "" : "/";
+  int node;
+
+  hrp_loggers = kcalloc(nr_node_ids, sizeof(*hrp_loggers), GFP_KERNEL);
+  if (hrp_loggers == NULL) {
+    return -ENOMEM;
+  }
+  for_each_online_node(node) {
+    hrperf_logger_t *logger;
+    char *path;
+
+    // memory-only nodes have no rings to drain
+    if (cpumask_empty(cpumask_of_node(node))) {
+      continue;
+    }
+    path = kasprintf(GFP_KERNEL, "%s%shrperf_log.node%d.bin", log_dir, sep,
+                     node);
+    if (path == NULL) {
+      return -ENOMEM;
+    }
+    logger = &hrp_loggers[hrp_n_loggers++];
+    logger->node = node;
+    logger->markers = hrp_n_loggers == 1;
+#if HRP_INSTRUCTED_LOCKLESS
+    mutex_init(&logger->lock);
+#endif
+    if (hrperf_init_log_file(&logger->log, path, &log_header, node) != 0) {
+      pr_err("hrperf: Failed to initialize log file %s\n", path);
+    }
+    kfree(path);
+  }
+#else
+  hrp_loggers = kcalloc(1, sizeof(*hrp_loggers), GFP_KERNEL);
+  if (hrp_loggers == NULL) {
+    return -ENOMEM;
+  }
+  hrp_n_loggers = 1;
+  hrp_loggers[0].node = NUMA_NO_NODE;
+  hrp_loggers[0].markers = true;
+#if HRP_INSTRUCTED_LOCKLESS
+  mutex_init(&hrp_loggers[0].lock);
+#endif
+  if (hrperf_init_log_file(&hrp_loggers[0].log, HRP_PMC_LOG_PATH, &log_header,
+                           NUMA_NO_NODE) != 0) {
+    printk(KERN_ERR "Failed to initialize log file\n");
+  }
+#endif
+  return 0;
+}
+
+// Write the flight recorder's history of every ring to the log files. The
+// rings are frozen meanwhile, their samples are counted as dropped, so all
+// histories end at the dump. Called with hrp_state_lock held.
+static int hrperf_flight_dump(void) {
+  u64 args[HRP_LOG_MARKER_NARGS] = {hrp_n_dumps};
+
+  if (!flight_recorder) {
+    pr_warn("hrperf: Dumps need the flight recorder (flight_recorder=1).\n");
+    return -EINVAL;
+  }
+
+  WRITE_ONCE(hrp_rb_frozen, true);
+  // the samples being stored run with preemption disabled, wait for them
+  synchronize_rcu();
+  hrperf_emit_marker(HRP_LOG_MARKER_DUMP, args);
+  log_for_all_cpus();
+  WRITE_ONCE(hrp_rb_frozen, false);
+
+  pr_info("hrperf: Flight recorder dump %llu written\n", hrp_n_dumps++);
+  return 0;
+}
+
+static int hrperf_start_loggers(void) {
+  for (int i = 0; i < hrp_n_loggers; i++) {
+    hrperf_logger_t *logger = &hrp_loggers[i];
+#if HRP_LOG_PER_NODE
+    logger->thread = kthread_create_on_node(hrperf_logger_thread, logger,
+                                            logger->node, "hrperf_logger/%d",
+                                            logger->node);
+#else
+    logger->thread =
+        kthread_create(hrperf_logger_thread, logger, "logger_thread");
+#endif
+    if (IS_ERR(logger->thread)) {
+      int ret = PTR_ERR(logger->thread);
+      logger->thread = NULL;
+      printk(KERN_ERR "Failed to create the logger thread\n");
+      return ret;
+    }
+#if HRP_LOG_PER_NODE
+    // anywhere on its node, like the memory it copies
+    set_cpus_allowed_ptr(logger->thread, cpumask_of_node(logger->node));
+#else
+    kthread_bind(logger->thread, logger_cpu);
+#endif
+    wake_up_process(logger->thread);
+  }
+  return 0;
+}
+
+static void instructed_poll_op(struct work_struct *work) {
+  hrperf_poller_data_t poller_data;
+  poller_data.kts = 0; // Initialize kts to 0, will be set in the poller
+#if HRP_LOG_POLL_ID
+  poller_data.id = atomic64_inc_return(&hrp_poll_id);
+#endif
+#if HRP_INSTRUCTED_LOCKLESS
+  hrperf_instructed_poll(&poller_data);
+#else
+  smp_poll_pmus(&poller_data);
+#endif
+}
+
+static void instructed_log_op(struct work_struct *work) { log_for_all_cpus(); }
+
+static void instructed_poll_and_log(struct work_struct *work) {
+  instructed_poll_op(work);
+  instructed_log_op(work);
+}
+
+static __always_inline int
+enqueue_instructed_profile_op(instructed_profile_func_t func) {
+#if HRP_INSTRUCTED_LOCKLESS
+  // in the caller's context, concurrent ops only wait for the changes of the
+  // events and CPUs
+  if (instructed_profile) {
+    percpu_down_read(&hrp_instructed_sem);
+    func(NULL);
+    percpu_up_read(&hrp_instructed_sem);
+    return 0;
+  }
+#endif
+  if (instructed_profile) {
+    struct work_struct work;
     if (instructed_profile_wq == NULL) {
       pr_err("hrperf: Instructed profile workqueue is NULL.\n");
       return -EFAULT;
     }
-    queue_work_on(HRP_PMC_POLLER_CPU, instructed_profile_wq, work);
-    flush_work(work);
+    // the workqueue runs one op at a time on the poller CPU; the read side
+    // only keeps the events, CPUs and poller CPU from changing meanwhile
+    percpu_down_read(&hrp_instructed_sem);
+    INIT_WORK_ONSTACK(&work, func);
+    queue_work_on(poller_cpu, instructed_profile_wq, &work);
+    flush_work(&work);
+    destroy_work_on_stack(&work);
+    percpu_up_read(&hrp_instructed_sem);
     printk(KERN_INFO
            "hrperf: Instructed profiling - single poll and log done\n");
   } else {
@@ -384,6 +2286,348 @@ enqueue_instructed_profile_op(instructed_profile_func_t func) {
   return 0;
 }
 
+// Whether a targeted poll samples `cpu`, the CPUs of a full poll
+static __always_inline bool hrperf_poll_target(int cpu) {
+#if (HRP_POLL_POLLER_CORE != 1)
+  if (cpu == poller_cpu) {
+    return false;
+  }
+#endif
+  return cpumask_test_cpu(cpu, &hrp_selected_cpus);
+}
+
+static void hrperf_targeted_poll_func(void *info) {
+#if HRP_INSTRUCTED_LOCKLESS
+  hrperf_instructed_sample(info);
+#else
+  HrperfLogEntry entry;
+
+  hrperf_read_tick(&entry, ((hrperf_poller_data_t *)info)->kts,
+                   HRP_TICK_PERIODIC);
+#if HRP_LOG_POLL_ID
+  entry.tick.poll_id = ((hrperf_poller_data_t *)info)->id;
+#endif
+  hrperf_store_sample(&entry);
+#endif
+}
+
+// An instructed poll of the requested sampled CPUs only, so that a
+// request-scoped measurement does not interrupt the unrelated cores. The
+// calling CPU alone is read in place, without a cpumask or an IPI. Targeted
+// polls skip the barrier of HRP_STRICT_POLLING_SYNC, which waits for all CPUs.
+static int hrperf_poll_cpus(hrp_poll_cpus_t *arg) {
+  hrp_poll_cpus_t req;
+  hrperf_poller_data_t poll;
+  cpumask_var_t cpus;
+  u32 n = 0;
+  u64 start_ns;
+  int cpu;
+
+  if (!instructed_profile) {
+    pr_warn("hrperf: Targeted polls need the instructed profile mode.\n");
+    return -EINVAL;
+  }
+  if (copy_from_user(&req, arg, sizeof(req))) {
+    return -EFAULT;
+  }
+  if (req.flags & ~(HRP_POLL_CPUS_SELF | HRP_POLL_CPUS_LOG)) {
+    return -EINVAL;
+  }
+  if (!(req.flags & HRP_POLL_CPUS_SELF) &&
+      !zalloc_cpumask_var(&cpus, GFP_KERNEL)) {
+    return -ENOMEM;
+  }
+
+  // like the other instructed ops, see enqueue_instructed_profile_op; the
+  // lock keeps the timestamps of each ring ordered against the full polls
+  percpu_down_read(&hrp_instructed_sem);
+#if !HRP_INSTRUCTED_LOCKLESS
+  mutex_lock(&instructed_profile_lock);
+#endif
+  start_ns = ktime_get_ns();
+#if HRP_INSTRUCTED_LOCKLESS
+  poll.tid = current->pid;
+#endif
+#if HRP_LOG_POLL_ID
+  poll.id = atomic64_inc_return(&hrp_poll_id);
+#endif
+  if (req.flags & HRP_POLL_CPUS_SELF) {
+    unsigned long flags;
+
+    // like an IPI handler, nothing else samples this CPU meanwhile
+    local_irq_save(flags);
+    if (hrperf_poll_target(smp_processor_id())) {
+      poll.kts = hrp_read_kts();
+      hrperf_targeted_poll_func(&poll);
+      n = 1;
+    }
+    local_irq_restore(flags);
+  } else {
+    for_each_cpu(cpu, &hrp_selected_cpus) {
+      if (cpu < HRP_PMC_CPU_SELECTION_MASK_BITS &&
+          (req.cpu_mask[cpu / 64] >> (cpu % 64) & 1) &&
+          hrperf_poll_target(cpu)) {
+        cpumask_set_cpu(cpu, cpus);
+      }
+    }
+    n = cpumask_weight(cpus);
+    poll.kts = hrp_read_kts();
+    // runs in place, without an IPI, for the calling CPU
+    on_each_cpu_mask(cpus, hrperf_targeted_poll_func, &poll, 1);
+    free_cpumask_var(cpus);
+  }
+  hrperf_poll_timing_add(start_ns);
+#if !HRP_INSTRUCTED_LOCKLESS
+  mutex_unlock(&instructed_profile_lock);
+#endif
+  percpu_up_read(&hrp_instructed_sem);
+
+  if (req.flags & HRP_POLL_CPUS_LOG) {
+    int ret = enqueue_instructed_profile_op(instructed_log_op);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+  if (put_user(n, &arg->n_polled)) {
+    return -EFAULT;
+  }
+  return 0;
+}
+
+// a snapshot round, the ticks are indexed by CPU and belong to the caller
+typedef struct hrperf_snapshot_round {
+  u64 kts;
+  HrperfLogEntry *ticks;
+} hrperf_snapshot_round_t;
+
+static void hrperf_snapshot_func(void *info) {
+  hrperf_snapshot_round_t *round = info;
+
+  hrperf_read_tick(&round->ticks[smp_processor_id()], round->kts,
+                   HRP_TICK_SNAPSHOT);
+}
+
+// Read the requested sampled CPUs with one IPI round and copy their ticks to
+// the user buffer, bypassing the rings, the workqueue and the log. All ticks
+// have the time the round started.
+static int hrperf_snapshot(hrp_snapshot_t *arg) {
+  hrp_snapshot_t snap;
+  hrperf_snapshot_round_t round;
+  cpumask_var_t cpus;
+  u32 n = 0;
+  int cpu, ret = 0;
+
+  if (!instructed_profile) {
+    pr_warn("hrperf: Snapshots need the instructed profile mode.\n");
+    return -EINVAL;
+  }
+  if (copy_from_user(&snap, arg, sizeof(snap))) {
+    return -EFAULT;
+  }
+  if (!zalloc_cpumask_var(&cpus, GFP_KERNEL)) {
+    return -ENOMEM;
+  }
+  for_each_cpu(cpu, &hrp_selected_cpus) {
+    if (cpu < HRP_PMC_CPU_SELECTION_MASK_BITS &&
+        (snap.cpu_mask[cpu / 64] >> (cpu % 64) & 1)) {
+      cpumask_set_cpu(cpu, cpus);
+    }
+  }
+  if (cpumask_weight(cpus) > snap.max_entries) {
+    free_cpumask_var(cpus);
+    return -ENOSPC;
+  }
+  if (cpumask_empty(cpus)) {
+    free_cpumask_var(cpus);
+    return put_user(0u, &arg->n_entries) ? -EFAULT : 0;
+  }
+  // concurrent snapshots each read into their own ticks
+  round.ticks = kvmalloc_array(cpumask_last(cpus) + 1, sizeof(*round.ticks),
+                               GFP_KERNEL);
+  if (round.ticks == NULL) {
+    free_cpumask_var(cpus);
+    return -ENOMEM;
+  }
+
+  percpu_down_read(&hrp_instructed_sem);
+  round.kts = hrp_read_kts();
+  on_each_cpu_mask(cpus, hrperf_snapshot_func, &round, 1);
+  percpu_up_read(&hrp_instructed_sem);
+  for_each_cpu(cpu, cpus) {
+    char *dst = (char *)u64_to_user_ptr(snap.entries) +
+                (size_t)n * sizeof(HrperfLogEntry);
+    if (copy_to_user(dst, &round.ticks[cpu], sizeof(HrperfLogEntry))) {
+      ret = -EFAULT;
+      break;
+    }
+    n++;
+  }
+  kvfree(round.ticks);
+  free_cpumask_var(cpus);
+
+  if (ret == 0 && put_user(n, &arg->n_entries)) {
+    ret = -EFAULT;
+  }
+  return ret;
+}
+
+#if HRP_MMAP_RB
+// Map the ring buffer of one monitored CPU into user space. The CPU is chosen by
+// the mmap offset, cpu * HRP_RB_MMAP_SIZE for the entries and the producer
+// state, read-only, plus HRP_RB_MMAP_HEAD_OFFSET for the page of the head
+// index, which the consumer writes. The marker ring is mapped as CPU
+// nr_cpu_ids, the RDT ring of node n (HRP_RDT_BATCHED) as nr_cpu_ids + 1 + n.
+static int hrperf_mmap(struct file *file, struct vm_area_struct *vma) {
+  unsigned long size = vma->vm_end - vma->vm_start;
+  unsigned long rb_pages = HRP_RB_MMAP_SIZE >> PAGE_SHIFT;
+  unsigned long cpu = vma->vm_pgoff / rb_pages;
+  unsigned long pgoff = vma->vm_pgoff % rb_pages;
+  HrperfRingBuffer *rb;
+
+  if (pgoff == HRP_RB_MMAP_HEAD_OFFSET >> PAGE_SHIFT) {
+    if (size > PAGE_SIZE) {
+      return -EINVAL;
+    }
+  } else if (pgoff != 0 || size > HRP_RB_MMAP_HEAD_OFFSET) {
+    return -EINVAL;
+  } else if (vma->vm_flags & VM_WRITE) {
+    // tail indexes the entries the kernel writes, it must stay the kernel's
+    return -EPERM;
+  } else {
+    vm_flags_clear(vma, VM_MAYWRITE);
+  }
+
+  if (cpu == nr_cpu_ids) {
+    rb = marker_rb;
+  } else if (cpu < nr_cpu_ids && cpumask_test_cpu(cpu, &hrp_rb_cpus)) {
+    rb = hrp_cpu_rb(cpu);
+#if HRP_RDT_BATCHED
+  } else if (cpu > nr_cpu_ids && cpu - nr_cpu_ids - 1 < nr_node_ids &&
+             hrp_rdt_nodes != NULL &&
+             hrp_rdt_nodes[cpu - nr_cpu_ids - 1].rb != NULL) {
+    rb = hrp_rdt_nodes[cpu - nr_cpu_ids - 1].rb;
+#endif
+  } else {
+    return -ENXIO;
+  }
+  return remap_vmalloc_range(vma, rb, pgoff);
+}
+#endif
+
+static void hrperf_rb_stats(const HrperfRingBuffer *rb, hrp_rb_stats_t *stats) {
+  stats->produced = rb->produced;
+  stats->dropped = rb->dropped;
+  stats->logged_bytes = rb->logged_bytes;
+  stats->max_occupancy = rb->max_occupancy;
+  stats->valid = 1;
+}
+
+static void hrperf_collect_stats(hrp_stats_t *stats) {
+  int cpu;
+
+  memset(stats, 0, sizeof(*stats));
+  for_each_possible_cpu(cpu) {
+    const hrperf_timing_t *timing = per_cpu_ptr(&per_cpu_poll_timing, cpu);
+    stats->poll_rounds += timing->n;
+    stats->poll_ns_total += timing->ns_total;
+    stats->poll_ns_max = max(stats->poll_ns_max, timing->ns_max);
+  }
+  for (int i = 0; i < hrp_n_loggers; i++) {
+    const hrperf_timing_t *timing = &hrp_loggers[i].timing;
+    stats->log_passes += timing->n;
+    stats->log_ns_total += timing->ns_total;
+    stats->log_ns_max = max(stats->log_ns_max, timing->ns_max);
+  }
+  hrperf_rb_stats(marker_rb, &stats->marker);
+#if HRP_RDT_BATCHED
+  for (int node = 0; hrp_rdt_nodes != NULL && node < nr_node_ids; node++) {
+    const HrperfRingBuffer *rb = hrp_rdt_nodes[node].rb;
+    if (rb != NULL) {
+      stats->rdt.produced += rb->produced;
+      stats->rdt.dropped += rb->dropped;
+      stats->rdt.logged_bytes += rb->logged_bytes;
+      stats->rdt.max_occupancy = max(stats->rdt.max_occupancy,
+                                     rb->max_occupancy);
+      stats->rdt.valid = 1;
+    }
+  }
+#endif
+  for_each_cpu(cpu, &hrp_rb_cpus) {
+    if (cpu < HRP_PMC_CPU_SELECTION_MASK_BITS) {
+      hrperf_rb_stats(hrp_cpu_rb(cpu), &stats->cpus[cpu]);
+    }
+  }
+}
+
+static void hrperf_collect_hist(hrp_hist_t *hist) {
+  u32 cpu = hist->cpu;
+
+  memset(hist, 0, sizeof(*hist));
+  hist->cpu = cpu;
+  if (cpu >= nr_cpu_ids || !cpumask_test_cpu(cpu, &hrp_selected_cpus)) {
+    return;
+  }
+  const hrperf_hist_t *h = per_cpu_ptr(&per_cpu_hist, cpu);
+  hist->valid = 1;
+  hist->windows = h->windows;
+  memcpy(hist->buckets, h->buckets, sizeof(hist->buckets));
+}
+
+// Clear the histograms, or with `keep_buckets` only the previous samples so
+// that the next window starts at the next sample. Called while paused.
+static void hrperf_reset_hist(bool keep_buckets) {
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    hrperf_hist_t *h = per_cpu_ptr(&per_cpu_hist, cpu);
+    if (keep_buckets) {
+      h->kts = 0;
+    } else {
+      memset(h, 0, sizeof(*h));
+    }
+  }
+}
+
+// /sys/kernel/debug/hrperf/stats
+static int hrperf_stats_show(struct seq_file *m, void *v) {
+  hrp_stats_t *stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+  if (stats == NULL) {
+    return -ENOMEM;
+  }
+  hrperf_collect_stats(stats);
+
+  seq_printf(m, "poll_rounds %llu avg_ns %llu max_ns %llu\n",
+             stats->poll_rounds,
+             stats->poll_rounds ? stats->poll_ns_total / stats->poll_rounds
+                                : 0,
+             stats->poll_ns_max);
+  seq_printf(m, "log_passes %llu avg_ns %llu max_ns %llu\n",
+             stats->log_passes,
+             stats->log_passes ? stats->log_ns_total / stats->log_passes : 0,
+             stats->log_ns_max);
+  seq_printf(m, "%-6s %14s %14s %16s %10s\n", "cpu", "produced", "dropped",
+             "logged_bytes", "max_occ");
+  seq_printf(m, "%-6s %14llu %14llu %16llu %10u\n", "marker",
+             stats->marker.produced, stats->marker.dropped,
+             stats->marker.logged_bytes, stats->marker.max_occupancy);
+  if (stats->rdt.valid) {
+    seq_printf(m, "%-6s %14llu %14llu %16llu %10u\n", "rdt",
+               stats->rdt.produced, stats->rdt.dropped, stats->rdt.logged_bytes,
+               stats->rdt.max_occupancy);
+  }
+  for (int cpu = 0; cpu < HRP_PMC_CPU_SELECTION_MASK_BITS; cpu++) {
+    const hrp_rb_stats_t *rb = &stats->cpus[cpu];
+    if (rb->valid) {
+      seq_printf(m, "%-6d %14llu %14llu %16llu %10u\n", cpu, rb->produced,
+                 rb->dropped, rb->logged_bytes, rb->max_occupancy);
+    }
+  }
+
+  kfree(stats);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hrperf_stats);
+
 // IOCTL function to start/stop the logger/pollers
 static long hrperf_ioctl(struct file *file, unsigned int cmd,
                          unsigned long arg) {
@@ -394,12 +2638,36 @@ static long hrperf_ioctl(struct file *file, unsigned int cmd,
               "command is invalid in this mode.\n");
       return -EINVAL;
     }
+    mutex_lock(&hrp_state_lock);
     if (!hrperf_running) {
+#if HRP_USE_MULTIPLEXING
+      on_each_cpu_mask(&hrp_selected_cpus, hrperf_mux_resume, NULL, 1);
+#endif
+      // the pause is not a window
+      hrperf_reset_hist(true);
       hrperf_running = true;
-      wake_up_process(poller_thread);
-      wake_up_process(logger_thread);
+      if (sampling_mode == HRP_SAMPLING_MODE_HRTIMER) {
+        hrperf_hrtimer_start_all();
+      } else if (sampling_mode == HRP_SAMPLING_MODE_OVERFLOW) {
+        on_each_cpu_mask(&hrp_selected_cpus, hrperf_overflow_arm, NULL, 1);
+      } else {
+        wake_up_process(poller_thread);
+      }
+      for (int i = 0; i < hrp_n_loggers; i++) {
+        if (hrp_loggers[i].thread) {
+          wake_up_process(hrp_loggers[i].thread);
+        }
+      }
+#if HRP_RDT_BATCHED
+      for (int node = 0; node < nr_node_ids; node++) {
+        if (hrp_rdt_nodes[node].thread) {
+          wake_up_process(hrp_rdt_nodes[node].thread);
+        }
+      }
+#endif
       printk(KERN_INFO "hrperf: Monitoring resumed\n");
     }
+    mutex_unlock(&hrp_state_lock);
     break;
   case HRP_PMC_IOC_PAUSE:
     if (instructed_profile) {
@@ -407,48 +2675,266 @@ static long hrperf_ioctl(struct file *file, unsigned int cmd,
               "command is invalid in this mode.\n");
       return -EINVAL;
     }
+    mutex_lock(&hrp_state_lock);
     if (hrperf_running) {
+      reinit_completion(&hrp_poller_parked);
       hrperf_running = false;
+      if (sampling_mode == HRP_SAMPLING_MODE_HRTIMER) {
+        hrperf_hrtimer_cancel_all();
+      } else if (sampling_mode == HRP_SAMPLING_MODE_OVERFLOW) {
+        on_each_cpu_mask(&hrp_selected_cpus, hrperf_overflow_disarm, NULL, 1);
+      } else {
+        // the events and CPUs may change once the running round is done
+        wait_for_completion(&hrp_poller_parked);
+      }
+#if HRP_USE_MULTIPLEXING
+      on_each_cpu_mask(&hrp_selected_cpus, hrperf_mux_pause, NULL, 1);
+#endif
       printk(KERN_INFO "hrperf: Monitoring paused\n");
     }
+    mutex_unlock(&hrp_state_lock);
+    break;
+  case HRP_PMC_IOC_TSC_FREQ: {
+    if (cycles_per_us == 0) {
+      cycles_per_us = hrp_calibrate_tsc();
+      if (cycles_per_us == 0) {
+        pr_err("hrperf: TSC calibration failed.\n");
+        return -EIO;
+      }
+    }
+    if (copy_to_user((u64 *)arg, &cycles_per_us, sizeof(cycles_per_us))) {
+      return -EFAULT;
+    }
+    break;
+  }
+  case HRP_PMC_IOC_INSTRUCTED_POLL: {
+    // Perform a single poll operation
+    int ret = enqueue_instructed_profile_op(instructed_poll_op);
+    if (ret != 0) {
+      return ret;
+    }
+    break;
+  }
+  case HRP_PMC_IOC_INSTRUCTED_LOG: {
+    // Perform a single log operation
+    int ret = enqueue_instructed_profile_op(instructed_log_op);
+    if (ret != 0) {
+      return ret;
+    }
+    break;
+  }
+  case HRP_PMC_IOC_INSTRUCTED_POLL_AND_LOG: {
+    // Perform a single poll and log operation
+    int ret = enqueue_instructed_profile_op(instructed_poll_and_log);
+    if (ret != 0) {
+      return ret;
+    }
+    break;
+  }
+  case HRP_PMC_IOC_INSTRUCTED_POLL_CPUS:
+    return hrperf_poll_cpus((hrp_poll_cpus_t *)arg);
+  case HRP_PMC_IOC_SNAPSHOT:
+    return hrperf_snapshot((hrp_snapshot_t *)arg);
+  case HRP_PMC_IOC_SET_EVENTS: {
+    hrp_event_config_t config;
+    int ret;
+    if (copy_from_user(&config, (hrp_event_config_t *)arg, sizeof(config))) {
+      return -EFAULT;
+    }
+    if (hrperf_check_events(&config) != 0) {
+      return -EINVAL;
+    }
+    mutex_lock(&hrp_state_lock);
+    if (hrperf_running) {
+      mutex_unlock(&hrp_state_lock);
+      pr_warn("hrperf: Events can only be changed while paused.\n");
+      return -EBUSY;
+    }
+    hrperf_block_instructed();
+    hrp_groups_prev = hrp_groups;
+    hrp_groups.n_groups = 1;
+    hrp_groups.groups[0] = config;
+    ret = hrperf_program_groups();
+    if (ret == 0) {
+      hrperf_emit_event_markers();
+    }
+    hrperf_unblock_instructed();
+    mutex_unlock(&hrp_state_lock);
+    if (ret != 0) {
+      return ret;
+    }
+    pr_info("hrperf: Reprogrammed events on selected CPUs\n");
+    break;
+  }
+  case HRP_PMC_IOC_GET_EVENTS: {
+    hrp_event_config_t config;
+
+    mutex_lock(&hrp_state_lock);
+    config = hrp_groups.groups[0];
+    mutex_unlock(&hrp_state_lock);
+    if (copy_to_user((hrp_event_config_t *)arg, &config, sizeof(config))) {
+      return -EFAULT;
+    }
+    break;
+  }
+#if HRP_USE_MULTIPLEXING
+  case HRP_PMC_IOC_SET_GROUPS: {
+    hrp_event_groups_t groups;
+    int ret;
+    if (copy_from_user(&groups, (hrp_event_groups_t *)arg, sizeof(groups))) {
+      return -EFAULT;
+    }
+    if (groups.n_groups == 0 || groups.n_groups > HRP_MUX_MAX_GROUPS) {
+      pr_err("hrperf: Invalid number of event groups %u.\n", groups.n_groups);
+      return -EINVAL;
+    }
+    for (u32 g = 0; g < groups.n_groups; g++) {
+      if (hrperf_check_events(&groups.groups[g]) != 0) {
+        return -EINVAL;
+      }
+    }
+    mutex_lock(&hrp_state_lock);
+    if (hrperf_running) {
+      mutex_unlock(&hrp_state_lock);
+      pr_warn("hrperf: Event groups can only be changed while paused.\n");
+      return -EBUSY;
+    }
+    if (groups.rotate_samples == 0) {
+      groups.rotate_samples = hrp_groups.rotate_samples;
+    }
+    hrperf_block_instructed();
+    hrp_groups_prev = hrp_groups;
+    hrp_groups = groups;
+    ret = hrperf_program_groups();
+    if (ret == 0) {
+      hrperf_emit_event_markers();
+    }
+    hrperf_unblock_instructed();
+    mutex_unlock(&hrp_state_lock);
+    if (ret != 0) {
+      return ret;
+    }
+    pr_info("hrperf: Multiplexing %u event groups, switching every %u "
+            "samples\n",
+            hrp_groups.n_groups, hrp_groups.rotate_samples);
+    break;
+  }
+  case HRP_PMC_IOC_GET_GROUPS: {
+    if (copy_to_user((hrp_event_groups_t *)arg, &hrp_groups,
+                     sizeof(hrp_groups))) {
+      return -EFAULT;
+    }
+    break;
+  }
+#endif
+  case HRP_PMC_IOC_GET_STATS: {
+    int ret = 0;
+    hrp_stats_t *stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+    if (stats == NULL) {
+      return -ENOMEM;
+    }
+    hrperf_collect_stats(stats);
+    if (copy_to_user((hrp_stats_t *)arg, stats, sizeof(*stats))) {
+      ret = -EFAULT;
+    }
+    kfree(stats);
+    if (ret != 0) {
+      return ret;
+    }
+    break;
+  }
+  case HRP_PMC_IOC_DUMP: {
+    int ret;
+    mutex_lock(&hrp_state_lock);
+    ret = hrperf_flight_dump();
+    mutex_unlock(&hrp_state_lock);
+    if (ret != 0) {
+      return ret;
+    }
     break;
-  case HRP_PMC_IOC_TSC_FREQ: {
-    if (cycles_per_us == 0) {
-      cycles_per_us = hrp_calibrate_tsc();
-      if (cycles_per_us == 0) {
-        pr_err("hrperf: TSC calibration failed.\n");
-        return -EIO;
+  }
+  case HRP_PMC_IOC_GET_HIST: {
+    int ret = 0;
+    hrp_hist_t *hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+    if (hist == NULL) {
+      return -ENOMEM;
+    }
+    if (copy_from_user(&hist->cpu, &((hrp_hist_t *)arg)->cpu,
+                       sizeof(hist->cpu))) {
+      ret = -EFAULT;
+    } else {
+      hrperf_collect_hist(hist);
+      if (copy_to_user((hrp_hist_t *)arg, hist, sizeof(*hist))) {
+        ret = -EFAULT;
       }
     }
-    if (copy_to_user((u64 *)arg, &cycles_per_us, sizeof(cycles_per_us))) {
-      return -EFAULT;
+    kfree(hist);
+    if (ret != 0) {
+      return ret;
     }
     break;
   }
-  case HRP_PMC_IOC_INSTRUCTED_POLL: {
-    // Perform a single poll operation
-    int ret = enqueue_instructed_profile_op(instructed_poll_op);
+  case HRP_PMC_IOC_RESET_HIST: {
+    int ret = 0;
+    mutex_lock(&hrp_state_lock);
+    if (hrperf_running) {
+      pr_warn("hrperf: The histograms can only be reset while paused.\n");
+      ret = -EBUSY;
+    } else {
+      hrperf_reset_hist(false);
+    }
+    mutex_unlock(&hrp_state_lock);
     if (ret != 0) {
       return ret;
     }
     break;
   }
-  case HRP_PMC_IOC_INSTRUCTED_LOG: {
-    // Perform a single log operation
-    int ret = enqueue_instructed_profile_op(instructed_log_op);
-    if (ret != 0) {
-      return ret;
+#if HRP_TASK_COUNTERS
+  case HRP_PMC_IOC_TASK_COUNTERS: {
+    hrp_task_counters_t tc;
+    if (copy_from_user(&tc, (hrp_task_counters_t *)arg, sizeof(tc))) {
+      return -EFAULT;
+    }
+    hrperf_task_collect(&tc);
+    if (copy_to_user((hrp_task_counters_t *)arg, &tc, sizeof(tc))) {
+      return -EFAULT;
     }
     break;
   }
-  case HRP_PMC_IOC_INSTRUCTED_POLL_AND_LOG: {
-    // Perform a single poll and log operation
-    int ret = enqueue_instructed_profile_op(instructed_poll_and_log);
+#endif
+  case HRP_PMC_IOC_LOG_HEADER: {
+    // for logs written by user-space consumers of the mmap-ed rings
+    int ret = 0;
+    mutex_lock(&hrp_state_lock);
+    hrperf_fill_log_header(&log_header);
+    if (copy_to_user((hrp_log_header_t *)arg, &log_header,
+                     sizeof(log_header))) {
+      ret = -EFAULT;
+    }
+    mutex_unlock(&hrp_state_lock);
     if (ret != 0) {
       return ret;
     }
     break;
   }
+#if HRP_MMAP_RB
+  case HRP_PMC_IOC_RB_LAYOUT: {
+    hrp_rb_layout_t layout = {
+        .mmap_size = HRP_RB_MMAP_SIZE,
+        .n_entries = HRP_PMC_BUFFER_SIZE,
+        .entry_size = sizeof(HrperfLogEntry),
+        .head_offset = HRP_RB_MMAP_HEAD_OFFSET,
+        .tail_offset = offsetof(HrperfRingBuffer, tail),
+        .marker_index = nr_cpu_ids,
+        .rdt_index = nr_cpu_ids + 1,
+        .n_rdt_nodes = HRP_RDT_BATCHED ? nr_node_ids : 0,
+    };
+    if (copy_to_user((hrp_rb_layout_t *)arg, &layout, sizeof(layout))) {
+      return -EFAULT;
+    }
+    break;
+  }
+#endif
 #if HRP_USE_RDT
   case HRP_PMC_IOC_RDT_SCALE_FACTOR: {
     u32 scale_factor = mbm_get_scaling_factor();
@@ -469,12 +2955,36 @@ static long hrperf_ioctl(struct file *file, unsigned int cmd,
     if (copy_from_user(&rmid_set_args, (rmid_set_info_t *)arg, sizeof(rmid_set_info_t))) {
       return -EFAULT;
     }
+    // the RMID indexes the widened MBM counters
+    if (rmid_set_args.rmid > mbm_get_max_rmid()) {
+      pr_err("hrperf: RMID %u is above the max RMID %u.\n",
+             rmid_set_args.rmid, mbm_get_max_rmid());
+      return -EINVAL;
+    }
     mbm_set_rmid_for_core(rmid_set_args.core_id, rmid_set_args.rmid);
     u64 ts = __rdtsc();
     pr_info("hrperf: Set RMID %u on core %u at %llu\n", rmid_set_args.rmid,
            rmid_set_args.core_id, ts);
     break;
   }
+#if HRP_RDT_TAGS
+  case HRP_PMC_IOC_RDT_TAG: {
+    rmid_tag_info_t tag;
+    if (copy_from_user(&tag, (rmid_tag_info_t *)arg, sizeof(tag))) {
+      return -EFAULT;
+    }
+    int ret = mbm_rmid_set_tag(tag.kind, tag.id, tag.rmid);
+    if (ret != 0) {
+      return ret;
+    }
+    pr_info("hrperf: Tagged %s %llu with RMID %u\n",
+            tag.kind == HRP_RDT_TAG_TID   ? "thread"
+            : tag.kind == HRP_RDT_TAG_PID ? "process"
+                                          : "cgroup",
+            tag.id, tag.rmid);
+    break;
+  }
+#endif
 #endif
   default:
     return -ENOTTY;
@@ -482,21 +2992,400 @@ static long hrperf_ioctl(struct file *file, unsigned int cmd,
   return 0;
 }
 
+// Number of selected CPUs that take part in each poll round
+static u32 hrperf_count_polling_cpus(const struct cpumask *cpus) {
+  u32 n = cpumask_weight(cpus);
+#if (HRP_POLL_POLLER_CORE != 1)
+  // If poller core doesn't poll, we need to exclude it from the selected CPUs
+  // for synchronization purposes, but keep it in the mask for buffer allocation
+  if (cpumask_test_cpu(poller_cpu, cpus)) {
+    n--;
+  }
+#endif
+  return n;
+}
+
+// Set up the ring buffers of the CPUs that have none yet
+static int hrperf_prepare_rbs(const struct cpumask *cpus) {
+  int cpu;
+  for_each_cpu(cpu, cpus) {
+    if (cpumask_test_cpu(cpu, &hrp_rb_cpus)) {
+      continue;
+    }
+#if HRP_MMAP_RB
+    hrp_cpu_rb(cpu) = alloc_ring_buffer();
+    if (hrp_cpu_rb(cpu) == NULL) {
+      pr_err("hrperf: Failed to allocate ring buffer on CPU %d\n", cpu);
+      return -ENOMEM;
+    }
+#else
+    HrperfRingBuffer *rb = hrp_cpu_rb(cpu);
+    if (init_ring_buffer(rb) != 0) {
+      pr_err("hrperf: Failed to initialize ring buffer on CPU %d\n", cpu);
+      return -ENOMEM;
+    }
+#endif
+    cpumask_set_cpu(cpu, &hrp_rb_cpus);
+  }
+  return 0;
+}
+
+// Switch to a new CPU selection while paused. The newly added CPUs get their
+// ring buffers and counters set up, the removed ones keep their rings so that
+// the remaining samples are still logged or drained.
+static int hrperf_apply_cpus(const struct cpumask *cpus) {
+  cpumask_var_t added;
+  int ret;
+
+  if (!alloc_cpumask_var(&added, GFP_KERNEL)) {
+    return -ENOMEM;
+  }
+  cpumask_andnot(added, cpus, &hrp_selected_cpus);
+
+  ret = hrperf_prepare_rbs(added);
+  if (ret != 0) {
+    free_cpumask_var(added);
+    return ret;
+  }
+  on_each_cpu_mask(added, hrperf_pmc_enable_and_esel, NULL, 1);
+#if ENABLE_USER_SPACE_POLLING
+  on_each_cpu_mask(added, enable_rdpmc_in_user_space, NULL, 1);
+#endif
+
+  hrperf_block_instructed();
+  cpumask_copy(&hrp_selected_cpus, cpus);
+  hrperf_unblock_instructed();
+  N_CPUS = cpumask_weight(&hrp_selected_cpus);
+  N_POLLING_CPUS = hrperf_count_polling_cpus(&hrp_selected_cpus);
+  if (!instructed_profile && sampling_mode == HRP_SAMPLING_MODE_HRTIMER) {
+    hrperf_hrtimer_init_all();
+  }
+  free_cpumask_var(added);
+
+  pr_info("hrperf: Selected CPUs %*pbl, polling CPUs: %u\n",
+          cpumask_pr_args(&hrp_selected_cpus), N_POLLING_CPUS);
+  return 0;
+}
+
+static int hrp_param_set_cpus(const char *val, const struct kernel_param *kp) {
+  cpumask_var_t cpus;
+  int ret;
+
+  if (!alloc_cpumask_var(&cpus, GFP_KERNEL)) {
+    return -ENOMEM;
+  }
+  ret = cpulist_parse(val, cpus);
+  if (ret != 0) {
+    goto out;
+  }
+  // the CPU index also selects the ring in the mmap offset, below the markers
+  if (cpumask_empty(cpus) || !cpumask_subset(cpus, cpu_online_mask) ||
+      cpumask_last(cpus) >= HRP_PMC_CPU_SELECTION_MASK_BITS) {
+    pr_err("hrperf: Invalid CPU selection %s\n", val);
+    ret = -EINVAL;
+    goto out;
+  }
+
+  mutex_lock(&hrp_state_lock);
+  if (hrperf_running) {
+    pr_warn("hrperf: CPUs can only be changed while paused.\n");
+    ret = -EBUSY;
+  } else if (!hrp_initialized) {
+    cpumask_copy(&hrp_selected_cpus, cpus);
+    hrp_cpus_param_set = true;
+  } else if (hrperf_count_polling_cpus(cpus) == 0) {
+    pr_err("hrperf: No CPUs will participate in polling.\n");
+    ret = -EINVAL;
+  } else {
+    ret = hrperf_apply_cpus(cpus);
+  }
+  mutex_unlock(&hrp_state_lock);
+
+out:
+  free_cpumask_var(cpus);
+  return ret;
+}
+
+static int hrp_param_get_cpus(char *buffer, const struct kernel_param *kp) {
+  return scnprintf(buffer, PAGE_SIZE, "%*pbl\n",
+                   cpumask_pr_args(&hrp_selected_cpus));
+}
+
+static const struct kernel_param_ops hrp_cpus_ops = {
+    .set = hrp_param_set_cpus,
+    .get = hrp_param_get_cpus,
+};
+
+// intervals and ratios, only changed while paused and non-zero unless the
+// parameter takes 0 to disable something (hrp_uint0_ops)
+static int hrp_param_store_uint(const char *val, const struct kernel_param *kp,
+                                bool allow_zero) {
+  uint v;
+  int ret = kstrtouint(val, 0, &v);
+  if (ret != 0) {
+    return ret;
+  }
+  if (v == 0 && !allow_zero) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&hrp_state_lock);
+  if (hrperf_running) {
+    pr_warn("hrperf: %s can only be changed while paused.\n", kp->name);
+    ret = -EBUSY;
+  } else {
+    *(uint *)kp->arg = v;
+  }
+  mutex_unlock(&hrp_state_lock);
+  return ret;
+}
+
+static int hrp_param_set_uint(const char *val, const struct kernel_param *kp) {
+  return hrp_param_store_uint(val, kp, false);
+}
+
+static const struct kernel_param_ops hrp_uint_ops = {
+    .set = hrp_param_set_uint,
+    .get = param_get_uint,
+};
+
+#if HRP_ADAPTIVE_INTERVAL || HRP_BURST_SAMPLING || HRP_USE_RDT
+static int hrp_param_set_uint0(const char *val, const struct kernel_param *kp) {
+  return hrp_param_store_uint(val, kp, true);
+}
+
+static const struct kernel_param_ops hrp_uint0_ops = {
+    .set = hrp_param_set_uint0,
+    .get = param_get_uint,
+};
+#endif
+
+// poller and logger cores, the sleeping threads are moved to the new core
+static int hrp_param_set_thread_cpu(const char *val,
+                                    const struct kernel_param *kp) {
+  uint cpu;
+  int ret = kstrtouint(val, 0, &cpu);
+  if (ret != 0) {
+    return ret;
+  }
+  if (cpu >= nr_cpu_ids || !cpu_online(cpu)) {
+    pr_err("hrperf: CPU %u is not online.\n", cpu);
+    return -EINVAL;
+  }
+
+  mutex_lock(&hrp_state_lock);
+  if (hrperf_running) {
+    pr_warn("hrperf: %s can only be changed while paused.\n", kp->name);
+    ret = -EBUSY;
+    goto out;
+  }
+  if (kp->arg == &poller_cpu) {
+    uint old = poller_cpu;
+    hrperf_block_instructed();
+    poller_cpu = cpu;
+    if (hrp_initialized &&
+        hrperf_count_polling_cpus(&hrp_selected_cpus) == 0) {
+      pr_err("hrperf: No CPUs will participate in polling.\n");
+      poller_cpu = old;
+      hrperf_unblock_instructed();
+      ret = -EINVAL;
+      goto out;
+    }
+    N_POLLING_CPUS = hrperf_count_polling_cpus(&hrp_selected_cpus);
+    hrperf_unblock_instructed();
+    if (poller_thread) {
+      ret = set_cpus_allowed_ptr(poller_thread, cpumask_of(cpu));
+    }
+  } else {
+    logger_cpu = cpu;
+#if HRP_LOG_PER_NODE
+    pr_info("hrperf: logger_cpu is unused, the loggers run on their nodes.\n");
+#else
+    if (hrp_loggers && hrp_loggers[0].thread) {
+      ret = set_cpus_allowed_ptr(hrp_loggers[0].thread, cpumask_of(cpu));
+    }
+#endif
+  }
+out:
+  mutex_unlock(&hrp_state_lock);
+  return ret;
+}
+
+static const struct kernel_param_ops hrp_thread_cpu_ops = {
+    .set = hrp_param_set_thread_cpu,
+    .get = param_get_uint,
+};
+
+// writing any true value dumps the flight recorder, like HRP_PMC_IOC_DUMP
+static int hrp_param_set_dump(const char *val, const struct kernel_param *kp) {
+  bool dump;
+  int ret = kstrtobool(val, &dump);
+  if (ret != 0 || !dump) {
+    return ret;
+  }
+
+  mutex_lock(&hrp_state_lock);
+  ret = hrp_initialized ? hrperf_flight_dump() : -EINVAL;
+  mutex_unlock(&hrp_state_lock);
+  return ret;
+}
+
+static const struct kernel_param_ops hrp_dump_ops = {
+    .set = hrp_param_set_dump,
+};
+
+module_param_cb(cpus, &hrp_cpus_ops, NULL, 0644);
+MODULE_PARM_DESC(cpus, "CPUs to monitor as a cpulist, e.g. 0-15,32 (default: "
+                       "the selection mask in config.h)");
+module_param_cb(poll_interval_us_low, &hrp_uint_ops, &poll_interval_us_low,
+                0644);
+MODULE_PARM_DESC(poll_interval_us_low,
+                 "Lower bound of the poller sleep between two polls, in us");
+module_param_cb(poll_interval_us_high, &hrp_uint_ops, &poll_interval_us_high,
+                0644);
+MODULE_PARM_DESC(poll_interval_us_high,
+                 "Upper bound of the poller sleep between two polls, in us");
+module_param_cb(hrtimer_interval_us, &hrp_uint_ops, &hrtimer_interval_us,
+                0644);
+MODULE_PARM_DESC(hrtimer_interval_us,
+                 "Period of the per-CPU hrtimers in the hrtimer sampling "
+                 "mode, in us");
+module_param_cb(polling_logging_ratio, &hrp_uint_ops, &polling_logging_ratio,
+                0644);
+MODULE_PARM_DESC(polling_logging_ratio,
+                 "Poll intervals between two runs of the logger thread");
+module_param_cb(poller_cpu, &hrp_thread_cpu_ops, &poller_cpu, 0644);
+MODULE_PARM_DESC(poller_cpu, "CPU of the poller thread");
+module_param_cb(logger_cpu, &hrp_thread_cpu_ops, &logger_cpu, 0644);
+MODULE_PARM_DESC(logger_cpu, "CPU of the logger thread");
+module_param_cb(dump, &hrp_dump_ops, NULL, 0200);
+MODULE_PARM_DESC(dump, "Write 1 to dump the flight recorder to the log");
+#if HRP_ADAPTIVE_INTERVAL
+module_param_cb(adaptive_min_us, &hrp_uint_ops, &adaptive_min_us, 0644);
+MODULE_PARM_DESC(adaptive_min_us, "Shortest adaptive poll interval, in us");
+module_param_cb(adaptive_max_us, &hrp_uint_ops, &adaptive_max_us, 0644);
+MODULE_PARM_DESC(adaptive_max_us, "Longest adaptive poll interval, in us");
+module_param_cb(adaptive_threshold, &hrp_uint_ops, &adaptive_threshold, 0644);
+MODULE_PARM_DESC(adaptive_threshold,
+                 "Change of the PMC0 rate or IPC of a CPU, in permille, above "
+                 "which the poll interval is halved");
+module_param_cb(adaptive_budget, &hrp_uint0_ops, &adaptive_budget, 0644);
+MODULE_PARM_DESC(adaptive_budget,
+                 "Samples per second over all CPUs in the long run, 0 for no "
+                 "budget");
+#endif
+#if HRP_BURST_SAMPLING
+module_param_cb(burst_interval_us, &hrp_uint_ops, &burst_interval_us, 0644);
+MODULE_PARM_DESC(burst_interval_us, "Poll interval during a burst, in us");
+module_param_cb(burst_window_us, &hrp_uint_ops, &burst_window_us, 0644);
+MODULE_PARM_DESC(burst_window_us, "Length of a burst, in us");
+module_param_cb(burst_core_mbps, &hrp_uint0_ops, &burst_core_mbps, 0644);
+MODULE_PARM_DESC(burst_core_mbps,
+                 "Bandwidth of a CPU (PMC0 + PMC1 lines) in MB/s that starts a "
+                 "burst, 0 to ignore");
+module_param_cb(burst_node_mbps, &hrp_uint0_ops, &burst_node_mbps, 0644);
+MODULE_PARM_DESC(burst_node_mbps,
+                 "Bandwidth of a NUMA node (IMC, or the sum of its CPUs) in MB/s "
+                 "that starts a burst, 0 to ignore");
+#endif
+#if HRP_USE_RDT
+module_param_cb(rdt_interval_us, &hrp_uint0_ops, &rdt_interval_us, 0644);
+MODULE_PARM_DESC(rdt_interval_us,
+                 "Minimum time between two RDT reads of a CPU, in us, 0 to "
+                 "read at every sample");
+#endif
+
 static __always_inline void cleanup(void) {
-  if (logger_thread) {
-    kthread_stop(logger_thread);
+  debugfs_remove_recursive(hrp_debugfs_dir);
+
+#if HRP_SCHED_SWITCH_HOOK
+  if (hrp_sched_switch_tp) {
+    tracepoint_probe_unregister(hrp_sched_switch_tp, hrperf_sched_switch, NULL);
+    tracepoint_synchronize_unregister();
+    hrp_sched_switch_tp = NULL;
+  }
+#endif
+#if HRP_TASK_COUNTERS
+  if (atomic64_read(&hrp_task_table_full) != 0) {
+    pr_info("hrperf: %lld context switches found the task table full\n",
+            atomic64_read(&hrp_task_table_full));
+  }
+  vfree(hrp_task_table);
+  hrp_task_table = NULL;
+#endif
+
+#if HRP_RDT_BATCHED
+  if (hrp_rdt_nodes) {
+    for (int node = 0; node < nr_node_ids; node++) {
+      if (hrp_rdt_nodes[node].thread) {
+        kthread_stop(hrp_rdt_nodes[node].thread);
+      }
+    }
+  }
+#endif
+
+  for (int i = 0; i < hrp_n_loggers; i++) {
+    if (hrp_loggers[i].thread) {
+      kthread_stop(hrp_loggers[i].thread);
+    }
   }
 
   if (poller_thread) {
     kthread_stop(poller_thread);
   }
 
+  if (!instructed_profile && sampling_mode == HRP_SAMPLING_MODE_HRTIMER &&
+      hrp_sampler_ready) {
+    hrperf_running = false;
+    hrperf_hrtimer_cancel_all();
+  }
+
+  if (!instructed_profile && sampling_mode == HRP_SAMPLING_MODE_OVERFLOW &&
+      hrp_sampler_ready) {
+    if (hrperf_running) {
+      hrperf_running = false;
+      on_each_cpu_mask(&hrp_selected_cpus, hrperf_overflow_disarm, NULL, 1);
+    }
+    unregister_nmi_handler(NMI_LOCAL, "hrperf_pmi");
+    hrperf_overflow_release();
+  }
+
   if (instructed_profile_wq) {
     flush_workqueue(instructed_profile_wq);
     destroy_workqueue(instructed_profile_wq);
   }
 
-  hrperf_close_log_file(log_file);
+  for (int i = 0; i < hrp_n_loggers; i++) {
+    hrperf_close_log_file(&hrp_loggers[i].log);
+  }
+  kfree(hrp_loggers);
+  hrp_loggers = NULL;
+  hrp_n_loggers = 0;
+
+#if HRP_RDT_BATCHED
+  // the loggers drained them until here
+  if (hrp_rdt_nodes) {
+    for (int node = 0; node < nr_node_ids; node++) {
+#if HRP_MMAP_RB
+      free_ring_buffer(hrp_rdt_nodes[node].rb);
+#else
+      vfree(hrp_rdt_nodes[node].rb);
+#endif
+    }
+    vfree(hrp_rdt_nodes);
+    hrp_rdt_nodes = NULL;
+  }
+#endif
+
+#if HRP_MMAP_RB
+  int cpu;
+  for_each_cpu(cpu, &hrp_rb_cpus) {
+    free_ring_buffer(hrp_cpu_rb(cpu));
+    hrp_cpu_rb(cpu) = NULL;
+  }
+  free_ring_buffer(marker_rb);
+  marker_rb = NULL;
+#endif
 
 #if HRP_LOG_IMC
   destroy_g_uncore_pmus();
@@ -514,17 +3403,118 @@ static __always_inline void cleanup(void) {
 }
 
 static int __init hrp_pmc_init(void) {
+  int ret = 0;
+
   printk(KERN_INFO "hrperf: Initializing LKM\n");
 
+  if (sampling_mode != HRP_SAMPLING_MODE_IPI &&
+      sampling_mode != HRP_SAMPLING_MODE_HRTIMER &&
+      sampling_mode != HRP_SAMPLING_MODE_OVERFLOW) {
+    pr_err("hrperf: Invalid sampling mode %d.\n", sampling_mode);
+    return -EINVAL;
+  }
+
+  if (flight_recorder && instructed_profile) {
+    pr_err("hrperf: The flight recorder needs a polling profile.\n");
+    return -EINVAL;
+  }
+
+#if HRP_TASK_COUNTERS
+  if (!instructed_profile && sampling_mode == HRP_SAMPLING_MODE_OVERFLOW) {
+    pr_err("hrperf: Task counters are not supported in the overflow sampling "
+           "mode.\n");
+    return -EINVAL;
+  }
+#endif
+
+  if (histograms && (instructed_profile || flight_recorder)) {
+    pr_err("hrperf: The histogram mode needs a polling profile without the "
+           "flight recorder.\n");
+    return -EINVAL;
+  }
+
+#if HRP_RDT_BATCHED
+  if (instructed_profile || histograms) {
+    pr_err("hrperf: Batched RDT reads need a logged polling profile.\n");
+    return -EINVAL;
+  }
+#endif
+
+  if (sampling_mode == HRP_SAMPLING_MODE_OVERFLOW &&
+      (overflow_period == 0 ||
+       (overflow_counter != 0 && overflow_counter != 1))) {
+    pr_err("hrperf: Invalid overflow period %u or trigger counter %d.\n",
+           overflow_period, overflow_counter);
+    return -EINVAL;
+  }
+
+#if HRP_USE_RDT && !HRP_RDT_BATCHED
+  // a sample would read the RDT counters from the PMI, an MSR pair the
+  // interrupted code may be in the middle of
+  if (!instructed_profile && sampling_mode == HRP_SAMPLING_MODE_OVERFLOW) {
+    pr_err("hrperf: RDT in the overflow sampling mode needs "
+           "HRP_RDT_BATCHED.\n");
+    return -EINVAL;
+  }
+#endif
+
+#if HRP_LOG_SCHED_SWITCH
+  // the PMI could interrupt the sched_switch probe in the middle of a sample,
+  // as a second producer on the ring of the CPU
+  if (!instructed_profile && sampling_mode == HRP_SAMPLING_MODE_OVERFLOW) {
+    pr_err("hrperf: HRP_LOG_SCHED_SWITCH is not supported in the overflow "
+           "sampling mode.\n");
+    return -EINVAL;
+  }
+#endif
+
+#if HRP_USE_MULTIPLEXING
+  if (sampling_mode == HRP_SAMPLING_MODE_OVERFLOW) {
+    pr_err("hrperf: Multiplexing is not supported in the overflow sampling "
+           "mode.\n");
+    return -EINVAL;
+  }
+  if (mux_rotate_samples == 0) {
+    pr_err("hrperf: Invalid mux_rotate_samples %u.\n", mux_rotate_samples);
+    return -EINVAL;
+  }
+  hrp_groups.rotate_samples = mux_rotate_samples;
+#endif
+
+#if HRP_ADAPTIVE_INTERVAL
+  if (instructed_profile || sampling_mode != HRP_SAMPLING_MODE_IPI) {
+    pr_info("hrperf: The adaptive interval only applies to the IPI sampling "
+            "mode, samples still carry their interval.\n");
+  }
+#endif
+
+#if HRP_BURST_SAMPLING
+  if (instructed_profile || sampling_mode != HRP_SAMPLING_MODE_IPI) {
+    pr_info("hrperf: Burst sampling only applies to the IPI sampling mode.\n");
+  }
+#endif
+
+#if HRP_USE_TOPDOWN
+  if (hrperf_check_topdown() != 0) {
+    return -ENODEV;
+  }
+#endif
+  if (!instructed_profile && sampling_mode == HRP_SAMPLING_MODE_OVERFLOW &&
+      hrperf_check_fw_write() != 0) {
+    return -ENODEV;
+  }
+
   if (mbm_init() != 0) {
     pr_err("hrperf: Failed to initialize Intel MBM.\n");
     return -EIO;
   }
 
 #if HRP_USE_TSC
+  // also needed by the hrtimer engine to map its grid to TSC timestamps
   u64 tsc_cycle = hrp_calibrate_tsc();
   if (tsc_cycle == 0) {
     pr_err("hrperf: TSC calibration failed.\n");
+    mbm_deinit();
     return -EIO;
   }
   pr_info("hrperf: TSC cycles per us: %llu\n", tsc_cycle);
@@ -534,6 +3524,7 @@ static int __init hrp_pmc_init(void) {
   dev_t dev_num = MKDEV(HRP_PMC_MAJOR_NUMBER, 0);
   if (register_chrdev_region(dev_num, 1, HRP_PMC_DEVICE_NAME) < 0) {
     printk(KERN_ALERT "hrperf: failed to register a major number\n");
+    mbm_deinit();
     return -1;
   }
   major_number = MAJOR(dev_num);
@@ -544,6 +3535,7 @@ static int __init hrp_pmc_init(void) {
   if (cdev_add(&char_dev, dev_num, 1) < 0) {
     unregister_chrdev_region(dev_num, 1);
     printk(KERN_ALERT "hrperf: failed to add cdev\n");
+    mbm_deinit();
     return -1;
   }
 
@@ -556,6 +3548,7 @@ static int __init hrp_pmc_init(void) {
     unregister_chrdev_region(dev_num, 1);
     cdev_del(&char_dev);
     printk(KERN_ALERT "hrperf: failed to register device class\n");
+    mbm_deinit();
     return PTR_ERR(dev_class);
   }
   printk(KERN_INFO "hrperf: device class registered\n");
@@ -566,62 +3559,79 @@ static int __init hrp_pmc_init(void) {
     cdev_del(&char_dev);
     unregister_chrdev_region(dev_num, 1);
     printk(KERN_ALERT "hrperf: failed to create the device\n");
+    mbm_deinit();
     return PTR_ERR(device_p);
   }
   printk(KERN_INFO "hrperf: device setup done\n");
 
-  // step 2.1: initialize selected CPUs using a 256-bit mask
-  // init cpumask to zero
-  cpumask_clear(&hrp_selected_cpus);
+  // step 2.1: initialize selected CPUs from the cpus parameter, or else from
+  // the 256-bit mask
+  if (!hrp_cpus_param_set) {
+    // init cpumask to zero
+    cpumask_clear(&hrp_selected_cpus);
 
-  // copy the 256-bit CPU selection mask into hrp_selected_cpus
-  bitmap_copy(cpumask_bits(&hrp_selected_cpus), hrp_pmc_cpu_selection_mask_bits,
-              HRP_PMC_CPU_SELECTION_MASK_BITS);
+    // copy the 256-bit CPU selection mask into hrp_selected_cpus
+    bitmap_copy(cpumask_bits(&hrp_selected_cpus),
+                hrp_pmc_cpu_selection_mask_bits,
+                HRP_PMC_CPU_SELECTION_MASK_BITS);
+  }
 
   N_CPUS = cpumask_weight(&hrp_selected_cpus);
 
   // Calculate the actual number of CPUs that will participate in polling
-  N_POLLING_CPUS = N_CPUS;
-#if (HRP_POLL_POLLER_CORE != 1)
-  // If poller core doesn't poll, we need to exclude it from the selected CPUs
-  // for synchronization purposes, but keep it in the mask for buffer allocation
-  if (cpumask_test_cpu(HRP_PMC_POLLER_CPU, &hrp_selected_cpus)) {
-    N_POLLING_CPUS = N_CPUS - 1;
-  }
-#endif
+  N_POLLING_CPUS = hrperf_count_polling_cpus(&hrp_selected_cpus);
 
   if (N_CPUS <= 0 || N_CPUS > NR_CPUS) {
     pr_err("hrperf: No/Too many CPUs selected for monitoring. Please check the "
            "CPU selection mask.\n");
-    return -EINVAL;
+    ret = -EINVAL;
+    goto fail;
   }
 
   if (N_POLLING_CPUS <= 0) {
     pr_err("hrperf: No CPUs will participate in polling. Check CPU selection "
            "and poller configuration.\n");
-    return -EINVAL;
+    ret = -EINVAL;
+    goto fail;
   }
 
   pr_info("hrperf: Number of selected CPUs: %u, polling CPUs: %u\n", N_CPUS,
           N_POLLING_CPUS);
 
-  // Initialize per-CPU ring buffers
-  int cpu;
-  for_each_cpu(cpu, &hrp_selected_cpus) {
-    HrperfRingBuffer *rb = per_cpu_ptr(&per_cpu_buffer, cpu);
-    if (init_ring_buffer(rb) != 0) {
-      pr_err("hrperf: Failed to initialize ring buffer on CPU %d\n", cpu);
-      return -ENOMEM;
-    }
+  // Initialize per-CPU ring buffers, CPUs added later get theirs on demand
+  cpumask_clear(&hrp_rb_cpus);
+  if (hrperf_prepare_rbs(&hrp_selected_cpus) != 0) {
+    ret = -ENOMEM;
+    goto fail;
+  }
+
+#if HRP_MMAP_RB
+  marker_rb = alloc_ring_buffer();
+  if (marker_rb == NULL) {
+    ret = -ENOMEM;
+    goto fail;
   }
+#else
+  if (init_ring_buffer(marker_rb) != 0) {
+    pr_err("hrperf: Failed to initialize the marker ring buffer\n");
+    ret = -ENOMEM;
+    goto fail;
+  }
+#endif
   pr_info("hrperf: Initialized ring buffers for selected CPUs\n");
 
+  // not fatal, the statistics are also available through the ioctl
+  hrp_debugfs_dir = debugfs_create_dir("hrperf", NULL);
+  debugfs_create_file("stats", 0444, hrp_debugfs_dir, NULL,
+                      &hrperf_stats_fops);
+
   // step 2.2: enable the counters and make event selections
-  smp_call_function_many(&hrp_selected_cpus, hrperf_pmc_enable_and_esel, NULL,
-                         1);
-#if HRP_POLL_POLLER_CORE
-  hrperf_pmc_enable_and_esel(NULL); // also enable on the current CPU
+#if HRP_USE_ALL_COUNTERS
+  hrperf_discover_counters();
 #endif
+  // (on_each_cpu_mask also covers the current CPU if it is selected)
+  on_each_cpu_mask(&hrp_selected_cpus, hrperf_pmc_enable_and_esel, NULL, 1);
+  hrperf_emit_event_markers();
 
 #if HRP_LOG_IMC
   // initialize IMC uncore PMUs
@@ -630,61 +3640,138 @@ static int __init hrp_pmc_init(void) {
 
   // Special step: enable RDPMC in user space if configured
 #if ENABLE_USER_SPACE_POLLING
-  smp_call_function_many(&hrp_selected_cpus, enable_rdpmc_in_user_space, NULL,
-                         1);
-#if HRP_POLL_POLLER_CORE
-  hrperf_pmc_enable_and_esel(NULL); // also enable on the current CPU
-#endif
+  on_each_cpu_mask(&hrp_selected_cpus, enable_rdpmc_in_user_space, NULL, 1);
 #endif
 
   if (instructed_profile) {
     poller_thread = NULL;
     pr_info(
         "hrperf: Instructed profiling enabled, poller thread not created\n");
+  } else if (sampling_mode == HRP_SAMPLING_MODE_OVERFLOW) {
+    poller_thread = NULL;
+    overflow_preload = (-(u64)overflow_period) & PMC_COUNTER_MASK;
+    ret = hrperf_overflow_reserve();
+    if (ret != 0) {
+      goto fail;
+    }
+    if (register_nmi_handler(NMI_LOCAL, hrperf_pmi_handler, NMI_FLAG_FIRST,
+                             "hrperf_pmi") != 0) {
+      pr_err("hrperf: Failed to register the PMI handler.\n");
+      hrperf_overflow_release();
+      ret = -EIO;
+      goto fail;
+    }
+    hrp_sampler_ready = true;
+    pr_info("hrperf: Overflow sampling enabled, a sample every %u events of "
+            "PMC%d, poller thread not created\n",
+            overflow_period, overflow_counter);
+  } else if (sampling_mode == HRP_SAMPLING_MODE_HRTIMER) {
+    poller_thread = NULL;
+    hrperf_hrtimer_init_all();
+    hrp_sampler_ready = true;
+    pr_info("hrperf: Per-CPU hrtimer sampling enabled, interval %u us, "
+            "poller thread not created\n",
+            hrtimer_interval_us);
   } else {
     // Initialize poller thread
     poller_thread = kthread_create(hrperf_poller_thread, NULL, "poller_thread");
     if (IS_ERR(poller_thread)) {
       printk(KERN_ERR "Failed to create the poller thread\n");
-      return PTR_ERR(poller_thread);
+      ret = PTR_ERR(poller_thread);
+      poller_thread = NULL;
+      goto fail;
     }
 
     // Bind to the core before start running!
-    kthread_bind(poller_thread, HRP_PMC_POLLER_CPU);
+    kthread_bind(poller_thread, poller_cpu);
     wake_up_process(poller_thread);
   }
 
-  // step 3: init log file
-  log_file = hrperf_init_log_file();
-  if (log_file == NULL) {
-    printk(KERN_ERR "Failed to initialize log file\n");
-    // Handle the error appropriately
+  // step 3: init log files
+  hrperf_fill_log_header(&log_header);
+  if (!histograms) {
+    ret = hrperf_init_loggers();
+    if (ret != 0) {
+      printk(KERN_ERR "Failed to initialize the loggers\n");
+      goto fail;
+    }
   }
 
-  if (instructed_profile) {
-    logger_thread = NULL;
+  if (histograms) {
+    pr_info("hrperf: Histogram mode enabled, nothing is logged\n");
+  } else if (instructed_profile) {
     pr_info(
         "hrperf: Instructed profiling enabled, logger thread not created\n");
+  } else if (!kernel_logger) {
+    pr_info("hrperf: Kernel logger disabled, logger thread not created\n");
+  } else if (flight_recorder) {
+    pr_info("hrperf: Flight recorder enabled, the rings are logged on dumps "
+            "only\n");
   } else {
-    // Initialize logger thread
-    logger_thread = kthread_create(hrperf_logger_thread, NULL, "logger_thread");
-    if (IS_ERR(logger_thread)) {
-      printk(KERN_ERR "Failed to create the logger thread\n");
-      return PTR_ERR(logger_thread);
+    ret = hrperf_start_loggers();
+    if (ret != 0) {
+      goto fail;
     }
-    kthread_bind(logger_thread, HRP_PMC_LOGGER_CPU);
-    wake_up_process(logger_thread);
   }
 
+#if HRP_RDT_BATCHED
+  ret = hrperf_start_rdt_threads();
+  if (ret != 0) {
+    goto fail;
+  }
+  pr_info("hrperf: Batched RDT reads every %u us by a thread per node\n",
+          rdt_interval_us);
+#endif
+
   if (instructed_profile) {
-    instructed_profile_wq = alloc_workqueue("hrp_inst_log_wq", WQ_HIGHPRI, 0);
+    // one op at a time per CPU, ops run on the poller CPU
+    instructed_profile_wq = alloc_workqueue("hrp_inst_log_wq", WQ_HIGHPRI, 1);
     if (instructed_profile_wq == NULL) {
       pr_err("hrperf: Failed to create instructed log workqueue.\n");
-      return -ENOMEM;
+      ret = -ENOMEM;
+      goto fail;
     }
   }
 
+#if HRP_LOG_SCHED_SWITCH
+  if (instructed_profile) {
+    pr_info("hrperf: Context switches are not sampled in the instructed "
+            "profile mode\n");
+  }
+#endif
+#if HRP_TASK_COUNTERS
+  hrp_task_table = vzalloc(HRP_TASK_TABLE_SIZE * sizeof(*hrp_task_table));
+  if (hrp_task_table == NULL) {
+    pr_err("hrperf: Failed to allocate the task counter table.\n");
+    ret = -ENOMEM;
+    goto fail;
+  }
+#endif
+#if HRP_SCHED_SWITCH_HOOK
+  for_each_kernel_tracepoint(hrperf_find_sched_switch, NULL);
+  if (hrp_sched_switch_tp == NULL) {
+    pr_err("hrperf: sched_switch tracepoint not found.\n");
+    ret = -ENOENT;
+    goto fail;
+  }
+  ret = tracepoint_probe_register(hrp_sched_switch_tp, hrperf_sched_switch,
+                                  NULL);
+  if (ret != 0) {
+    pr_err("hrperf: Failed to hook sched_switch: %d.\n", ret);
+    hrp_sched_switch_tp = NULL;
+    goto fail;
+  }
+#endif
+
+  mutex_lock(&hrp_state_lock);
+  hrp_initialized = true;
+  mutex_unlock(&hrp_state_lock);
   return 0;
+
+fail:
+  // stops whatever already runs and removes the device
+  cleanup();
+  return ret;
 }
 
 static void __exit hrp_pmc_exit(void) { cleanup(); }
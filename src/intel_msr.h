@@ -28,6 +28,18 @@
 #define MSR_IA32_PMC2 0x000000c3 // available since Arch PMC V3
 #define MSR_IA32_PMC3 0x000000c4
 
+/* full-width write aliases of the general-purpose counters */
+#define MSR_IA32_A_PMC0 0x000004c1
+#define MSR_IA32_A_PMC1 0x000004c2
+
 /* offcore response events selector MSRs */
 #define MSR_OFFCORE_RSP0 0x000001A6
-#define MSR_OFFCORE_RSP1 0x000001A7
\ No newline at end of file
+#define MSR_OFFCORE_RSP1 0x000001A7
+
+/* actual and maximum performance clock counters, count while in C0 */
+#define MSR_IA32_MPERF 0x000000e7
+#define MSR_IA32_APERF 0x000000e8
+
+/* topdown metrics, with fixed counter 3 (slots) */
+#define MSR_IA32_PERF_CAPABILITIES 0x00000345
+#define MSR_PERF_METRICS 0x00000329
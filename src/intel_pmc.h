@@ -19,6 +19,10 @@
 #define PMC_ESEL_ENABLE         (1ULL << 22) /* Enable counters */
 #define PMC_ESEL_INV            (1ULL << 23) /* Invert counter mask */
 
+/* general-purpose counters are 48 bits wide on all supported chips */
+#define PMC_COUNTER_WIDTH       48
+#define PMC_COUNTER_MASK        ((1ULL << PMC_COUNTER_WIDTH) - 1)
+
 /*
         architectural performance counters (works on all Intel Xeon CPUs)
 */
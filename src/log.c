@@ -3,27 +3,235 @@
 #include <linux/kernel.h>
 #include <linux/printk.h>
 #include <linux/smp.h>
+#include <linux/stddef.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
 
 #include "log.h"
 #include "config.h"
 
-struct file* hrperf_init_log_file(void) {
+static void add_field(hrp_log_header_t *header, const char *name,
+                      size_t offset, size_t size) {
+    hrp_log_field_t *field;
+
+    if (WARN_ON(header->n_fields >= HRP_LOG_MAX_FIELDS)) {
+        return;
+    }
+    field = &header->fields[header->n_fields++];
+    strscpy(field->name, name, sizeof(field->name));
+    field->offset = offset;
+    field->size = size;
+}
+
+#if HRP_LOG_COMPACT
+// words of an entry in the compact format: seq, then the tick
+#define HRP_LOG_TICK_WORDS (sizeof(HrperfTick) / sizeof(u64))
+#define HRP_LOG_ENTRY_WORDS (HRP_LOG_SEQ + HRP_LOG_TICK_WORDS)
+// an entry where every word takes the longest varint
+#define HRP_LOG_ENTRY_MAX_BYTES (HRP_LOG_ENTRY_WORDS * 10)
+#define HRP_LOG_BLOCK_BYTES (64 * 1024)
+
+_Static_assert(sizeof(HrperfTick) % sizeof(u64) == 0,
+               "the compact format encodes the tick as u64 words");
+#endif
+
+#define ADD_TICK_FIELD(header, name, member)                                   \
+    add_field(header, name, offsetof(HrperfLogEntry, tick.member),             \
+              sizeof(((HrperfTick *)0)->member))
+
+void hrperf_log_header_init(hrp_log_header_t *header) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, HRP_LOG_HEADER_MAGIC, sizeof(header->magic));
+    header->version = HRP_LOG_HEADER_VERSION;
+    header->header_size = sizeof(*header);
+    header->entry_size = sizeof(HrperfLogEntry);
+    header->max_fields = HRP_LOG_MAX_FIELDS;
+    header->cpu_mask_words = ARRAY_SIZE(header->cpu_mask);
+    header->max_groups = HRP_MUX_MAX_GROUPS;
+    header->n_gp_events = HRP_NUM_GP_EVENTS;
+    header->format = HRP_LOG_COMPACT ? HRP_LOG_FORMAT_COMPACT : HRP_LOG_FORMAT_RAW;
+
+    // in the order of HrperfTick, named as the parser columns
+    add_field(header, "cpu_id", offsetof(HrperfLogEntry, cpu_id),
+              sizeof(int));
+#if HRP_LOG_SEQ
+    add_field(header, "seq", offsetof(HrperfLogEntry, seq),
+              sizeof(unsigned int));
+#endif
+    ADD_TICK_FIELD(header, "timestamp", kts);
+    ADD_TICK_FIELD(header, "stall_mem", stall_mem);
+    ADD_TICK_FIELD(header, "inst_retire", inst_retire);
+    ADD_TICK_FIELD(header, "cpu_unhalt", cpu_unhalt);
+    ADD_TICK_FIELD(header, "llc_misses", llc_misses);
+    ADD_TICK_FIELD(header, "sw_prefetch", sw_prefetch);
+#if HRP_LOG_IMC
+    ADD_TICK_FIELD(header, "imc_read", imc_reads);
+    ADD_TICK_FIELD(header, "imc_write", imc_writes);
+#endif
+#if HRP_USE_RDT
+#if !HRP_RDT_BATCHED
+    ADD_TICK_FIELD(header, "total_bw", total_bw);
+#if HRP_RDT_INCLUDE_LOCAL_BW
+    ADD_TICK_FIELD(header, "local_bw", local_bw);
+#endif
+    ADD_TICK_FIELD(header, "occupancy", occupancy);
+#endif
+#if HRP_RDT_TAGS
+    ADD_TICK_FIELD(header, "rmid", rmid);
+#endif
+#endif
+#if HRP_USE_MULTIPLEXING
+    ADD_TICK_FIELD(header, "group_id", group_id);
+    ADD_TICK_FIELD(header, "time_enabled", time_enabled);
+    ADD_TICK_FIELD(header, "time_running", time_running);
+#endif
+#if HRP_USE_ALL_COUNTERS
+    ADD_TICK_FIELD(header, "ref_cycles", ref_cycles);
+    ADD_TICK_FIELD(header, "slots", slots);
+    for (int i = 0; i < HRP_NUM_TICK_PMCS - 3; i++) {
+        char name[HRP_LOG_FIELD_NAME_LEN];
+        snprintf(name, sizeof(name), "pmc%d", i + 3);
+        add_field(header, name,
+                  offsetof(HrperfLogEntry, tick.pmc) + i * sizeof(u64),
+                  sizeof(u64));
+    }
+#endif
+#if HRP_USE_TOPDOWN
+    ADD_TICK_FIELD(header, "td_slots", td_slots);
+    ADD_TICK_FIELD(header, "perf_metrics", perf_metrics);
+#endif
+#if HRP_LOG_FREQ
+    ADD_TICK_FIELD(header, "aperf", aperf);
+    ADD_TICK_FIELD(header, "mperf", mperf);
+#endif
+#if HRP_ADAPTIVE_INTERVAL
+    ADD_TICK_FIELD(header, "interval", interval);
+#endif
+#if HRP_LOG_SCHED_SWITCH
+    ADD_TICK_FIELD(header, "prev_tid", prev_tid);
+    ADD_TICK_FIELD(header, "next_tid", next_tid);
+#endif
+#if HRP_INSTRUCTED_LOCKLESS
+    ADD_TICK_FIELD(header, "poll_tid", poll_tid);
+#endif
+#if HRP_LOG_POLL_ID
+    ADD_TICK_FIELD(header, "poll_id", poll_id);
+#endif
+}
+
+// Open the log at `path`, with the scratch of the compact format on `node`
+int hrperf_init_log_file(HrperfLogFile *log, const char *path,
+                         const hrp_log_header_t *header, int node) {
     struct file *file;
+    ssize_t write_ret;
+
+    log->file = NULL;
+#if HRP_LOG_COMPACT
+    log->block_buf = vmalloc_node(HRP_LOG_BLOCK_BYTES, node);
+    if (log->block_buf == NULL) {
+        pr_err("hrperf: Failed to allocate the block buffer of %s\n", path);
+        return -ENOMEM;
+    }
+#endif
 
-    file = filp_open(HRP_PMC_LOG_PATH, O_WRONLY | O_CREAT | O_APPEND | O_LARGEFILE, 0666);
+    // a log describes one run, its header must match every entry in it
+    file = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_LARGEFILE, 0666);
     if (IS_ERR(file)) {
-        printk(KERN_ERR "Error opening the log file\n");
-        return NULL;
+        printk(KERN_ERR "Error opening the log file %s\n", path);
+        return PTR_ERR(file);
+    }
+    log->file = file;
+
+    write_ret = kernel_write(file, header, sizeof(*header), &file->f_pos);
+    if (write_ret != sizeof(*header)) {
+        printk(KERN_ERR "hrperf: Failed to write the log header: %zd\n", write_ret);
+    }
+
+    return 0;
+}
+
+#if HRP_LOG_COMPACT
+static __always_inline u8 *put_varint(u8 *p, u64 v) {
+    while (v >= 0x80) {
+        *p++ = (u8)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (u8)v;
+    return p;
+}
+
+// small differences of either sign become small varints
+static __always_inline u64 zigzag(u64 delta) {
+    return (delta << 1) ^ (u64)((s64)delta >> 63);
+}
+
+static __always_inline void entry_words(const HrperfLogEntry *entry, u64 *words) {
+#if HRP_LOG_SEQ
+    words[0] = entry->seq;
+#endif
+    memcpy(&words[HRP_LOG_SEQ],
+           (const u8 *)entry + offsetof(HrperfLogEntry, tick),
+           sizeof(HrperfTick));
+}
+
+static void write_block(HrperfRingBuffer *rb, HrperfLogFile *log, u8 *end) {
+    hrp_log_block_t *block = (hrp_log_block_t *)log->block_buf;
+    struct file *file = log->file;
+    ssize_t write_ret;
+
+    block->size = end - log->block_buf - sizeof(*block);
+    write_ret = kernel_write(file, log->block_buf, end - log->block_buf, &file->f_pos);
+    if (write_ret < 0) {
+        printk(KERN_ERR "hrperf: kernel_write error: %zd\n", write_ret);
+    } else {
+        rb->logged_bytes += write_ret;
     }
+}
+
+// Encode the entries from head to tail into blocks of HRP_LOG_BLOCK_BYTES
+static void log_compact(HrperfRingBuffer *rb, HrperfLogFile *log,
+                        unsigned int head, unsigned int tail) {
+    u8 *block_buf = log->block_buf;
+    hrp_log_block_t *block = (hrp_log_block_t *)block_buf;
+    u8 *p = NULL;
+    u64 prev[HRP_LOG_ENTRY_WORDS], cur[HRP_LOG_ENTRY_WORDS];
+
+    for (unsigned int i = head; i != tail; i = (i + 1) % HRP_PMC_BUFFER_SIZE) {
+        const HrperfLogEntry *entry = &rb->buffer[i];
+
+        if (p != NULL && (entry->cpu_id != block->cpu_id ||
+                          p + HRP_LOG_ENTRY_MAX_BYTES > block_buf + HRP_LOG_BLOCK_BYTES)) {
+            write_block(rb, log, p);
+            p = NULL;
+        }
+        if (p == NULL) {
+            block->magic = HRP_LOG_BLOCK_MAGIC;
+            block->cpu_id = entry->cpu_id;
+            block->n_entries = 0;
+            p = block_buf + sizeof(*block);
+        }
 
-    return file;
+        entry_words(entry, cur);
+        for (int w = 0; w < HRP_LOG_ENTRY_WORDS; w++) {
+            p = put_varint(p, block->n_entries ? zigzag(cur[w] - prev[w]) : cur[w]);
+        }
+        memcpy(prev, cur, sizeof(prev));
+        block->n_entries++;
+    }
+    if (p != NULL) {
+        write_block(rb, log, p);
+    }
 }
+#endif
 
-inline __attribute__((always_inline)) void log_and_clear(HrperfRingBuffer *rb, struct file *file) {
+inline __attribute__((always_inline)) void log_and_clear(HrperfRingBuffer *rb, HrperfLogFile *log) {
     unsigned int head, tail;
+#if !HRP_LOG_COMPACT
+    struct file *file = log->file;
     ssize_t write_ret;
+#endif
 
-    head = rb->head;
+    head = rb_head(rb);
     tail = smp_load_acquire(&rb->tail);
 
     if (head == tail) {
@@ -31,12 +239,17 @@ inline __attribute__((always_inline)) void log_and_clear(HrperfRingBuffer *rb, s
         return;
     }
 
+#if HRP_LOG_COMPACT
+    log_compact(rb, log, head, tail);
+#else
     if (head < tail) {
         // Data is contiguous
         size_t size = (tail - head) * sizeof(HrperfLogEntry);
         write_ret = kernel_write(file, &rb->buffer[head], size, &file->f_pos);
         if (write_ret < 0) {
             printk(KERN_ERR "hrperf: kernel_write error: %zd\n", write_ret);
+        } else {
+            rb->logged_bytes += write_ret;
         }
     } else {
         // Data wraps around
@@ -44,6 +257,8 @@ inline __attribute__((always_inline)) void log_and_clear(HrperfRingBuffer *rb, s
         write_ret = kernel_write(file, &rb->buffer[head], size1, &file->f_pos);
         if (write_ret < 0) {
             printk(KERN_ERR "hrperf: kernel_write error: %zd\n", write_ret);
+        } else {
+            rb->logged_bytes += write_ret;
         }
 
         if (tail > 0) {
@@ -51,16 +266,24 @@ inline __attribute__((always_inline)) void log_and_clear(HrperfRingBuffer *rb, s
             write_ret = kernel_write(file, &rb->buffer[0], size2, &file->f_pos);
             if (write_ret < 0) {
                 printk(KERN_ERR "hrperf: kernel_write error: %zd\n", write_ret);
+            } else {
+                rb->logged_bytes += write_ret;
             }
         }
     }
+#endif
 
     // Update head
     smp_store_release(&rb->head, tail);
 }
 
-void hrperf_close_log_file(struct file *file) {
-    if (file != NULL) {
-        filp_close(file, NULL);
+void hrperf_close_log_file(HrperfLogFile *log) {
+    if (log->file != NULL) {
+        filp_close(log->file, NULL);
+        log->file = NULL;
     }
+#if HRP_LOG_COMPACT
+    vfree(log->block_buf);
+    log->block_buf = NULL;
+#endif
 }
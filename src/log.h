@@ -4,8 +4,18 @@
 #include <linux/fs.h>
 #include "buffer.h"
 
-struct file* hrperf_init_log_file(void);
-void log_and_clear(HrperfRingBuffer *rb, struct file *file);
-void hrperf_close_log_file(struct file *file);
+// a log file and the state of the logger writing it
+typedef struct {
+    struct file *file;
+#if HRP_LOG_COMPACT
+    u8 *block_buf; // encoding scratch of HRP_LOG_BLOCK_BYTES
+#endif
+} HrperfLogFile;
+
+void hrperf_log_header_init(hrp_log_header_t *header);
+int hrperf_init_log_file(HrperfLogFile *log, const char *path,
+                         const hrp_log_header_t *header, int node);
+void log_and_clear(HrperfRingBuffer *rb, HrperfLogFile *log);
+void hrperf_close_log_file(HrperfLogFile *log);
 
 #endif // LOG_H
@@ -1,3 +1,6 @@
+#include <linux/nodemask.h>
+#include <linux/slab.h>
+
 #include <mbm/types.h>
 #include <mbm/rmid.h>
 #include "mbm/mbm.h"
@@ -83,7 +86,10 @@ void mbm_init_cap(void) {
 
   /* Extract counter width from bits 0-7 of EAX */
   u32 counter_width_offset = eax & 0xFF;
-  cap->counter_width = 24 + counter_width_offset;
+  cap->counter_width = QM_CTR_MIN_WIDTH + counter_width_offset;
+  g_mbm_mgr.counter_mask = cap->counter_width < 62
+                               ? BIT_ULL(cap->counter_width) - 1
+                               : QM_CTR_DATA_MASK;
 
   g_mbm_mgr.scaling_factor = ebx;
 
@@ -110,6 +116,15 @@ int mbm_init(void) {
   }
 
   mbm_init_cap();
+
+  g_mbm_mgr.wide = kcalloc((size_t)nr_node_ids * (g_mbm_mgr.max_rmid + 1) *
+                               MBM_N_WIDE_EVENTS,
+                           sizeof(u64), GFP_KERNEL);
+  if (g_mbm_mgr.wide == NULL) {
+    pr_err("hrperf: Failed to allocate the MBM counter table.\n");
+    return -ENOMEM;
+  }
+
   mbm_rmid_init();
   
   return 0;
@@ -117,5 +132,7 @@ int mbm_init(void) {
 
 int mbm_deinit(void) {
   mbm_rmid_deinit();
+  kfree(g_mbm_mgr.wide);
+  g_mbm_mgr.wide = NULL;
   return 0;
 }
\ No newline at end of file
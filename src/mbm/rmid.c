@@ -4,11 +4,15 @@
  */
 
 #include <asm/msr.h>
+#include <linux/bitmap.h>
+#include <linux/cgroup.h>
 #include <linux/cpumask.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/smp.h>
+#include <linux/topology.h>
 
 #include "mbm/rmid.h"
 #include "mbm/types.h"
@@ -121,6 +125,111 @@ u32 mbm_rmid_get_for_core(u32 core_id) {
   return rmid;
 }
 
+/*
+ * Tag a thread, process or cgroup with an RMID, or remove its tag if rmid is
+ * RMID0. The RMID must not be one of a core.
+ */
+int mbm_rmid_set_tag(u32 kind, u64 id, u32 rmid) {
+  u32 i;
+  int ret = 0;
+  struct rmid_tag *tag = NULL, *free = NULL;
+  struct rmid_manager *g_rmid_mgr = &g_mbm_mgr.rmid_mgr;
+
+  if (kind >= HRP_RDT_N_TAG_KINDS || rmid > g_mbm_mgr.max_rmid) {
+    pr_err("hrperf: Invalid RMID tag kind %u or RMID %u\n", kind, rmid);
+    return -EINVAL;
+  }
+
+  spin_lock(&g_rmid_mgr->lock);
+
+  for (i = 0; i < g_rmid_mgr->num_cores; i++) {
+    if (rmid != RMID0 && g_rmid_mgr->rmid_table[i].in_use &&
+        g_rmid_mgr->rmid_table[i].rmid == rmid) {
+      pr_err("hrperf: RMID %u is used by core %u\n", rmid,
+             g_rmid_mgr->rmid_table[i].core_id);
+      ret = -EBUSY;
+      goto out;
+    }
+  }
+
+  for (i = 0; i < MAX_RMID_TAGS; i++) {
+    struct rmid_tag *t = &g_rmid_mgr->tags[i];
+    if (t->rmid == RMID0) {
+      if (free == NULL) {
+        free = t;
+      }
+    } else if (t->kind == kind && t->id == id) {
+      tag = t;
+    }
+  }
+
+  if (tag != NULL) {
+    WRITE_ONCE(tag->rmid, rmid);
+    if (rmid == RMID0) {
+      g_rmid_mgr->n_tags[kind]--;
+    }
+  } else if (rmid == RMID0) {
+    ret = -ENOENT;
+  } else if (free == NULL) {
+    pr_err("hrperf: No room for more than %d RMID tags\n", MAX_RMID_TAGS);
+    ret = -ENOSPC;
+  } else {
+    WRITE_ONCE(free->kind, kind);
+    WRITE_ONCE(free->id, id);
+    /* publish the tag once it is complete */
+    smp_wmb();
+    WRITE_ONCE(free->rmid, rmid);
+    g_rmid_mgr->n_tags[kind]++;
+  }
+
+out:
+  spin_unlock(&g_rmid_mgr->lock);
+  return ret;
+}
+
+static __always_inline u32 mbm_rmid_find_tag(u32 kind, u64 id) {
+  u32 i;
+  struct rmid_manager *g_rmid_mgr = &g_mbm_mgr.rmid_mgr;
+
+  if (READ_ONCE(g_rmid_mgr->n_tags[kind]) == 0) {
+    return RMID0;
+  }
+  for (i = 0; i < MAX_RMID_TAGS; i++) {
+    struct rmid_tag *t = &g_rmid_mgr->tags[i];
+    u32 rmid = READ_ONCE(t->rmid);
+    if (rmid != RMID0 && READ_ONCE(t->kind) == kind && READ_ONCE(t->id) == id) {
+      return rmid;
+    }
+  }
+  return RMID0;
+}
+
+/*
+ * RMID a task is tagged with: its thread's, else its process's, else the one
+ * of its cgroup or of the closest tagged ancestor. RMID0 if none.
+ */
+u32 mbm_rmid_for_task(struct task_struct *task) {
+  u32 rmid = mbm_rmid_find_tag(HRP_RDT_TAG_TID, task->pid);
+
+  if (rmid == RMID0) {
+    rmid = mbm_rmid_find_tag(HRP_RDT_TAG_PID, task->tgid);
+  }
+#ifdef CONFIG_CGROUPS
+  if (rmid == RMID0 &&
+      READ_ONCE(g_mbm_mgr.rmid_mgr.n_tags[HRP_RDT_TAG_CGROUP]) != 0) {
+    struct cgroup *cgrp;
+
+    rcu_read_lock();
+    for (cgrp = task_dfl_cgroup(task); cgrp != NULL && rmid == RMID0;
+         cgrp = cgroup_parent(cgrp)) {
+      rmid = mbm_rmid_find_tag(HRP_RDT_TAG_CGROUP, cgroup_id(cgrp));
+    }
+    rcu_read_unlock();
+  }
+#endif
+  return rmid;
+}
+
 /*
  * Initialize RMID management
  */
@@ -166,3 +275,53 @@ void mbm_rmid_deinit(void) {
 
   pr_info("hrperf: RMID manager cleaned up\n");
 }
+
+/*
+ * Read the counters of the RMIDs of the cores of a node and of all tagged
+ * RMIDs back to back, on a CPU of that node: MBM counters of any RMID can be
+ * read from any CPU sharing its L3. Fills up to @max entries of @data and
+ * @core_ids, the core of each RMID or MBM_NO_CORE for tags, and returns their
+ * number, 0 if the caller is not running on the node. Reads that fail keep
+ * their status in @data.
+ */
+int mbm_rmid_poll_node(int node, mbm_counter_data_t *data, u32 *core_ids,
+                       int max) {
+  struct rmid_manager *g_rmid_mgr = &g_mbm_mgr.rmid_mgr;
+  DECLARE_BITMAP(seen, MAX_RMID + 1);
+  int n = 0;
+  int cpu;
+
+  bitmap_zero(seen, MAX_RMID + 1);
+  for (int idx = 0; idx < MAX_CORES && n < max; idx++) {
+    struct rmid_info *info = &g_rmid_mgr->rmid_table[idx];
+    u32 rmid = READ_ONCE(info->rmid);
+    if (!READ_ONCE(info->in_use) || rmid == RMID0 || rmid > MAX_RMID ||
+        cpu_to_node(info->core_id) != node ||
+        __test_and_set_bit(rmid, seen)) {
+      continue;
+    }
+    core_ids[n] = info->core_id;
+    data[n++].rmid = rmid;
+  }
+  for (int i = 0; i < MAX_RMID_TAGS && n < max; i++) {
+    u32 rmid = READ_ONCE(g_rmid_mgr->tags[i].rmid);
+    if (rmid == RMID0 || rmid > MAX_RMID || __test_and_set_bit(rmid, seen)) {
+      continue;
+    }
+    core_ids[n] = MBM_NO_CORE;
+    data[n++].rmid = rmid;
+  }
+
+  // each QM_EVTSEL write and QM_CTR read, and the node of the widened
+  // counts, must be of the same CPU
+  cpu = get_cpu();
+  if (cpu_to_node(cpu) != node) {
+    put_cpu();
+    return 0;
+  }
+  for (int i = 0; i < n; i++) {
+    mbm_read_counters(&data[i]);
+  }
+  put_cpu();
+  return n;
+}
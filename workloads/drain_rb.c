@@ -0,0 +1,177 @@
+/*
+ * Drain the mmap-ed per-CPU ring buffers of hrperf into a file, without the
+ * kernel logger. Requires hrperf compiled with HRP_MMAP_RB and loaded with
+ * kernel_logger=n. The output has the same format as /hrperf_log.bin, a log
+ * header followed by the entries. The marker ring is drained before the CPU
+ * rings so that event selections come before the samples they describe, the
+ * RDT rings of the nodes (HRP_RDT_BATCHED) after them.
+ */
+#include "hrperf_api.h"
+
+#include <signal.h>
+
+#define MAX_CPUS 256
+#define MAX_NODES 64
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_sigint(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+static size_t drain_one(void *rb, volatile u32 *head_p,
+                        const hrp_rb_layout_t *layout, FILE *out) {
+  volatile u32 *tail_p = (volatile u32 *)((char *)rb + layout->tail_offset);
+  u32 head = *head_p;
+  u32 tail = __atomic_load_n(tail_p, __ATOMIC_ACQUIRE);
+  size_t n = 0;
+
+  if (head == tail) {
+    return 0;
+  }
+
+  if (head < tail) {
+    n = tail - head;
+    fwrite((char *)rb + (size_t)head * layout->entry_size, layout->entry_size,
+           n, out);
+  } else {
+    n = layout->n_entries - head;
+    fwrite((char *)rb + (size_t)head * layout->entry_size, layout->entry_size,
+           n, out);
+    fwrite(rb, layout->entry_size, tail, out);
+    n += tail;
+  }
+
+  __atomic_store_n(head_p, tail, __ATOMIC_RELEASE);
+  return n;
+}
+
+int main(int argc, char *argv[]) {
+  const char *out_path = argc > 1 ? argv[1] : "hrperf_log.bin";
+  hrp_rb_layout_t layout;
+  hrp_log_header_t header;
+  void *rbs[MAX_CPUS] = {0};
+  volatile u32 *heads[MAX_CPUS] = {0};
+  void *marker_rb = NULL;
+  volatile u32 *marker_head = NULL;
+  void *rdt_rbs[MAX_NODES] = {0};
+  volatile u32 *rdt_heads[MAX_NODES] = {0};
+  int n_mapped = 0;
+
+  int fd = open_hrperf();
+  if (fd < 0) {
+    perror("open");
+    return 1;
+  }
+
+  if (hrperf_get_rb_layout(fd, &layout) != 0) {
+    fprintf(stderr, "Is hrperf compiled with HRP_MMAP_RB?\n");
+    close(fd);
+    return 1;
+  }
+  if (hrperf_get_log_header(fd, &header) != 0) {
+    close(fd);
+    return 1;
+  }
+  // the rings hold raw entries, whatever the kernel logger writes
+  header.format = HRP_LOG_FORMAT_RAW;
+
+  for (int cpu = 0; cpu < MAX_CPUS && cpu < (int)layout.marker_index; cpu++) {
+    void *rb = hrperf_map_rb(fd, &layout, cpu);
+    if (rb == MAP_FAILED) {
+      continue;
+    }
+    heads[cpu] = hrperf_map_rb_head(fd, &layout, cpu);
+    if (heads[cpu] == NULL) {
+      perror("mmap head");
+      munmap(rb, layout.head_offset);
+      continue;
+    }
+    rbs[cpu] = rb;
+    n_mapped++;
+  }
+  marker_rb = hrperf_map_rb(fd, &layout, layout.marker_index);
+  marker_head = hrperf_map_rb_head(fd, &layout, layout.marker_index);
+  if (marker_rb == MAP_FAILED || marker_head == NULL) {
+    perror("mmap marker ring");
+    if (marker_rb != MAP_FAILED) {
+      munmap(marker_rb, layout.head_offset);
+    }
+    if (marker_head != NULL) {
+      munmap((void *)marker_head, getpagesize());
+    }
+    marker_rb = NULL;
+  }
+  // nodes without CPUs have no RDT ring
+  for (u32 node = 0; node < MAX_NODES && node < layout.n_rdt_nodes; node++) {
+    void *rb = hrperf_map_rb(fd, &layout, layout.rdt_index + node);
+    if (rb == MAP_FAILED) {
+      continue;
+    }
+    rdt_heads[node] = hrperf_map_rb_head(fd, &layout, layout.rdt_index + node);
+    if (rdt_heads[node] == NULL) {
+      perror("mmap RDT head");
+      munmap(rb, layout.head_offset);
+      continue;
+    }
+    rdt_rbs[node] = rb;
+  }
+  printf("Mapped ring buffers of %d CPUs, entry size %u\n", n_mapped,
+         layout.entry_size);
+
+  FILE *out = fopen(out_path, "wb");
+  if (out == NULL) {
+    perror("fopen");
+    close(fd);
+    return 1;
+  }
+  fwrite(&header, sizeof(header), 1, out);
+
+  signal(SIGINT, handle_sigint);
+  size_t total = 0;
+  while (!stop) {
+    size_t drained = 0;
+    if (marker_rb != NULL) {
+      drained += drain_one(marker_rb, marker_head, &layout, out);
+    }
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+      if (rbs[cpu] != NULL) {
+        drained += drain_one(rbs[cpu], heads[cpu], &layout, out);
+      }
+    }
+    for (int node = 0; node < MAX_NODES; node++) {
+      if (rdt_rbs[node] != NULL) {
+        drained += drain_one(rdt_rbs[node], rdt_heads[node], &layout, out);
+      }
+    }
+    total += drained;
+    if (drained == 0) {
+      usleep(1000);
+    }
+  }
+
+  if (marker_rb != NULL) {
+    total += drain_one(marker_rb, marker_head, &layout, out);
+    munmap(marker_rb, layout.head_offset);
+    munmap((void *)marker_head, getpagesize());
+  }
+  for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+    if (rbs[cpu] != NULL) {
+      total += drain_one(rbs[cpu], heads[cpu], &layout, out);
+      munmap(rbs[cpu], layout.head_offset);
+      munmap((void *)heads[cpu], getpagesize());
+    }
+  }
+  for (int node = 0; node < MAX_NODES; node++) {
+    if (rdt_rbs[node] != NULL) {
+      total += drain_one(rdt_rbs[node], rdt_heads[node], &layout, out);
+      munmap(rdt_rbs[node], layout.head_offset);
+      munmap((void *)rdt_heads[node], getpagesize());
+    }
+  }
+  fclose(out);
+  close(fd);
+  printf("Drained %zu entries into %s\n", total, out_path);
+  return 0;
+}
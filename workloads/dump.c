@@ -0,0 +1,5 @@
+#include "hrperf_api.h"
+
+int main() {
+    return hrperf_dump();
+}
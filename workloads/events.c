@@ -0,0 +1,125 @@
+/*
+ * Show or reprogram the events on hrperf's general-purpose counters.
+ * Without arguments, prints the current selection. Otherwise takes one
+ * <evtsel>:<offcore_rsp>:<name_id> triple per counter, starting from PMC0,
+ * values can be given in hex with a 0x prefix. Counters without a triple are
+ * disabled. hrperf must be paused.
+ * With HRP_USE_MULTIPLEXING, several groups separated by "/" can be given, and
+ * -k sets the number of samples taken with each group before switching.
+ */
+#include "hrperf_api.h"
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void print_usage(const char *program_name) {
+  printf("Usage: %s [-k <rotate_samples>] [<evtsel>:<offcore_rsp>:<name_id> "
+         "... [/ <group 1 events> ...]]\n",
+         program_name);
+  printf("  e.g. %s 0x43412e:0:1 0x430f40:0:2 0x144314a3:0:3\n", program_name);
+  printf("  -k <rotate_samples> : samples per group when multiplexing\n");
+  printf("  -h                  : Show this help message\n");
+}
+
+static int parse_event(const char *arg, hrp_event_sel_t *ev) {
+  unsigned long long evtsel, offcore_rsp;
+  unsigned int name_id;
+
+  if (sscanf(arg, "%lli:%lli:%i", &evtsel, &offcore_rsp, &name_id) != 3) {
+    return 1;
+  }
+  ev->evtsel = evtsel;
+  ev->offcore_rsp = offcore_rsp;
+  ev->name_id = name_id;
+  ev->reserved = 0;
+  return 0;
+}
+
+static void print_group(const hrp_event_config_t *config) {
+  for (int i = 0; i < HRP_NUM_GP_EVENTS; i++) {
+    if (config->events[i].evtsel == 0) {
+      continue;
+    }
+    printf("  PMC%d: evtsel 0x%llx offcore_rsp 0x%llx name_id %u\n", i,
+           (unsigned long long)config->events[i].evtsel,
+           (unsigned long long)config->events[i].offcore_rsp,
+           config->events[i].name_id);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  hrp_event_groups_t groups = {0};
+  int opt;
+
+  while ((opt = getopt(argc, argv, "k:h")) != -1) {
+    switch (opt) {
+    case 'k':
+      groups.rotate_samples = (u32)strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind == argc) {
+    if (hrperf_get_groups(&groups) == 0) {
+      printf("%u groups, switching every %u samples\n", groups.n_groups,
+             groups.rotate_samples);
+      for (u32 g = 0; g < groups.n_groups; g++) {
+        printf("Group %u:\n", g);
+        print_group(&groups.groups[g]);
+      }
+      return 0;
+    }
+    if (hrperf_get_events(&groups.groups[0]) != 0) {
+      return 1;
+    }
+    print_group(&groups.groups[0]);
+    return 0;
+  }
+
+  int pmc = 0;
+  groups.n_groups = 1;
+  for (int i = optind; i < argc; i++) {
+    if (strcmp(argv[i], "/") == 0) {
+      if (groups.n_groups == HRP_MUX_MAX_GROUPS) {
+        fprintf(stderr, "Error: At most %d groups\n", HRP_MUX_MAX_GROUPS);
+        return 1;
+      }
+      groups.n_groups++;
+      pmc = 0;
+      continue;
+    }
+    if (pmc == HRP_NUM_GP_EVENTS) {
+      fprintf(stderr, "Error: At most %d events per group\n",
+              HRP_NUM_GP_EVENTS);
+      return 1;
+    }
+    hrp_event_config_t *config = &groups.groups[groups.n_groups - 1];
+    if (parse_event(argv[i], &config->events[pmc++]) != 0) {
+      fprintf(stderr, "Error: Cannot parse event '%s'\n", argv[i]);
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (groups.n_groups == 1 && groups.rotate_samples == 0) {
+    if (hrperf_set_events(&groups.groups[0]) != 0) {
+      fprintf(stderr, "Error: Failed to set events. Is hrperf paused?\n");
+      return 1;
+    }
+  } else if (hrperf_set_groups(&groups) != 0) {
+    fprintf(stderr, "Error: Failed to set event groups. Is hrperf paused and "
+                    "compiled with HRP_USE_MULTIPLEXING?\n");
+    return 1;
+  }
+
+  printf("Successfully reprogrammed %u event group(s)\n", groups.n_groups);
+  return 0;
+}
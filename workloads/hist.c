@@ -0,0 +1,91 @@
+/*
+ * Print the per-CPU histograms of hrperf's histogram mode (histograms=1):
+ * bandwidth, IPC and stall rate of the sampling windows, in log2 buckets.
+ * For each bucket, "at_or_above" is the share of the windows whose value is at
+ * least the start of the bucket, e.g. how often a core exceeded 4 GB/s.
+ *
+ * Usage: hist [cpu]    print all sampled CPUs, or one
+ *        hist reset    clear the histograms, while paused
+ */
+#include "hrperf_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *metric_names[HRP_HIST_N_METRICS] = {
+    [HRP_HIST_BANDWIDTH] = "bandwidth (MB/s)",
+    [HRP_HIST_IPC] = "IPC (1/1000)",
+    [HRP_HIST_STALL] = "stall cycles per cycle (1/1000)",
+};
+
+static void print_hist(const hrp_hist_t *hist) {
+  printf("cpu %u: %llu windows\n", hist->cpu,
+         (unsigned long long)hist->windows);
+  for (int m = 0; m < HRP_HIST_N_METRICS; m++) {
+    const u64 *buckets = hist->buckets[m];
+    u64 total = 0;
+    for (int b = 0; b < HRP_HIST_BUCKETS; b++) {
+      total += buckets[b];
+    }
+    if (total == 0) {
+      continue;
+    }
+    printf("  %s\n", metric_names[m]);
+    printf("    %-24s %14s %12s\n", "range", "windows", "at_or_above");
+    u64 above = total;
+    for (int b = 0; b < HRP_HIST_BUCKETS; b++) {
+      if (buckets[b] != 0) {
+        char range[48];
+        if (b == 0) {
+          snprintf(range, sizeof(range), "0");
+        } else {
+          snprintf(range, sizeof(range), "[%llu, %llu)", 1ULL << (b - 1),
+                   1ULL << b);
+        }
+        printf("    %-24s %14llu %11.2f%%\n", range,
+               (unsigned long long)buckets[b], 100.0 * above / total);
+      }
+      above -= buckets[b];
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+    return hrperf_reset_hist();
+  }
+
+  int fd = open_hrperf();
+  if (fd < 0) {
+    perror("open");
+    return 1;
+  }
+  hrp_hist_t *hist = malloc(sizeof(*hist));
+  if (hist == NULL) {
+    close(fd);
+    return 1;
+  }
+
+  int first = 0, last = HRP_PMC_CPU_SELECTION_MASK_BITS - 1;
+  if (argc > 1) {
+    first = last = atoi(argv[1]);
+  }
+  int ret = 0;
+  for (int cpu = first; cpu <= last; cpu++) {
+    hist->cpu = cpu;
+    if (hrperf_get_hist(fd, hist) != 0) {
+      ret = 1;
+      break;
+    }
+    if (hist->valid) {
+      print_hist(hist);
+    } else if (argc > 1) {
+      fprintf(stderr, "CPU %d is not sampled\n", cpu);
+      ret = 1;
+    }
+  }
+
+  free(hist);
+  close(fd);
+  return ret;
+}
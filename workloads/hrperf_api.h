@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #define u64 uint64_t
@@ -15,6 +16,180 @@ typedef struct {
     u32 core_id;    // Core ID to set RMID on
 } rmid_set_info_t;
 
+// kinds of RMID tags, see HRP_PMC_IOC_RDT_TAG
+#define HRP_RDT_TAG_TID 0
+#define HRP_RDT_TAG_PID 1
+#define HRP_RDT_TAG_CGROUP 2    // id: the inode number of its cgroup2 directory
+#define HRP_RDT_N_TAG_KINDS 3
+typedef struct {
+    u32 kind;       // HRP_RDT_TAG_*
+    u32 rmid;       // RMID to tag with, 0 removes the tag
+    u64 id;         // tid, pid or cgroup id
+} rmid_tag_info_t;
+
+typedef struct {
+    u64 mmap_size;      // bytes per CPU, CPU n is mapped at offset n * mmap_size
+    u32 n_entries;      // capacity of the ring, in entries
+    u32 entry_size;     // size of one log entry
+    u32 head_offset;    // offset of the page of the u32 head index, the
+                        // consumer's, mapped on its own and writable
+    u32 tail_offset;    // offset of the u32 tail index (producer owned), the
+                        // entries and the tail are mapped read-only
+    u32 marker_index;   // the marker ring is mapped as this CPU index,
+                        // nr_cpu_ids
+    u32 rdt_index;      // the RDT ring of node n is mapped as CPU index
+                        // rdt_index + n, for n < n_rdt_nodes
+    u32 n_rdt_nodes;    // 0 without HRP_RDT_BATCHED, some nodes may have none
+} hrp_rb_layout_t;
+
+// maximum number of general-purpose counters an event selection describes
+#define HRP_NUM_GP_EVENTS 8
+
+#define HRP_EVENT_ID_NONE 0
+#define HRP_EVENT_ID_LLC_MISSES 1
+#define HRP_EVENT_ID_SW_PREFETCH 2
+#define HRP_EVENT_ID_STALLS_MEM 3
+#define HRP_EVENT_ID_OCR_READS 4
+#define HRP_EVENT_ID_OCR_WRITES 5
+#define HRP_EVENT_ID_OCR_WRITE_EST 6
+
+typedef struct {
+    u64 evtsel;         // raw IA32_PERFEVTSELx value, including the enable bits
+    u64 offcore_rsp;    // OFFCORE_RSP value for offcore events, 0 otherwise
+    u32 name_id;        // one of HRP_EVENT_ID_*
+    u32 reserved;
+} hrp_event_sel_t;
+
+// events[i] is programmed on PMCi, a zero evtsel leaves the counter disabled
+typedef struct {
+    hrp_event_sel_t events[HRP_NUM_GP_EVENTS];
+} hrp_event_config_t;
+
+#define HRP_MUX_MAX_GROUPS 4
+
+// event groups multiplexed on the general-purpose counters
+typedef struct {
+    u32 n_groups;       // number of valid entries in groups
+    u32 rotate_samples; // samples per group before switching, 0 to keep
+    hrp_event_config_t groups[HRP_MUX_MAX_GROUPS];
+} hrp_event_groups_t;
+
+#define HRP_PMC_CPU_SELECTION_MASK_BITS 256
+
+// header at the start of the log file, see src/config.h
+#define HRP_LOG_HEADER_MAGIC "HRPERFLG"
+#define HRP_LOG_HEADER_VERSION 2
+#define HRP_LOG_MAX_FIELDS 64
+#define HRP_LOG_FIELD_NAME_LEN 24
+
+#define HRP_LOG_CLOCK_REAL 0
+#define HRP_LOG_CLOCK_RAW 1
+#define HRP_LOG_CLOCK_TSC 2
+
+#define HRP_LOG_FORMAT_RAW 0
+#define HRP_LOG_FORMAT_COMPACT 1
+
+typedef struct {
+    char name[HRP_LOG_FIELD_NAME_LEN]; // column name used by the parsers
+    u32 offset;         // from the start of the entry
+    u32 size;           // 4 for cpu_id, 8 for the counters
+} hrp_log_field_t;
+
+typedef struct {
+    char magic[8];      // HRP_LOG_HEADER_MAGIC, not NUL-terminated
+    u32 version;        // HRP_LOG_HEADER_VERSION
+    u32 header_size;    // the entries start at this file offset
+    u32 entry_size;     // size of one log entry
+    u32 n_fields;       // valid entries in fields
+    u32 max_fields;     // HRP_LOG_MAX_FIELDS
+    u32 cpu_mask_words; // length of cpu_mask
+    u32 max_groups;     // HRP_MUX_MAX_GROUPS
+    u32 n_gp_events;    // HRP_NUM_GP_EVENTS
+    u32 clock;          // one of HRP_LOG_CLOCK_*
+    u32 sampling_mode;  // sampling_mode module parameter, or -1 for instructed profile
+    u32 sampling_period; // poll or hrtimer interval in us, or overflow events
+    u32 format;         // HRP_LOG_FORMAT_*
+    u64 tsc_khz;        // TSC frequency
+    u64 rdt_scale;      // bytes per RDT counter unit, 0 without RDT
+    u64 start_walltime_ns; // CLOCK_REALTIME when the header was made
+    u64 start_kts;      // log clock at the same time
+    hrp_log_field_t fields[HRP_LOG_MAX_FIELDS];
+    u64 cpu_mask[HRP_PMC_CPU_SELECTION_MASK_BITS / 64]; // monitored CPUs
+    hrp_event_groups_t events; // programmed events
+} hrp_log_header_t;
+
+// statistics of one ring buffer
+typedef struct {
+    u64 produced;       // entries enqueued, including the dropped ones
+    u64 dropped;        // entries lost because the ring was full
+    u64 logged_bytes;   // bytes written to the log file by the kernel logger
+    u32 max_occupancy;  // most entries ever waiting in the ring
+    u32 valid;          // 1 if the CPU has a ring buffer
+} hrp_rb_stats_t;
+
+// statistics of the sampling pipeline, durations are in ns
+typedef struct {
+    u64 poll_rounds;    // IPI poll rounds, including instructed polls
+    u64 poll_ns_total;
+    u64 poll_ns_max;
+    u64 log_passes;     // passes of the kernel logger over all rings
+    u64 log_ns_total;
+    u64 log_ns_max;
+    hrp_rb_stats_t marker;
+    hrp_rb_stats_t rdt; // the RDT rings of all nodes, with HRP_RDT_BATCHED
+    hrp_rb_stats_t cpus[HRP_PMC_CPU_SELECTION_MASK_BITS]; // indexed by CPU id
+} hrp_stats_t;
+
+// log2 histograms of one CPU's sampling windows, see HRP_PMC_IOC_GET_HIST.
+// Bucket 0 counts the windows with a value of 0, bucket i > 0 those with a
+// value in [2^(i-1), 2^i).
+#define HRP_HIST_BUCKETS 64
+#define HRP_HIST_BANDWIDTH 0    // PMC0 + PMC1 lines, in MB/s
+#define HRP_HIST_IPC 1          // instructions per cycle, in 1/1000
+#define HRP_HIST_STALL 2        // PMC2 stall cycles per cycle, in 1/1000
+#define HRP_HIST_N_METRICS 3
+typedef struct {
+    u32 cpu;            // in: the CPU to read
+    u32 valid;          // out: 1 if the CPU is sampled
+    u64 windows;        // out: windows counted, halted windows have no IPC
+    u64 buckets[HRP_HIST_N_METRICS][HRP_HIST_BUCKETS];
+} hrp_hist_t;
+
+// totals of one thread's counters over the time it ran, see
+// HRP_PMC_IOC_TASK_COUNTERS
+typedef struct {
+    u32 tid;            // in: the thread to read
+    u32 valid;          // out: 1 if the thread has run on a selected CPU
+    u64 runs;           // times it was switched out
+    u64 run_kts;        // log clock time it ran
+    u64 stall_mem;      // PMC2
+    u64 inst_retire;
+    u64 cpu_unhalt;
+    u64 llc_misses;     // PMC0, offcore reads with HRP_USE_OFFCORE
+    u64 sw_prefetch;    // PMC1, offcore writes with HRP_USE_OFFCORE
+} hrp_task_counters_t;
+
+// a synchronous read of the counters of some CPUs, see HRP_PMC_IOC_SNAPSHOT.
+// The entries have the layout of the log entries, entry_size bytes each as
+// described by the log header, and are written by increasing CPU id.
+typedef struct {
+    u64 cpu_mask[HRP_PMC_CPU_SELECTION_MASK_BITS / 64]; // in: CPUs to read
+    u64 entries;        // in: user address of the buffer for the entries
+    u32 max_entries;    // in: entries the buffer holds
+    u32 n_entries;      // out: entries written, one per sampled CPU asked for
+} hrp_snapshot_t;
+
+// an instructed poll of some sampled CPUs only, see
+// HRP_PMC_IOC_INSTRUCTED_POLL_CPUS. With HRP_POLL_CPUS_SELF the mask is ignored
+// and the CPU running the ioctl polls itself, without an IPI.
+#define HRP_POLL_CPUS_SELF 0x1
+#define HRP_POLL_CPUS_LOG  0x2 // log afterwards, like INSTRUCTED_POLL_AND_LOG
+typedef struct {
+    u64 cpu_mask[HRP_PMC_CPU_SELECTION_MASK_BITS / 64]; // in: CPUs to poll
+    u32 flags;          // in: HRP_POLL_CPUS_*
+    u32 n_polled;       // out: sampled CPUs polled
+} hrp_poll_cpus_t;
+
 #define HRP_PMC_IOC_MAGIC 'k'
 #define HRP_PMC_IOC_START                   _IO(HRP_PMC_IOC_MAGIC, 1)
 #define HRP_IOC_STOP                        _IO(HRP_PMC_IOC_MAGIC, 2)
@@ -25,6 +200,20 @@ typedef struct {
 #define HRP_PMC_IOC_TSC_FREQ                _IOR(HRP_PMC_IOC_MAGIC, 10, u64)
 #define HRP_PMC_IOC_RDT_SCALE_FACTOR        _IOR(HRP_PMC_IOC_MAGIC, 11, u32)
 #define HRP_PMC_IOC_RDT_MAX_RMID            _IOR(HRP_PMC_IOC_MAGIC, 12, u32)
+#define HRP_PMC_IOC_RB_LAYOUT               _IOR(HRP_PMC_IOC_MAGIC, 13, hrp_rb_layout_t)
+#define HRP_PMC_IOC_SET_EVENTS              _IOW(HRP_PMC_IOC_MAGIC, 14, hrp_event_config_t)
+#define HRP_PMC_IOC_GET_EVENTS              _IOR(HRP_PMC_IOC_MAGIC, 15, hrp_event_config_t)
+#define HRP_PMC_IOC_SET_GROUPS              _IOW(HRP_PMC_IOC_MAGIC, 16, hrp_event_groups_t)
+#define HRP_PMC_IOC_GET_GROUPS              _IOR(HRP_PMC_IOC_MAGIC, 17, hrp_event_groups_t)
+#define HRP_PMC_IOC_LOG_HEADER              _IOR(HRP_PMC_IOC_MAGIC, 18, hrp_log_header_t)
+#define HRP_PMC_IOC_GET_STATS               _IOR(HRP_PMC_IOC_MAGIC, 19, hrp_stats_t)
+#define HRP_PMC_IOC_DUMP                    _IO(HRP_PMC_IOC_MAGIC, 20)
+#define HRP_PMC_IOC_GET_HIST                _IOWR(HRP_PMC_IOC_MAGIC, 21, hrp_hist_t)
+#define HRP_PMC_IOC_RESET_HIST              _IO(HRP_PMC_IOC_MAGIC, 22)
+#define HRP_PMC_IOC_TASK_COUNTERS           _IOWR(HRP_PMC_IOC_MAGIC, 23, hrp_task_counters_t)
+#define HRP_PMC_IOC_RDT_TAG                 _IOW(HRP_PMC_IOC_MAGIC, 24, rmid_tag_info_t)
+#define HRP_PMC_IOC_SNAPSHOT                _IOWR(HRP_PMC_IOC_MAGIC, 25, hrp_snapshot_t)
+#define HRP_PMC_IOC_INSTRUCTED_POLL_CPUS    _IOWR(HRP_PMC_IOC_MAGIC, 26, hrp_poll_cpus_t)
 
 const char *HRP_PMC_DEVICE_NAME = "/dev/hrperf_device";
 
@@ -121,6 +310,29 @@ static inline int hrperf_set_rmid(u32 core_id, u32 rmid) {
     return 0;
 }
 
+/*
+ * Tag a thread, process or cgroup (HRP_RDT_TAG_*) with an RMID, 0 removes the
+ * tag. Only available if hrperf is compiled with HRP_RDT_TAGS.
+*/
+static inline int hrperf_rdt_tag(u32 kind, u64 id, u32 rmid) {
+    int fd = open_hrperf();
+    rmid_tag_info_t tag = { .kind = kind, .rmid = rmid, .id = id };
+
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_RDT_TAG, &tag) < 0) {
+        perror("ioctl");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
+
 /*
  * Get RDT Scaling Factor
  */
@@ -212,6 +424,254 @@ static inline void hrperf_instruct_poll_and_log() {
     close(fd);
 }
 
+/*
+ * Get the layout of the mmap-able per-CPU ring buffers.
+ * Only available if hrperf is compiled with HRP_MMAP_RB.
+*/
+static inline int hrperf_get_rb_layout(int fd, hrp_rb_layout_t *layout) {
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_RB_LAYOUT, layout) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Get the header that starts a log file, describing the entry layout and the
+ * current setup. Consumers writing their own logs should write it first.
+*/
+static inline int hrperf_get_log_header(int fd, hrp_log_header_t *header) {
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_LOG_HEADER, header) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Map the entries and the tail index of one CPU's ring buffer, read-only,
+ * head_offset bytes. Returns MAP_FAILED if the CPU is not monitored by hrperf.
+*/
+static inline void *hrperf_map_rb(int fd, const hrp_rb_layout_t *layout,
+                                  int cpu) {
+    return mmap(NULL, layout->head_offset, PROT_READ, MAP_SHARED, fd,
+                (off_t)cpu * layout->mmap_size);
+}
+
+/*
+ * Map the page of the head index of one CPU's ring buffer, which the consumer
+ * advances. Unmap it with munmap(head, getpagesize()).
+*/
+static inline volatile u32 *hrperf_map_rb_head(int fd,
+                                               const hrp_rb_layout_t *layout,
+                                               int cpu) {
+    void *page = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, (off_t)cpu * layout->mmap_size + layout->head_offset);
+    return page == MAP_FAILED ? NULL : (volatile u32 *)page;
+}
+
+/*
+ * Get the events programmed on the general-purpose counters.
+*/
+static inline int hrperf_get_events(hrp_event_config_t *config) {
+    int fd = open_hrperf();
+
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_GET_EVENTS, config) < 0) {
+        perror("ioctl");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Reprogram the general-purpose counters, hrperf must be paused.
+ * The new selection is recorded in the log, so one log can span several
+ * event sets.
+*/
+static inline int hrperf_set_events(const hrp_event_config_t *config) {
+    int fd = open_hrperf();
+
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_SET_EVENTS, (void *)config) < 0) {
+        perror("ioctl");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Set the event groups multiplexed on the general-purpose counters,
+ * hrperf must be paused. Only available if hrperf is compiled with
+ * HRP_USE_MULTIPLEXING.
+*/
+static inline int hrperf_set_groups(const hrp_event_groups_t *groups) {
+    int fd = open_hrperf();
+
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_SET_GROUPS, (void *)groups) < 0) {
+        perror("ioctl");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Get the multiplexed event groups, fails with ENOTTY if hrperf is not
+ * compiled with HRP_USE_MULTIPLEXING.
+*/
+static inline int hrperf_get_groups(hrp_event_groups_t *groups) {
+    int fd = open_hrperf();
+
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    int ret = hrperf_ioctl(fd, HRP_PMC_IOC_GET_GROUPS, groups) < 0;
+    close(fd);
+    return ret;
+}
+
+/*
+ * Get the per-CPU sample, drop and log counts and the poller/logger timings.
+*/
+static inline int hrperf_get_stats(hrp_stats_t *stats) {
+    int fd = open_hrperf();
+
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_GET_STATS, stats) < 0) {
+        perror("ioctl");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+// Write the flight recorder's history to the log, needs flight_recorder=1
+static inline int hrperf_dump() {
+    int fd = open_hrperf();
+
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_DUMP, NULL) < 0) {
+        perror("ioctl");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Get the histograms of hist->cpu, needs histograms=1. hist->valid is 0 if the
+ * CPU is not sampled.
+*/
+static inline int hrperf_get_hist(int fd, hrp_hist_t *hist) {
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_GET_HIST, hist) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+    return 0;
+}
+
+// Clear the histograms of all CPUs, only while paused
+static inline int hrperf_reset_hist() {
+    int fd = open_hrperf();
+
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_RESET_HIST, NULL) < 0) {
+        perror("ioctl");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Get the counter totals of the thread tc->tid, e.g. gettid() for the caller,
+ * whose totals include its current run. Needs HRP_TASK_COUNTERS.
+*/
+static inline int hrperf_get_task_counters(int fd, hrp_task_counters_t *tc) {
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_TASK_COUNTERS, tc) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Read the counters of the sampled CPUs in snap->cpu_mask now and copy them to
+ * snap->entries, in the layout given by hrperf_get_log_header. Needs the
+ * instructed profile mode. Takes a few microseconds, e.g. to difference two
+ * snapshots around a region of a benchmark.
+*/
+static inline int hrperf_snapshot(int fd, hrp_snapshot_t *snap) {
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_SNAPSHOT, snap) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Instruct the hiresperf to poll only the sampled CPUs in req->cpu_mask, or
+ * with HRP_POLL_CPUS_SELF only the calling CPU, which needs no IPI. The other
+ * sampled CPUs are not interrupted and get no log entry for this poll.
+*/
+static inline int hrperf_instruct_poll_cpus(int fd, hrp_poll_cpus_t *req) {
+    if (hrperf_ioctl(fd, HRP_PMC_IOC_INSTRUCTED_POLL_CPUS, req) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Poll the CPU the caller runs on, e.g. at the start and end of a request.
+*/
+static inline int hrperf_instruct_poll_self(int fd) {
+    hrp_poll_cpus_t req = {.flags = HRP_POLL_CPUS_SELF};
+    return hrperf_instruct_poll_cpus(fd, &req);
+}
+
 // for the bpf component
 int hrp_bpf_start();
 void hrp_bpf_stop();
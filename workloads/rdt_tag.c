@@ -0,0 +1,75 @@
+#include "hrperf_api.h"
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+void print_usage(const char *program_name) {
+  printf("Usage: %s -r <rmid> (-t <tid> | -p <pid> | -g <cgroup_dir>)\n",
+         program_name);
+  printf("  -r <rmid>       : RMID, 0 removes the tag\n");
+  printf("  -t <tid>        : thread to tag\n");
+  printf("  -p <pid>        : process to tag\n");
+  printf("  -g <cgroup_dir> : cgroup2 directory to tag, e.g. "
+         "/sys/fs/cgroup/tenant\n");
+  printf("  -h              : Show this help message\n");
+}
+
+int main(int argc, char *argv[]) {
+  u32 rmid = 0;
+  u32 kind = 0;
+  u64 id = 0;
+  int rmid_set = 0;
+  int target_set = 0;
+  struct stat st;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r:t:p:g:h")) != -1) {
+    switch (opt) {
+    case 'r':
+      rmid = (u32)strtoul(optarg, NULL, 10);
+      rmid_set = 1;
+      break;
+    case 't':
+    case 'p':
+      kind = opt == 't' ? HRP_RDT_TAG_TID : HRP_RDT_TAG_PID;
+      id = strtoull(optarg, NULL, 10);
+      target_set++;
+      break;
+    case 'g':
+      // the id of a cgroup2 cgroup is the inode number of its directory
+      if (stat(optarg, &st) != 0) {
+        perror(optarg);
+        return 1;
+      }
+      kind = HRP_RDT_TAG_CGROUP;
+      id = st.st_ino;
+      target_set++;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!rmid_set || target_set != 1) {
+    fprintf(stderr, "Error: -r (rmid) and one of -t, -p or -g are required.\n");
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  if (hrperf_rdt_tag(kind, id, rmid) != 0) {
+    fprintf(stderr,
+            "Error: Failed to tag %llu with RMID %u. Is hrperf compiled with "
+            "HRP_RDT_TAGS?\n",
+            (unsigned long long)id, rmid);
+    return 1;
+  }
+
+  printf("Tagged %llu with RMID %u\n", (unsigned long long)id, rmid);
+  return 0;
+}
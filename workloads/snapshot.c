@@ -0,0 +1,126 @@
+/*
+ * Run a command between two snapshots of hrperf's counters and print what each
+ * CPU counted meanwhile (HRP_PMC_IOC_SNAPSHOT, instructed profile mode only).
+ * The entries are decoded with the field table of the log header.
+ *
+ * Usage: snapshot [-c cpu]... command [args]    all sampled CPUs by default
+ */
+#include "hrperf_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+static u64 field_value(const char *entry, const hrp_log_field_t *field) {
+  if (field->size == 4) {
+    u32 v;
+    memcpy(&v, entry + field->offset, sizeof(v));
+    return v;
+  }
+  u64 v;
+  memcpy(&v, entry + field->offset, sizeof(v));
+  return v;
+}
+
+static const hrp_log_field_t *find_field(const hrp_log_header_t *header,
+                                         const char *name) {
+  for (u32 i = 0; i < header->n_fields; i++) {
+    if (strcmp(header->fields[i].name, name) == 0) {
+      return &header->fields[i];
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  hrp_snapshot_t before, after;
+  hrp_log_header_t *header = malloc(sizeof(*header));
+  int opt;
+
+  memset(&before, 0, sizeof(before));
+  while ((opt = getopt(argc, argv, "+c:")) != -1) {
+    if (opt == 'c') {
+      int cpu = atoi(optarg);
+      if (cpu >= 0 && cpu < HRP_PMC_CPU_SELECTION_MASK_BITS) {
+        before.cpu_mask[cpu / 64] |= 1ULL << (cpu % 64);
+      }
+    } else {
+      fprintf(stderr, "Usage: %s [-c cpu]... command [args]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc || header == NULL) {
+    fprintf(stderr, "Usage: %s [-c cpu]... command [args]\n", argv[0]);
+    return 1;
+  }
+
+  int fd = open_hrperf();
+  if (fd < 0) {
+    perror("open");
+    return 1;
+  }
+  if (hrperf_get_log_header(fd, header) != 0) {
+    close(fd);
+    return 1;
+  }
+  int any = 0;
+  for (int w = 0; w < HRP_PMC_CPU_SELECTION_MASK_BITS / 64; w++) {
+    any |= before.cpu_mask[w] != 0;
+  }
+  if (!any) {
+    memcpy(before.cpu_mask, header->cpu_mask, sizeof(before.cpu_mask));
+  }
+
+  size_t size = (size_t)header->entry_size * HRP_PMC_CPU_SELECTION_MASK_BITS;
+  char *entries0 = malloc(size), *entries1 = malloc(size);
+  if (entries0 == NULL || entries1 == NULL) {
+    close(fd);
+    return 1;
+  }
+  before.entries = (u64)(uintptr_t)entries0;
+  before.max_entries = HRP_PMC_CPU_SELECTION_MASK_BITS;
+  after = before;
+  after.entries = (u64)(uintptr_t)entries1;
+
+  if (hrperf_snapshot(fd, &before) != 0) {
+    close(fd);
+    return 1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    execvp(argv[optind], &argv[optind]);
+    perror("execvp");
+    _exit(127);
+  }
+  int status = 0;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+    perror("fork");
+  }
+  if (hrperf_snapshot(fd, &after) != 0 || after.n_entries != before.n_entries) {
+    close(fd);
+    return 1;
+  }
+
+  const hrp_log_field_t *cpu_id = find_field(header, "cpu_id");
+  for (u32 i = 0; i < after.n_entries; i++) {
+    const char *e0 = entries0 + (size_t)i * header->entry_size;
+    const char *e1 = entries1 + (size_t)i * header->entry_size;
+    printf("cpu %d:", (int)field_value(e1, cpu_id));
+    for (u32 f = 0; f < header->n_fields; f++) {
+      const hrp_log_field_t *field = &header->fields[f];
+      if (field->size != 8) {
+        continue;
+      }
+      printf(" %s=%llu", field->name,
+             (unsigned long long)(field_value(e1, field) -
+                                  field_value(e0, field)));
+    }
+    printf("\n");
+  }
+
+  free(entries0);
+  free(entries1);
+  free(header);
+  close(fd);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
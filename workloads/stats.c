@@ -0,0 +1,53 @@
+/*
+ * Print the statistics of hrperf's sampling pipeline: per-CPU samples
+ * produced and dropped, bytes logged and the highest ring occupancy, plus the
+ * poll round and logger pass durations. The same numbers are in
+ * /sys/kernel/debug/hrperf/stats.
+ */
+#include "hrperf_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void print_rb(const char *name, const hrp_rb_stats_t *rb) {
+  printf("%-6s %14llu %14llu %16llu %10u\n", name,
+         (unsigned long long)rb->produced, (unsigned long long)rb->dropped,
+         (unsigned long long)rb->logged_bytes, rb->max_occupancy);
+}
+
+int main(void) {
+  hrp_stats_t *stats = malloc(sizeof(*stats));
+  if (stats == NULL || hrperf_get_stats(stats) != 0) {
+    free(stats);
+    return 1;
+  }
+
+  printf("poll rounds %llu, avg %llu ns, max %llu ns\n",
+         (unsigned long long)stats->poll_rounds,
+         (unsigned long long)(stats->poll_rounds
+                                  ? stats->poll_ns_total / stats->poll_rounds
+                                  : 0),
+         (unsigned long long)stats->poll_ns_max);
+  printf("logger passes %llu, avg %llu ns, max %llu ns\n",
+         (unsigned long long)stats->log_passes,
+         (unsigned long long)(stats->log_passes
+                                  ? stats->log_ns_total / stats->log_passes
+                                  : 0),
+         (unsigned long long)stats->log_ns_max);
+
+  printf("%-6s %14s %14s %16s %10s\n", "cpu", "produced", "dropped",
+         "logged_bytes", "max_occ");
+  print_rb("marker", &stats->marker);
+  if (stats->rdt.valid) {
+    print_rb("rdt", &stats->rdt);
+  }
+  for (int cpu = 0; cpu < HRP_PMC_CPU_SELECTION_MASK_BITS; cpu++) {
+    if (stats->cpus[cpu].valid) {
+      char name[8];
+      snprintf(name, sizeof(name), "%d", cpu);
+      print_rb(name, &stats->cpus[cpu]);
+    }
+  }
+
+  free(stats);
+  return 0;
+}
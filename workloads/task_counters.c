@@ -0,0 +1,54 @@
+/*
+ * Print the counter totals of threads over the time they ran on the selected
+ * CPUs, kept by hrperf built with HRP_TASK_COUNTERS. Without arguments, prints
+ * its own totals, which include the current run.
+ *
+ * Usage: task_counters [tid...]
+ */
+#include "hrperf_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void print_header(void) {
+  printf("%-8s %10s %14s %16s %16s %16s %16s %16s\n", "tid", "runs",
+         "run_kts", "inst_retire", "cpu_unhalt", "stall_mem", "llc_misses",
+         "sw_prefetch");
+}
+
+static void print_task(const hrp_task_counters_t *tc) {
+  printf("%-8u %10llu %14llu %16llu %16llu %16llu %16llu %16llu\n", tc->tid,
+         (unsigned long long)tc->runs, (unsigned long long)tc->run_kts,
+         (unsigned long long)tc->inst_retire,
+         (unsigned long long)tc->cpu_unhalt,
+         (unsigned long long)tc->stall_mem,
+         (unsigned long long)tc->llc_misses,
+         (unsigned long long)tc->sw_prefetch);
+}
+
+int main(int argc, char **argv) {
+  int fd = open_hrperf();
+  if (fd < 0) {
+    perror("open");
+    return 1;
+  }
+
+  int ret = 0;
+  print_header();
+  for (int i = 1; i < argc || (argc == 1 && i == 1); i++) {
+    hrp_task_counters_t tc = {0};
+    tc.tid = argc > 1 ? (u32)atoi(argv[i]) : (u32)gettid();
+    if (hrperf_get_task_counters(fd, &tc) != 0) {
+      ret = 1;
+      break;
+    }
+    if (tc.valid) {
+      print_task(&tc);
+    } else {
+      fprintf(stderr, "thread %u has not run on a selected CPU\n", tc.tid);
+      ret = 1;
+    }
+  }
+
+  close(fd);
+  return ret;
+}